@@ -0,0 +1,24 @@
+#include <stdint.h>
+#include "arena.h"
+
+void arena_init(arena_t *arena, void *memory, size_t size) {
+    arena->base = memory;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    //align the address itself, the block may not start on a boundary
+    uintptr_t next = (uintptr_t)(arena->base + arena->used);
+    size_t pad = (ARENA_ALIGN - next % ARENA_ALIGN) % ARENA_ALIGN;
+    size_t start = arena->used + pad;
+    if (start > arena->size || size > arena->size - start) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+void arena_reset(arena_t *arena) {
+    arena->used = 0;
+}
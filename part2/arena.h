@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 16
+
+// Bump allocator over a fixed block of memory. Allocations are never freed
+// individually; the whole arena is reset once the request is done.
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+/*
+ * Set up an arena over caller-provided memory
+ * arena: The arena to initialize
+ * memory: The block to allocate from
+ * size: Size of the block in bytes
+ */
+void arena_init(arena_t *arena, void *memory, size_t size);
+
+/*
+ * Allocate from an arena
+ * arena: The arena to allocate from
+ * size: Number of bytes needed
+ * Returns a pointer aligned to ARENA_ALIGN, or NULL if the arena is exhausted
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * Release everything allocated from an arena at once
+ * arena: The arena to reset
+ */
+void arena_reset(arena_t *arena);
+
+#endif // ARENA_H
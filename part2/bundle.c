@@ -0,0 +1,147 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bundle.h"
+
+uint32_t bundle_hash(const char *path, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Checks that the header's tables lie inside the mapped file
+// Returns 0 if the layout is sane, -1 otherwise
+static int validate_header(const bundle_header_t *header, size_t map_size) {
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "bundle: bad magic\n");
+        return -1;
+    }
+    if (header->version != BUNDLE_VERSION) {
+        fprintf(stderr, "bundle: unsupported version %u\n", header->version);
+        return -1;
+    }
+    if (header->total_size != map_size) {
+        fprintf(stderr, "bundle: truncated file\n");
+        return -1;
+    }
+    if (header->n_buckets == 0 || (header->n_buckets & (header->n_buckets - 1)) != 0 ||
+        header->n_buckets < header->n_entries) {
+        fprintf(stderr, "bundle: bad bucket count\n");
+        return -1;
+    }
+    if (header->entries_offset + (uint64_t)header->n_entries * sizeof(bundle_entry_t) > map_size ||
+        header->buckets_offset + (uint64_t)header->n_buckets * sizeof(uint32_t) > map_size ||
+        header->strings_offset + header->strings_size > map_size) {
+        fprintf(stderr, "bundle: index out of bounds\n");
+        return -1;
+    }
+    return 0;
+}
+
+bundle_t *bundle_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("bundle open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("bundle fstat");
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(bundle_header_t)) {
+        fprintf(stderr, "bundle: %s is too small\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("bundle mmap");
+        close(fd);
+        return NULL;
+    }
+    const bundle_header_t *header = map;
+    if (validate_header(header, st.st_size) != 0) {
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    bundle_t *bundle = malloc(sizeof(bundle_t));
+    if (bundle == NULL) {
+        perror("malloc");
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+    int error;
+    if ((error = pthread_mutex_init(&bundle->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+        free(bundle);
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+    bundle->fd = fd;
+    bundle->map = map;
+    bundle->map_size = st.st_size;
+    bundle->header = header;
+    bundle->entries = (const bundle_entry_t *)((const char *)map + header->entries_offset);
+    bundle->buckets = (const uint32_t *)((const char *)map + header->buckets_offset);
+    bundle->strings = (const char *)map + header->strings_offset;
+    bundle->refcount = 1;
+    return bundle;
+}
+
+const bundle_entry_t *bundle_lookup(const bundle_t *bundle, const char *resource_name) {
+    size_t len = strlen(resource_name);
+    uint32_t hash = bundle_hash(resource_name, len);
+    uint32_t mask = bundle->header->n_buckets - 1;
+
+    //linear probe until an empty bucket is hit
+    for (uint32_t i = 0; i <= mask; i++) {
+        uint32_t slot = bundle->buckets[(hash + i) & mask];
+        if (slot == 0 || slot > bundle->header->n_entries) {
+            return NULL;
+        }
+        const bundle_entry_t *entry = &bundle->entries[slot - 1];
+        if (entry->hash == hash && entry->path_length == len &&
+            entry->path_offset + (uint64_t)len <= bundle->header->strings_size &&
+            memcmp(bundle->strings + entry->path_offset, resource_name, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void bundle_retain(bundle_t *bundle) {
+    pthread_mutex_lock(&bundle->lock);
+    bundle->refcount++;
+    pthread_mutex_unlock(&bundle->lock);
+}
+
+void bundle_release(bundle_t *bundle) {
+    pthread_mutex_lock(&bundle->lock);
+    int remaining = --bundle->refcount;
+    pthread_mutex_unlock(&bundle->lock);
+    if (remaining > 0) {
+        return;
+    }
+
+    if (munmap(bundle->map, bundle->map_size) == -1) {
+        perror("bundle munmap");
+    }
+    if (close(bundle->fd) == -1) {
+        perror("bundle close");
+    }
+    pthread_mutex_destroy(&bundle->lock);
+    free(bundle);
+}
@@ -0,0 +1,105 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk layout of an asset bundle produced by bundle_pack:
+ *
+ *   bundle_header_t
+ *   bundle_entry_t[n_entries]      sorted by path
+ *   uint32_t buckets[n_buckets]    open-addressing hash index, 0 = empty,
+ *                                  otherwise entry index + 1
+ *   char strings[strings_size]     paths referenced by the entries
+ *   payloads                       each one starts on a page boundary
+ *
+ * All integers are stored in host byte order; a bundle is meant to be packed
+ * on the same kind of machine that serves it.
+ */
+
+#define BUNDLE_MAGIC "HTTPBDL1"
+#define BUNDLE_VERSION 2
+#define BUNDLE_MIME_LEN 32
+#define BUNDLE_ETAG_LEN 24
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_buckets;             // Always a power of two
+    uint32_t page_size;
+    uint64_t entries_offset;
+    uint64_t buckets_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t total_size;
+} bundle_header_t;
+
+typedef struct {
+    uint64_t offset;                // Identity payload
+    uint64_t length;
+    uint64_t gzip_offset;           // Precompressed payload, 0 if absent
+    uint64_t gzip_length;
+    uint32_t path_offset;           // Into the string table, not terminated
+    uint32_t path_length;
+    uint32_t hash;                  // bundle_hash() of the path
+    uint32_t reserved;
+    char mime_type[BUNDLE_MIME_LEN];
+    char etag[BUNDLE_ETAG_LEN];     // Quoted, ready to be sent
+    char gzip_etag[BUNDLE_ETAG_LEN];    // Same for the precompressed payload
+} bundle_entry_t;
+
+// A bundle mapped into memory by the server
+typedef struct {
+    int fd;
+    void *map;
+    size_t map_size;
+    const bundle_header_t *header;
+    const bundle_entry_t *entries;
+    const uint32_t *buckets;
+    const char *strings;
+    int refcount;
+    pthread_mutex_t lock;
+} bundle_t;
+
+/*
+ * Hash a path for the bundle index (32-bit FNV-1a)
+ * path: The path to hash, e.g. "/quote.txt"
+ * len: Length of the path in bytes
+ * Returns the hash value
+ */
+uint32_t bundle_hash(const char *path, size_t len);
+
+/*
+ * Map a bundle file into memory and validate its header
+ * The returned bundle starts with a reference count of 1.
+ * path: Path to the bundle file
+ * Returns a pointer to the bundle on success or NULL on error
+ */
+bundle_t *bundle_open(const char *path);
+
+/*
+ * Find the entry for a requested resource
+ * bundle: The bundle to search
+ * resource_name: The requested resource, e.g. "/quote.txt"
+ * Returns a pointer to the entry or NULL if the bundle has no such resource
+ */
+const bundle_entry_t *bundle_lookup(const bundle_t *bundle, const char *resource_name);
+
+/*
+ * Take an additional reference to a bundle so that it stays mapped while a
+ * response is being sent from it
+ * bundle: The bundle to reference
+ */
+void bundle_retain(bundle_t *bundle);
+
+/*
+ * Drop a reference to a bundle, unmapping and freeing it when the last
+ * reference goes away
+ * bundle: The bundle to release
+ */
+void bundle_release(bundle_t *bundle);
+
+#endif // BUNDLE_H
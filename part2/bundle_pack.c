@@ -0,0 +1,314 @@
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "mime.h"
+
+/*
+ * Offline packer that turns a directory of server files into a single bundle
+ * file (see bundle.h) that the server can serve with './http_server -b'.
+ * A file 'X.gz' next to a file 'X' is stored as the precompressed variant of
+ * 'X' instead of as a resource of its own.
+ * The bundle is written to a temporary file and renamed into place, so a
+ * running server that reloads it (SIGHUP) never sees a partial bundle.
+ */
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+#define COPY_BUFSIZE 65536
+
+typedef struct {
+    char *path;         // Resource name, e.g. "/quote.txt"
+    char *source;       // Path of the file on disk
+    off_t size;
+    char *gzip_source;  // Precompressed variant on disk, NULL if none
+    off_t gzip_size;
+} pack_file_t;
+
+static const char *root_dir;
+static size_t root_len;
+static pack_file_t *files;
+static size_t n_files;
+static size_t files_capacity;
+
+// nftw() callback that records every regular file below the root directory
+static int collect_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    if (typeflag != FTW_F || !S_ISREG(sb->st_mode)) {
+        return 0;
+    }
+    if (n_files == files_capacity) {
+        files_capacity = files_capacity == 0 ? 16 : files_capacity * 2;
+        pack_file_t *grown = realloc(files, files_capacity * sizeof(pack_file_t));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        files = grown;
+    }
+    const char *relative = fpath + root_len;
+    while (*relative == '/') {
+        relative++;
+    }
+    pack_file_t *file = &files[n_files];
+    memset(file, 0, sizeof(*file));
+    file->path = malloc(strlen(relative) + 2);
+    file->source = strdup(fpath);
+    if (file->path == NULL || file->source == NULL) {
+        perror("malloc");
+        free(file->path);
+        free(file->source);
+        return -1;
+    }
+    sprintf(file->path, "/%s", relative);
+    file->size = sb->st_size;
+    n_files++;
+    return 0;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(((const pack_file_t *)a)->path, ((const pack_file_t *)b)->path);
+}
+
+// Attaches every 'X.gz' that has a matching 'X' as X's gzip variant and
+// removes it from the list of resources. The list must be sorted.
+static void attach_gzip_variants(void) {
+    int attached[n_files == 0 ? 1 : n_files];
+    for (size_t i = 0; i < n_files; i++) {
+        attached[i] = 0;
+        size_t len = strlen(files[i].path);
+        if (len > 3 && strcmp(files[i].path + len - 3, ".gz") == 0) {
+            char base[len - 2];
+            memcpy(base, files[i].path, len - 3);
+            base[len - 3] = '\0';
+            pack_file_t key = { .path = base };
+            pack_file_t *owner = bsearch(&key, files, n_files, sizeof(pack_file_t), compare_paths);
+            if (owner != NULL) {
+                owner->gzip_source = files[i].source;
+                owner->gzip_size = files[i].size;
+                attached[i] = 1;
+            }
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < n_files; i++) {
+        if (attached[i]) {
+            free(files[i].path);
+        } else {
+            files[kept++] = files[i];
+        }
+    }
+    n_files = kept;
+}
+
+static uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Copies 'size' bytes of the file at 'source' to 'out_fd' at 'offset' and
+// computes a 64-bit FNV-1a hash of the contents for the ETag
+// Returns 0 on success or -1 on error
+static int copy_payload(int out_fd, const char *source, off_t size, uint64_t offset, uint64_t *hash) {
+    int in_fd = open(source, O_RDONLY);
+    if (in_fd == -1) {
+        perror(source);
+        return -1;
+    }
+    char buf[COPY_BUFSIZE];
+    uint64_t h = 14695981039346656037ull;
+    off_t copied = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read(in_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < bytes_read; i++) {
+            h ^= (unsigned char)buf[i];
+            h *= 1099511628211ull;
+        }
+        if (pwrite(out_fd, buf, bytes_read, offset + copied) != bytes_read) {
+            perror("pwrite");
+            close(in_fd);
+            return -1;
+        }
+        copied += bytes_read;
+    }
+    if (bytes_read < 0) {
+        perror("read");
+        close(in_fd);
+        return -1;
+    }
+    close(in_fd);
+    if (copied != size) {
+        fprintf(stderr, "%s changed size while packing\n", source);
+        return -1;
+    }
+    *hash = h;
+    return 0;
+}
+
+static int write_bundle(const char *out_path) {
+    uint32_t page_size = sysconf(_SC_PAGESIZE);
+    uint32_t n_buckets = 1;
+    while (n_buckets < 2 * n_files) {
+        n_buckets <<= 1;
+    }
+    uint64_t strings_size = 0;
+    for (size_t i = 0; i < n_files; i++) {
+        strings_size += strlen(files[i].path);
+    }
+
+    bundle_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.n_entries = n_files;
+    header.n_buckets = n_buckets;
+    header.page_size = page_size;
+    header.entries_offset = sizeof(header);
+    header.buckets_offset = header.entries_offset + n_files * sizeof(bundle_entry_t);
+    header.strings_offset = header.buckets_offset + n_buckets * sizeof(uint32_t);
+    header.strings_size = strings_size;
+
+    bundle_entry_t *entries = calloc(n_files == 0 ? 1 : n_files, sizeof(bundle_entry_t));
+    uint32_t *buckets = calloc(n_buckets, sizeof(uint32_t));
+    char *strings = malloc(strings_size == 0 ? 1 : strings_size);
+    if (entries == NULL || buckets == NULL || strings == NULL) {
+        perror("malloc");
+        free(entries);
+        free(buckets);
+        free(strings);
+        return -1;
+    }
+
+    char tmp_path[strlen(out_path) + 32];
+    sprintf(tmp_path, "%s.tmp.%d", out_path, (int)getpid());
+    int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        perror(tmp_path);
+        free(entries);
+        free(buckets);
+        free(strings);
+        return -1;
+    }
+
+    uint64_t offset = align_up(header.strings_offset + strings_size, page_size);
+    uint32_t string_offset = 0;
+    for (size_t i = 0; i < n_files; i++) {
+        bundle_entry_t *entry = &entries[i];
+        size_t len = strlen(files[i].path);
+        memcpy(strings + string_offset, files[i].path, len);
+        entry->path_offset = string_offset;
+        entry->path_length = len;
+        entry->hash = bundle_hash(files[i].path, len);
+        string_offset += len;
+
+        const char *mime = get_mime_type(strrchr(files[i].path, '.'));
+        snprintf(entry->mime_type, sizeof(entry->mime_type), "%s", mime != NULL ? mime : DEFAULT_MIME_TYPE);
+
+        uint64_t content_hash;
+        entry->offset = offset;
+        entry->length = files[i].size;
+        if (copy_payload(out_fd, files[i].source, files[i].size, offset, &content_hash) != 0) {
+            goto fail;
+        }
+        snprintf(entry->etag, sizeof(entry->etag), "\"%016llx\"", (unsigned long long)content_hash);
+        offset = align_up(offset + files[i].size, page_size);
+
+        if (files[i].gzip_source != NULL) {
+            uint64_t gzip_hash;
+            entry->gzip_offset = offset;
+            entry->gzip_length = files[i].gzip_size;
+            if (copy_payload(out_fd, files[i].gzip_source, files[i].gzip_size, offset, &gzip_hash) != 0) {
+                goto fail;
+            }
+            //a different body needs a different strong validator
+            snprintf(entry->gzip_etag, sizeof(entry->gzip_etag), "\"%016llx-gz\"",
+                     (unsigned long long)gzip_hash);
+            offset = align_up(offset + files[i].gzip_size, page_size);
+        }
+
+        //insert into the hash index with linear probing
+        uint32_t slot = entry->hash & (n_buckets - 1);
+        while (buckets[slot] != 0) {
+            slot = (slot + 1) & (n_buckets - 1);
+        }
+        buckets[slot] = i + 1;
+    }
+    header.total_size = offset;
+
+    if (pwrite(out_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(out_fd, entries, n_files * sizeof(bundle_entry_t), header.entries_offset) !=
+            (ssize_t)(n_files * sizeof(bundle_entry_t)) ||
+        pwrite(out_fd, buckets, n_buckets * sizeof(uint32_t), header.buckets_offset) !=
+            (ssize_t)(n_buckets * sizeof(uint32_t)) ||
+        pwrite(out_fd, strings, strings_size, header.strings_offset) != (ssize_t)strings_size) {
+        perror("pwrite");
+        goto fail;
+    }
+    //the last payload may end before its page does
+    if (ftruncate(out_fd, header.total_size) == -1) {
+        perror("ftruncate");
+        goto fail;
+    }
+    if (fsync(out_fd) == -1) {
+        perror("fsync");
+        goto fail;
+    }
+    if (close(out_fd) == -1) {
+        perror("close");
+        out_fd = -1;
+        goto fail;
+    }
+    out_fd = -1;
+    if (rename(tmp_path, out_path) == -1) {
+        perror("rename");
+        goto fail;
+    }
+
+    free(entries);
+    free(buckets);
+    free(strings);
+    return 0;
+
+fail:
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    unlink(tmp_path);
+    free(entries);
+    free(buckets);
+    free(strings);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s <directory> <bundle>\n", argv[0]);
+        return 1;
+    }
+    root_dir = argv[1];
+    root_len = strlen(root_dir);
+
+    if (nftw(root_dir, collect_file, 16, FTW_PHYS) != 0) {
+        fprintf(stderr, "Failed to scan %s\n", root_dir);
+        return 1;
+    }
+    qsort(files, n_files, sizeof(pack_file_t), compare_paths);
+    attach_gzip_variants();
+
+    int result = write_bundle(argv[2]);
+    if (result == 0) {
+        printf("Packed %zu files into %s\n", n_files, argv[2]);
+    }
+
+    for (size_t i = 0; i < n_files; i++) {
+        free(files[i].path);
+        free(files[i].source);
+        free(files[i].gzip_source);
+    }
+    free(files);
+    return result == 0 ? 0 : 1;
+}
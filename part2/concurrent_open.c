@@ -1,20 +1,238 @@
 #define _GNU_SOURCE
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #define SERVER_FILE_PREFIX "server_files/"
 #define CONCURRENCY_DEGREE 5
+#define MAX_TRACKED_FD 65536
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static int n_waiters = 0;
 static int semaphore_initialized = 0;
 static sem_t semaphore;
 
+/*
+ * Scaling-test knobs, all read from the environment when the library loads:
+ *   CONCURRENT_OPEN_DEGREE  Number of threads the (f)open barrier waits for
+ *                           (default CONCURRENCY_DEGREE, 0 or 1 disables it)
+ *   SHIM_OPEN_LATENCY       Extra latency per server file open, as
+ *   SHIM_READ_LATENCY       "<dist>:<mean usec>" where dist is fixed, uniform
+ *                           (0 to 2x mean) or exp (exponential), e.g. exp:2000.
+ *                           The read latency applies to read, pread, preadv2
+ *                           and sendfile calls on server files.
+ *   SHIM_MAX_INFLIGHT       Cap on concurrent open/read calls on server files,
+ *                           emulating a device with a limited queue depth
+ *   SHIM_SUMMARY            Where to write a summary at exit: a file path or
+ *                           "stderr". No summary is written when unset.
+ * Only calls on descriptors of files opened under SERVER_FILE_PREFIX are
+ * slowed down. mincore() is not interposed, so page residency checks, such as
+ * the server's for a mapped bundle, still see the real page cache and skip
+ * the injected latency; so do accesses to mapped pages themselves.
+ */
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_EXP 2
+
+typedef struct {
+    int dist;
+    double mean_us;
+} latency_spec_t;
+
+static int barrier_degree = CONCURRENCY_DEGREE;
+static latency_spec_t open_latency;
+static latency_spec_t read_latency;
+static int max_inflight = 0;
+static const char *summary_path = NULL;
+
+// Statistics, updated with atomic builtins
+static long n_opens;
+static long n_reads;
+static long bytes_read;
+static long injected_us;
+static int inflight_opens;
+static int inflight_reads;
+static int max_inflight_opens;
+static int max_inflight_reads;
+
+// Server file descriptors whose reads are delayed and counted
+static unsigned char tracked_fds[MAX_TRACKED_FD];
+
+// Limit on concurrent open/read calls when SHIM_MAX_INFLIGHT is set
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_cond = PTHREAD_COND_INITIALIZER;
+static int inflight_total = 0;
+
+static int (*open_real)(const char *pathname, int flags, ...);
+static FILE *(*fopen_real)(const char *path, const char *mode);
+static int (*close_real)(int fd);
+static ssize_t (*read_real)(int fd, void *buf, size_t count);
+static ssize_t (*pread_real)(int fd, void *buf, size_t count, off_t offset);
+static ssize_t (*pread64_real)(int fd, void *buf, size_t count, off64_t offset);
+static ssize_t (*preadv2_real)(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags);
+static ssize_t (*sendfile_real)(int out_fd, int in_fd, off_t *offset, size_t count);
+static ssize_t (*sendfile64_real)(int out_fd, int in_fd, off64_t *offset, size_t count);
+
+// Parses a "<dist>:<mean usec>" latency spec, leaving 'spec' zeroed if unset
+static void parse_latency(const char *name, latency_spec_t *spec) {
+    const char *value = getenv(name);
+    spec->dist = DIST_FIXED;
+    spec->mean_us = 0;
+    if (value == NULL) {
+        return;
+    }
+    const char *colon = strchr(value, ':');
+    const char *number = value;
+    if (colon != NULL) {
+        if (strncmp(value, "uniform", colon - value) == 0) {
+            spec->dist = DIST_UNIFORM;
+        } else if (strncmp(value, "exp", colon - value) == 0) {
+            spec->dist = DIST_EXP;
+        } else if (strncmp(value, "fixed", colon - value) != 0) {
+            fprintf(stderr, "%s: unknown distribution in '%s', using fixed\n", name, value);
+        }
+        number = colon + 1;
+    }
+    spec->mean_us = atof(number);
+}
+
+// Resolves the real libc functions and reads the configuration. Runs when the
+// library is loaded, or earlier if an interposed call comes first.
+__attribute__((constructor))
+static void shim_init(void) {
+    open_real = dlsym(RTLD_NEXT, "open");
+    fopen_real = dlsym(RTLD_NEXT, "fopen");
+    close_real = dlsym(RTLD_NEXT, "close");
+    read_real = dlsym(RTLD_NEXT, "read");
+    pread_real = dlsym(RTLD_NEXT, "pread");
+    pread64_real = dlsym(RTLD_NEXT, "pread64");
+    preadv2_real = dlsym(RTLD_NEXT, "preadv2");
+    sendfile_real = dlsym(RTLD_NEXT, "sendfile");
+    sendfile64_real = dlsym(RTLD_NEXT, "sendfile64");
+
+    const char *degree = getenv("CONCURRENT_OPEN_DEGREE");
+    if (degree != NULL) {
+        barrier_degree = atoi(degree);
+    }
+    parse_latency("SHIM_OPEN_LATENCY", &open_latency);
+    parse_latency("SHIM_READ_LATENCY", &read_latency);
+    const char *cap = getenv("SHIM_MAX_INFLIGHT");
+    if (cap != NULL) {
+        max_inflight = atoi(cap);
+    }
+    summary_path = getenv("SHIM_SUMMARY");
+}
+
+// Writes the summary of what the shim observed, if one was requested
+__attribute__((destructor))
+static void shim_summary(void) {
+    if (summary_path == NULL) {
+        return;
+    }
+    FILE *out = strcmp(summary_path, "stderr") == 0 ? stderr : fopen_real(summary_path, "w");
+    if (out == NULL) {
+        perror(summary_path);
+        return;
+    }
+    fprintf(out, "concurrent_open summary\n");
+    fprintf(out, "  server file opens:       %ld\n", __atomic_load_n(&n_opens, __ATOMIC_RELAXED));
+    fprintf(out, "  server file reads:       %ld\n", __atomic_load_n(&n_reads, __ATOMIC_RELAXED));
+    fprintf(out, "  bytes read:              %ld\n", __atomic_load_n(&bytes_read, __ATOMIC_RELAXED));
+    fprintf(out, "  injected latency (ms):   %.1f\n", __atomic_load_n(&injected_us, __ATOMIC_RELAXED) / 1000.0);
+    fprintf(out, "  max concurrent opens:    %d\n", __atomic_load_n(&max_inflight_opens, __ATOMIC_RELAXED));
+    fprintf(out, "  max concurrent reads:    %d\n", __atomic_load_n(&max_inflight_reads, __ATOMIC_RELAXED));
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+// Sleeps for a duration drawn from the latency spec
+static void inject_latency(const latency_spec_t *spec) {
+    if (spec->mean_us <= 0) {
+        return;
+    }
+    static __thread unsigned int seed = 0;
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&seed;
+    }
+    double u = (rand_r(&seed) + 1.0) / ((double)RAND_MAX + 2.0);
+    double delay_us = spec->mean_us;
+    if (spec->dist == DIST_UNIFORM) {
+        delay_us = 2 * spec->mean_us * u;
+    } else if (spec->dist == DIST_EXP) {
+        delay_us = -spec->mean_us * log(u);
+    }
+    struct timespec ts = { .tv_sec = (time_t)(delay_us / 1e6),
+                           .tv_nsec = (long)(fmod(delay_us, 1e6) * 1000) };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+    __atomic_add_fetch(&injected_us, (long)delay_us, __ATOMIC_RELAXED);
+}
+
+// Raises *max to value if value is larger
+static void record_max(int *max, int value) {
+    int seen = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(max, &seen, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Marks the start of an open or read on a server file: waits for a slot if
+// SHIM_MAX_INFLIGHT is set, then counts the call as in flight
+static void begin_io(int *inflight, int *max) {
+    if (max_inflight > 0) {
+        pthread_mutex_lock(&inflight_lock);
+        while (inflight_total >= max_inflight) {
+            pthread_cond_wait(&inflight_cond, &inflight_lock);
+        }
+        inflight_total++;
+        pthread_mutex_unlock(&inflight_lock);
+    }
+    record_max(max, __atomic_add_fetch(inflight, 1, __ATOMIC_RELAXED));
+}
+
+static void end_io(int *inflight) {
+    __atomic_sub_fetch(inflight, 1, __ATOMIC_RELAXED);
+    if (max_inflight > 0) {
+        pthread_mutex_lock(&inflight_lock);
+        inflight_total--;
+        pthread_cond_signal(&inflight_cond);
+        pthread_mutex_unlock(&inflight_lock);
+    }
+}
+
+static int is_tracked(int fd) {
+    return fd >= 0 && fd < MAX_TRACKED_FD && __atomic_load_n(&tracked_fds[fd], __ATOMIC_RELAXED);
+}
+
+static void set_tracked(int fd, unsigned char tracked) {
+    if (fd >= 0 && fd < MAX_TRACKED_FD) {
+        __atomic_store_n(&tracked_fds[fd], tracked, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts one read of 'result' bytes from a server file
+static void account_read(ssize_t result) {
+    __atomic_add_fetch(&n_reads, 1, __ATOMIC_RELAXED);
+    if (result > 0) {
+        __atomic_add_fetch(&bytes_read, result, __ATOMIC_RELAXED);
+    }
+}
+
 /*
  * Versions of (f)open that will only allow threads to proceed once a sufficient
  * number of threads have initiated an (f)open syscall
@@ -55,16 +273,19 @@ int is_server_file(const char *pathname) {
     return (strncmp(SERVER_FILE_PREFIX, pathname, strlen(SERVER_FILE_PREFIX)) == 0);
 }
 
-// Wait until 'CONCURRENCY_DEGREE' threads all have initiated barrier(). Then,
-// allow all of them to proceed.
+// Wait until 'barrier_degree' (CONCURRENCY_DEGREE unless overridden) threads
+// all have initiated barrier(). Then, allow all of them to proceed.
 int barrier(void) {
+    if (barrier_degree <= 1) {
+        return 0;
+    }
     int result;
     if ((result = pthread_mutex_lock(&lock)) != 0) {
         fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(result));
         return -1;
     }
-    if (n_waiters == CONCURRENCY_DEGREE - 1) {
-        for (int i = 0; i < CONCURRENCY_DEGREE - 1; i++) {
+    if (n_waiters == barrier_degree - 1) {
+        for (int i = 0; i < barrier_degree - 1; i++) {
             if (sem_post(&semaphore) == -1) {
                 perror("sem_post");
                 pthread_mutex_unlock(&lock);
@@ -91,23 +312,38 @@ int barrier(void) {
     return 0;
 }
 
+// Opens a server file through 'open_real' with latency injection and
+// in-flight accounting, remembering the descriptor so its reads are tracked
+static int open_server_file(const char *pathname, int flags, mode_t mode) {
+    begin_io(&inflight_opens, &max_inflight_opens);
+    inject_latency(&open_latency);
+    int fd = open_real(pathname, flags, mode);
+    end_io(&inflight_opens);
+    __atomic_add_fetch(&n_opens, 1, __ATOMIC_RELAXED);
+    set_tracked(fd, 1);
+    return fd;
+}
+
 int open(const char *pathname, int flags, ...) {
     // Init the semaphore if it hasn't already been initialized
     if (init_semaphore() != 0) {
         return -1;
     }
 
-    int (*open_orig)(const char *pathname, int flags);
-    open_orig = dlsym(RTLD_NEXT, "open"); // Get pointer to real open
-    char *error = dlerror();
-    if (error != NULL) {
-        fprintf(stderr, "dlsym: %s\n", error);
-        return -1;
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    if (open_real == NULL) {
+        shim_init();
     }
 
     // If thread isn't opening a server file, let it proceed
     if (!is_server_file(pathname)) {
-        return open_orig(pathname, flags);
+        return open_real(pathname, flags, mode);
     }
 
     // Otherwise, check in at the barrier
@@ -116,7 +352,7 @@ int open(const char *pathname, int flags, ...) {
         return -1;
     }
 
-    return open_orig(pathname, flags);
+    return open_server_file(pathname, flags, mode);
 }
 
 FILE *fopen(const char * restrict path, const char * restrict mode) {
@@ -125,17 +361,13 @@ FILE *fopen(const char * restrict path, const char * restrict mode) {
         return NULL;
     }
 
-    FILE* (*fopen_orig)(const char * restrict path, const char * restrict mode);
-    fopen_orig = dlsym(RTLD_NEXT, "fopen"); // Get pointer to real fopen
-    char *error = dlerror();
-    if (error != NULL) {
-        fprintf(stderr, "dlsym: %s\n", error);
-        return NULL;
+    if (fopen_real == NULL) {
+        shim_init();
     }
 
     // If thread isn't opening a server file, let it proceed
     if (!is_server_file(path)) {
-        return fopen_orig(path, mode);
+        return fopen_real(path, mode);
     }
 
     // Otherwise, check in at the barrier
@@ -144,5 +376,117 @@ FILE *fopen(const char * restrict path, const char * restrict mode) {
         return NULL;
     }
 
-    return fopen_orig(path, mode);
+    begin_io(&inflight_opens, &max_inflight_opens);
+    inject_latency(&open_latency);
+    FILE *file = fopen_real(path, mode);
+    end_io(&inflight_opens);
+    __atomic_add_fetch(&n_opens, 1, __ATOMIC_RELAXED);
+    if (file != NULL) {
+        set_tracked(fileno(file), 1);
+    }
+    return file;
+}
+
+int close(int fd) {
+    if (close_real == NULL) {
+        shim_init();
+    }
+    set_tracked(fd, 0);
+    return close_real(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    if (read_real == NULL) {
+        shim_init();
+    }
+    if (!is_tracked(fd)) {
+        return read_real(fd, buf, count);
+    }
+    begin_io(&inflight_reads, &max_inflight_reads);
+    inject_latency(&read_latency);
+    ssize_t result = read_real(fd, buf, count);
+    end_io(&inflight_reads);
+    account_read(result);
+    return result;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    if (pread_real == NULL) {
+        shim_init();
+    }
+    if (!is_tracked(fd)) {
+        return pread_real(fd, buf, count, offset);
+    }
+    begin_io(&inflight_reads, &max_inflight_reads);
+    inject_latency(&read_latency);
+    ssize_t result = pread_real(fd, buf, count, offset);
+    end_io(&inflight_reads);
+    account_read(result);
+    return result;
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+    if (pread64_real == NULL) {
+        shim_init();
+    }
+    if (!is_tracked(fd)) {
+        return pread64_real(fd, buf, count, offset);
+    }
+    begin_io(&inflight_reads, &max_inflight_reads);
+    inject_latency(&read_latency);
+    ssize_t result = pread64_real(fd, buf, count, offset);
+    end_io(&inflight_reads);
+    account_read(result);
+    return result;
+}
+
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    if (preadv2_real == NULL) {
+        shim_init();
+    }
+    if (!is_tracked(fd)) {
+        return preadv2_real(fd, iov, iovcnt, offset, flags);
+    }
+    // A slow device never has the data cached: make non-blocking reads fail
+    // so the server takes its cold-read path
+    if ((flags & RWF_NOWAIT) && read_latency.mean_us > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    begin_io(&inflight_reads, &max_inflight_reads);
+    inject_latency(&read_latency);
+    ssize_t result = preadv2_real(fd, iov, iovcnt, offset, flags);
+    end_io(&inflight_reads);
+    account_read(result);
+    return result;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if (sendfile_real == NULL) {
+        shim_init();
+    }
+    if (!is_tracked(in_fd)) {
+        return sendfile_real(out_fd, in_fd, offset, count);
+    }
+    begin_io(&inflight_reads, &max_inflight_reads);
+    inject_latency(&read_latency);
+    ssize_t result = sendfile_real(out_fd, in_fd, offset, count);
+    end_io(&inflight_reads);
+    account_read(result);
+    return result;
+}
+
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count) {
+    if (sendfile64_real == NULL) {
+        shim_init();
+    }
+    if (!is_tracked(in_fd)) {
+        return sendfile64_real(out_fd, in_fd, offset, count);
+    }
+    begin_io(&inflight_reads, &max_inflight_reads);
+    inject_latency(&read_latency);
+    ssize_t result = sendfile64_real(out_fd, in_fd, offset, count);
+    end_io(&inflight_reads);
+    account_read(result);
+    return result;
 }
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "conn_pool.h"
+
+// Prepares a connection object for a new client socket
+static void conn_setup(http_conn_t *conn, conn_pool_t *pool, int fd,
+                       const struct sockaddr *addr, socklen_t addr_len) {
+    conn->fd = fd;
+    conn->pool = pool;
+    conn->next_free = NULL;
+    conn->limiter = NULL;
+    conn->limit_counted = 0;
+    conn->linger = 0;
+    conn->conn_id = 0;
+    conn->accept_ns = 0;
+    conn->request.resource_name[0] = '\0';
+    if (addr != NULL && addr_len <= sizeof(conn->addr)) {
+        memcpy(&conn->addr, addr, addr_len);
+        conn->addr_len = addr_len;
+    } else {
+        memset(&conn->addr, 0, sizeof(conn->addr));
+        conn->addr_len = 0;
+    }
+    arena_init(&conn->arena, conn->arena_mem, sizeof(conn->arena_mem));
+}
+
+int conn_pool_init(conn_pool_t *pool, int size) {
+    int error;
+    pool->conns = calloc(size, sizeof(http_conn_t));
+    if (pool->conns == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    if ((error = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+        free(pool->conns);
+        return -1;
+    }
+    pool->size = size;
+    pool->n_overflow = 0;
+    pool->free_list = NULL;
+    for (int i = size - 1; i >= 0; i--) {
+        pool->conns[i].next_free = pool->free_list;
+        pool->free_list = &pool->conns[i];
+    }
+    pool->n_free = size;
+    return 0;
+}
+
+http_conn_t *conn_acquire(conn_pool_t *pool, int fd, const struct sockaddr *addr, socklen_t addr_len) {
+    pthread_mutex_lock(&pool->lock);
+    http_conn_t *conn = pool->free_list;
+    if (conn != NULL) {
+        pool->free_list = conn->next_free;
+        pool->n_free--;
+        pthread_mutex_unlock(&pool->lock);
+        conn_setup(conn, pool, fd, addr, addr_len);
+        return conn;
+    }
+    pool->n_overflow++;
+    pthread_mutex_unlock(&pool->lock);
+
+    //every pooled connection is busy, don't turn the client away for it
+    conn = malloc(sizeof(http_conn_t));
+    if (conn == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    conn_setup(conn, NULL, fd, addr, addr_len);
+    return conn;
+}
+
+void conn_release(http_conn_t *conn) {
+    conn_pool_t *pool = conn->pool;
+    if (pool == NULL) {
+        free(conn);
+        return;
+    }
+    arena_reset(&conn->arena);
+    conn->fd = -1;
+    pthread_mutex_lock(&pool->lock);
+    conn->next_free = pool->free_list;
+    pool->free_list = conn;
+    pool->n_free++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int conn_pool_free(conn_pool_t *pool) {
+    int error;
+    if (pool->n_free != pool->size) {
+        fprintf(stderr, "conn_pool_free: %d connections still in use\n", pool->size - pool->n_free);
+    }
+    if ((error = pthread_mutex_destroy(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(error));
+        free(pool->conns);
+        return -1;
+    }
+    free(pool->conns);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <pthread.h>
+#include "http.h"
+
+#define CONN_POOL_SIZE 64
+
+// Free list of preallocated connection objects, including their arenas and
+// I/O buffers, recycled from one connection to the next so that serving a
+// request does not touch malloc/free
+typedef struct conn_pool {
+    http_conn_t *conns;         // One block holding every pooled connection
+    int size;
+    http_conn_t *free_list;
+    int n_free;
+    long n_overflow;            // Connections that had to be heap allocated
+    pthread_mutex_t lock;
+} conn_pool_t;
+
+/*
+ * Allocate every connection object of a pool up front
+ * pool: Pointer to the conn_pool_t to be initialized
+ * size: Number of connection objects to preallocate
+ * Returns 0 on success or -1 on error
+ */
+int conn_pool_init(conn_pool_t *pool, int size);
+
+/*
+ * Take a connection object for a newly accepted socket. Never blocks: when
+ * the pool is empty a connection is allocated on the heap instead and freed
+ * again on release.
+ * pool: The pool to take from
+ * fd: The client socket
+ * addr: The client address returned by accept()
+ * addr_len: The length of addr
+ * Returns the connection, or NULL on error
+ */
+http_conn_t *conn_acquire(conn_pool_t *pool, int fd, const struct sockaddr *addr, socklen_t addr_len);
+
+/*
+ * Return a connection object to the pool it came from, resetting its arena.
+ * The socket must already be closed.
+ * conn: The connection to release
+ */
+void conn_release(http_conn_t *conn);
+
+/*
+ * Deallocates a pool. Every connection must have been released.
+ * Returns 0 on success or -1 on error
+ */
+int conn_pool_free(conn_pool_t *pool);
+
+#endif // CONN_POOL_H
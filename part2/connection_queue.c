@@ -1,10 +1,53 @@
 #include <stdio.h>
 #include <string.h>
 #include "connection_queue.h"
+#include "probes.h"
+#include "timeutil.h"
+
+// Restores the heap order after ready[idx] got a smaller key
+static void ready_sift_up(connection_queue_t *queue, int idx) {
+    http_send_t *send = queue->ready[idx];
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (queue->ready[parent]->sched_key <= send->sched_key) {
+            break;
+        }
+        queue->ready[idx] = queue->ready[parent];
+        idx = parent;
+    }
+    queue->ready[idx] = send;
+}
+
+// Removes and returns the response with the smallest key
+static http_send_t *ready_pop(connection_queue_t *queue) {
+    http_send_t *top = queue->ready[0];
+    http_send_t *last = queue->ready[--queue->n_ready];
+    int idx = 0;
+    while (1) {
+        int child = 2 * idx + 1;
+        if (child >= queue->n_ready) {
+            break;
+        }
+        if (child + 1 < queue->n_ready &&
+            queue->ready[child + 1]->sched_key < queue->ready[child]->sched_key) {
+            child++;
+        }
+        if (last->sched_key <= queue->ready[child]->sched_key) {
+            break;
+        }
+        queue->ready[idx] = queue->ready[child];
+        idx = child;
+    }
+    if (queue->n_ready > 0) {
+        queue->ready[idx] = last;
+    }
+    return top;
+}
 
 int connection_queue_init(connection_queue_t *queue) {
     //initialize length and shutdown to zero
     queue->length = 0;
+    queue->n_ready = 0;
     queue->shutdown = 0;
     int error;
 
@@ -27,7 +70,7 @@ int connection_queue_init(connection_queue_t *queue) {
     return 0;
 }
 
-int connection_enqueue(connection_queue_t *queue, int connection_fd) {
+int connection_enqueue(connection_queue_t *queue, http_conn_t *conn) {
     int error;
     if((error = pthread_mutex_lock(&queue->lock)) != 0){
        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
@@ -51,8 +94,10 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd) {
         return 1;
     }
 
-    queue->client_fds[queue->length]=connection_fd;
+    queue->conns[queue->length]=conn;
+    queue->conn_arrival_ms[queue->length] = monotonic_ms();
     queue->length++;
+    PROBE_ENQUEUE(conn->fd, queue->length);
     
     //signal queue_empty
     if((error = pthread_cond_signal(&queue->queue_empty)) != 0){
@@ -68,55 +113,91 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd) {
     return 0;
 }
 
-int connection_dequeue(connection_queue_t *queue) {
+int connection_requeue(connection_queue_t *queue, http_send_t *send) {
     int error;
+    if((error = pthread_mutex_lock(&queue->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    //workers may already be gone at shutdown
+    if(queue->shutdown == 1 || queue->n_ready == READY_CAPACITY){
+        pthread_mutex_unlock(&queue->lock);
+        return 1;
+    }
 
+    long long remaining = (send->end - send->offset) + (send->buf_len - send->buf_sent);
+    send->sched_key = remaining + (long long)send->arrival_ms * SRPT_AGING_RATE;
+    queue->ready[queue->n_ready] = send;
+    ready_sift_up(queue, queue->n_ready);
+    queue->n_ready++;
 
+    //wake a worker waiting for new connections
+    if((error = pthread_cond_signal(&queue->queue_empty)) != 0){
+        fprintf(stderr, "pthread_cond_signal failed: %s\n", strerror(error));
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    if((error = pthread_mutex_unlock(&queue->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+int connection_queue_waiting(connection_queue_t *queue) {
+    int error;
     if((error = pthread_mutex_lock(&queue->lock)) != 0){
         fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
         return -1;
     }
+    int waiting = queue->length;
+    pthread_mutex_unlock(&queue->lock);
+    return waiting;
+}
 
-    
+int connection_dequeue_work(connection_queue_t *queue, http_conn_t **conn, http_send_t **send) {
+    int error;
+    *conn = NULL;
+    *send = NULL;
+    if((error = pthread_mutex_lock(&queue->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
 
-    //wait while queue is empty 
-    while(queue->length == 0){
+    //wait while there is nothing to do, responses in the heap still get
+    //finished after a shutdown
+    while(queue->length == 0 && queue->n_ready == 0 && queue->shutdown == 0){
         if((error = pthread_cond_wait(&queue->queue_empty, &queue->lock)) != 0){
             fprintf(stderr, "pthread_cond_wait failed: %s\n", strerror(error));
             pthread_mutex_unlock(&queue->lock);
             return -1;
         }
-        if (queue->shutdown == 1) {
-            break;
-        }
     }
 
-    //chek if shutdown occured and queue is empty
-    if((queue->shutdown == 1) && (queue->length == 0)){
-        if((error = pthread_mutex_unlock(&queue->lock)) != 0){
-            fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
-        }
-        return -1;
+    //a new connection competes with the heap top like any other response,
+    //so a stream of connections cannot starve a response forever
+    int take_conn = queue->length > 0;
+    if(take_conn && queue->n_ready > 0){
+        long long conn_key = SRPT_NEW_CONN_BYTES +
+            (long long)queue->conn_arrival_ms[queue->length - 1] * SRPT_AGING_RATE;
+        take_conn = conn_key <= queue->ready[0]->sched_key;
     }
 
-    queue->length--;
-    int dequeued_fd = queue->client_fds[queue->length];
-    queue->client_fds[queue->length]=-1;
-    
-    //signal queue_full
-    if((error = pthread_cond_signal(&queue->queue_full)) != 0){
-        fprintf(stderr, "pthread_cond_signal failed: %s\n", strerror(error));
-        pthread_mutex_unlock(&queue->lock);
-        return -1;
+    if(take_conn){
+        queue->length--;
+        *conn = queue->conns[queue->length];
+        queue->conns[queue->length]=NULL;
+        PROBE_DEQUEUE((*conn)->fd, queue->length);
+        pthread_cond_signal(&queue->queue_full);
+    } else if(queue->n_ready > 0){
+        *send = ready_pop(queue);
     }
 
-
     if((error = pthread_mutex_unlock(&queue->lock)) != 0){
         fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
         return -1;
     }
-
-    return dequeued_fd;
+    return (*conn == NULL && *send == NULL) ? -1 : 0;
 }
 
 int connection_queue_shutdown(connection_queue_t *queue) {
@@ -2,13 +2,26 @@
 #define CONNECTION_QUEUE_H
 
 #include <pthread.h>
+#include "http.h"
 
 #define CAPACITY 5
+// Responses that can wait between slices when scheduling by size
+#define READY_CAPACITY 256
+// Bytes of priority a waiting response gains per millisecond, so a large
+// response cannot be passed over forever by a stream of small ones
+#define SRPT_AGING_RATE 1024
+// Bytes a new connection is taken to need before its request is read, so it
+// is keyed like a one-slice response that arrived when it was accepted
+#define SRPT_NEW_CONN_BYTES 65536
 
 // Struct representing a thread-safe queue data structure
-// The queue stores file descriptors of active client TCP sockets
-typedef struct {
-    int client_fds[CAPACITY];
+// The queue stores the connection objects of active client TCP sockets, and
+// a min-heap of partly sent responses ordered by bytes left (with aging)
+typedef struct connection_queue {
+    http_conn_t *conns[CAPACITY];
+    long conn_arrival_ms[CAPACITY];
+    http_send_t *ready[READY_CAPACITY];
+    int n_ready;
     int length;
     int read_idx;
     int write_idx;
@@ -28,24 +41,47 @@ typedef struct {
 int connection_queue_init(connection_queue_t *queue);
 
 /*
- * Add a new file descriptor to a connection queue. If the queue is full, then
+ * Add a new connection to a connection queue. If the queue is full, then
  * this function blocks until space becomes available. If the queue is shut
  * down, then no addition to the queue takes place and an error is returned.
  * queue: A pointer to the connection_queue_t to add to
- * connection_fd: The socket file descriptor to add to the queue
+ * conn: The client connection to add to the queue
  * Returns 0 on success or -1 on error
  */
-int connection_enqueue(connection_queue_t *queue, int connection_fd);
+int connection_enqueue(connection_queue_t *queue, http_conn_t *conn);
 
 /*
- * Remove a file descriptor from the connection queue. If the queue is empty,
- * then this function blocks until an item becomes available. If the queue is
- * shut down, then no removal from the queue takes place and an error is
- * returned.
+ * Put a partly sent response back to wait for its next slice. Never blocks.
+ * Its priority is its remaining bytes less SRPT_AGING_RATE for every
+ * millisecond since it started, which orders responses the same way no
+ * matter when it is compared, so the heap never needs reordering.
+ * queue: A pointer to the connection_queue_t to add to
+ * send: The response, which the queue owns until it is taken again
+ * Returns 0 on success, 1 if the queue is full or shut down (the caller keeps
+ * the response), or -1 on error
+ */
+int connection_requeue(connection_queue_t *queue, http_send_t *send);
+
+/*
+ * Take the next piece of work from the queue, blocking until there is some.
+ * A new connection is keyed like a response of SRPT_NEW_CONN_BYTES that arrived
+ * when it was queued, and is taken unless the response with the fewest bytes
+ * left has a smaller key. A waiting response therefore goes first once it has
+ * waited about (bytes left - SRPT_NEW_CONN_BYTES) / SRPT_AGING_RATE ms longer
+ * than the connection, however many connections keep arriving.
  * queue: A pointer to the connection_queue_t to remove from
- * Returns the removed socket file descriptor on success or -1 on error
+ * conn: Set to the new connection, or NULL
+ * send: Set to the response to send the next slice of, or NULL
+ * Returns 0 on success or -1 once the queue is shut down and empty
+ */
+int connection_dequeue_work(connection_queue_t *queue, http_conn_t **conn, http_send_t **send);
+
+/*
+ * Count the new connections waiting for a worker
+ * queue: A pointer to the connection_queue_t to look at
+ * Returns the number of connections or -1 on error
  */
-int connection_dequeue(connection_queue_t *queue);
+int connection_queue_waiting(connection_queue_t *queue);
 
 /*
  * Cleanly shuts down the connection queue. All threads currently blocked on an
@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "file_flight.h"
+
+static unsigned long path_hash(const char *path) {
+    unsigned long hash = 14695981039346656037UL;
+    for (const unsigned char *c = (const unsigned char *)path; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211UL;
+    }
+    return hash;
+}
+
+// Takes an entry for a path, not yet opened, from the pool or the heap.
+// Must be called with the lock held if flight is not NULL.
+static shared_file_t *file_new(file_flight_t *flight, const char *path, unsigned long hash, int shared) {
+    shared_file_t *file = NULL;
+    int pooled = flight != NULL && flight->free_list != NULL;
+    if (pooled) {
+        file = flight->free_list;
+        flight->free_list = file->next;
+        flight->n_free--;
+    } else {
+        if (flight != NULL) {
+            flight->n_overflow++;
+        }
+        //every pooled entry is busy, don't fail the request for it
+        file = malloc(sizeof(shared_file_t));
+        if (file == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+    }
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    file->fd = -1;
+    file->size = 0;
+    file->error = 0;
+    file->loading = 1;
+    file->refcount = 1;
+    file->shared = shared;
+    file->hash = hash;
+    file->owner = flight;
+    file->pooled = pooled;
+    file->next = NULL;
+    return file;
+}
+
+// Returns an entry to the pool it came from, or frees it. Must be called with
+// the owner's lock held, if it has an owner.
+static void file_recycle(shared_file_t *file) {
+    file_flight_t *flight = file->owner;
+    if (!file->pooled) {
+        free(file);
+        return;
+    }
+    file->next = flight->free_list;
+    flight->free_list = file;
+    flight->n_free++;
+}
+
+// Opens and stats the file, recording the outcome in the entry
+static void file_load(shared_file_t *file, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        file->error = errno;
+        return;
+    }
+    if (fstat(fd, &st) == -1) {
+        file->error = errno;
+        close(fd);
+        return;
+    }
+    file->fd = fd;
+    file->size = st.st_size;
+}
+
+// Opens a file on its own, outside the table
+static int open_private(file_flight_t *flight, const char *path, shared_file_t **file) {
+    if (flight != NULL) {
+        pthread_mutex_lock(&flight->lock);
+    }
+    shared_file_t *private = file_new(flight, "", 0, 0);
+    if (flight != NULL) {
+        pthread_mutex_unlock(&flight->lock);
+    }
+    if (private == NULL) {
+        return ENOMEM;
+    }
+    file_load(private, path);
+    private->loading = 0;
+    int error = private->error;
+    if (error != 0) {
+        file_flight_release(private);
+        return error;
+    }
+    *file = private;
+    return 0;
+}
+
+// Drops a reference to a shared entry, closing it with the last one. The
+// entry has left its bucket by then, since the opener holds a reference until
+// its load is done. Must be called with the lock held.
+static void release_locked(shared_file_t *file) {
+    if (--file->refcount > 0) {
+        return;
+    }
+    if (file->fd != -1) {
+        close(file->fd);
+    }
+    file_recycle(file);
+}
+
+// Unlinks an entry whose load has finished from its bucket. Must be called
+// with the lock held.
+static void unlink_loaded(file_flight_t *flight, shared_file_t *file) {
+    shared_file_t **link = &flight->buckets[file->hash & (FLIGHT_BUCKETS - 1)];
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+    file->next = NULL;
+}
+
+int file_flight_init(file_flight_t *flight) {
+    int error;
+    pthread_condattr_t attr;
+    memset(flight->buckets, 0, sizeof(flight->buckets));
+    flight->n_coalesced = 0;
+    flight->n_overflow = 0;
+    flight->files = calloc(FLIGHT_POOL_SIZE, sizeof(shared_file_t));
+    if (flight->files == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    flight->free_list = NULL;
+    for (int i = FLIGHT_POOL_SIZE - 1; i >= 0; i--) {
+        flight->files[i].next = flight->free_list;
+        flight->free_list = &flight->files[i];
+    }
+    flight->n_free = FLIGHT_POOL_SIZE;
+    if ((error = pthread_mutex_init(&flight->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+        free(flight->files);
+        return -1;
+    }
+    //waits are bounded on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    error = pthread_cond_init(&flight->loaded, &attr);
+    pthread_condattr_destroy(&attr);
+    if (error != 0) {
+        fprintf(stderr, "pthread_cond_init failed: %s\n", strerror(error));
+        pthread_mutex_destroy(&flight->lock);
+        free(flight->files);
+        return -1;
+    }
+    return 0;
+}
+
+int file_flight_open(file_flight_t *flight, const char *path, shared_file_t **file) {
+    //paths too long to key the table on are not worth coalescing
+    if (flight == NULL || strlen(path) >= FLIGHT_PATH_LEN) {
+        return open_private(flight, path, file);
+    }
+    unsigned long hash = path_hash(path);
+    shared_file_t **bucket = &flight->buckets[hash & (FLIGHT_BUCKETS - 1)];
+    int error;
+
+    pthread_mutex_lock(&flight->lock);
+    shared_file_t *entry = *bucket;
+    while (entry != NULL &&
+           (!entry->loading || entry->hash != hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) {
+        //first request for this path, load it for everyone
+        entry = file_new(flight, path, hash, 1);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&flight->lock);
+            return ENOMEM;
+        }
+        entry->next = *bucket;
+        *bucket = entry;
+        pthread_mutex_unlock(&flight->lock);
+
+        file_load(entry, path);
+
+        pthread_mutex_lock(&flight->lock);
+        entry->loading = 0;
+        //later requests open the file afresh rather than reuse this result
+        unlink_loaded(flight, entry);
+        pthread_cond_broadcast(&flight->loaded);
+    } else {
+        entry->refcount++;
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += FLIGHT_WAIT_MS / 1000;
+        deadline.tv_nsec += (FLIGHT_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (entry->loading) {
+            if (pthread_cond_timedwait(&flight->loaded, &flight->lock, &deadline) == ETIMEDOUT &&
+                entry->loading) {
+                //the first request is stuck on the disk, don't wait forever
+                release_locked(entry);
+                pthread_mutex_unlock(&flight->lock);
+                return open_private(flight, path, file);
+            }
+        }
+        flight->n_coalesced++;
+    }
+
+    error = entry->error;
+    if (error != 0) {
+        release_locked(entry);
+    } else {
+        *file = entry;
+    }
+    pthread_mutex_unlock(&flight->lock);
+    return error;
+}
+
+void file_flight_release(shared_file_t *file) {
+    file_flight_t *flight = file->owner;
+    if (!file->shared) {
+        //private copies are never joined, so this is the only reference
+        if (file->fd != -1) {
+            close(file->fd);
+        }
+        if (!file->pooled) {
+            free(file);
+            return;
+        }
+    }
+    if (flight == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&flight->lock);
+    if (file->shared) {
+        release_locked(file);
+    } else {
+        file_recycle(file);
+    }
+    pthread_mutex_unlock(&flight->lock);
+}
+
+int file_flight_free(file_flight_t *flight) {
+    int error;
+    for (int i = 0; i < FLIGHT_BUCKETS; i++) {
+        if (flight->buckets[i] != NULL) {
+            fprintf(stderr, "file_flight_free: %s still loading\n", flight->buckets[i]->path);
+        }
+    }
+    if (flight->n_free != FLIGHT_POOL_SIZE) {
+        fprintf(stderr, "file_flight_free: %d files still in use\n", FLIGHT_POOL_SIZE - flight->n_free);
+    }
+    if ((error = pthread_cond_destroy(&flight->loaded)) != 0) {
+        fprintf(stderr, "pthread_cond_destroy failed: %s\n", strerror(error));
+        pthread_mutex_destroy(&flight->lock);
+        free(flight->files);
+        return -1;
+    }
+    if ((error = pthread_mutex_destroy(&flight->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(error));
+        free(flight->files);
+        return -1;
+    }
+    free(flight->files);
+    return 0;
+}
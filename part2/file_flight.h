@@ -0,0 +1,81 @@
+#ifndef FILE_FLIGHT_H
+#define FILE_FLIGHT_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define FLIGHT_BUCKETS 256          // Power of two
+#define FLIGHT_WAIT_MS 2000         // Longest a request waits for another's open
+#define FLIGHT_POOL_SIZE 64         // Preallocated file entries
+#define FLIGHT_PATH_LEN 1024        // Longer paths are opened without joining
+
+struct file_flight;
+
+// An open file shared by every response that asked for the same path while
+// it was being opened. The descriptor is only ever read with pread/sendfile
+// at explicit offsets, so sharing it is safe.
+typedef struct shared_file {
+    int fd;                     // -1 if the open failed
+    off_t size;
+    int error;                  // errno of the failed open or fstat, 0 on success
+    int loading;                // Set while the first requester is opening it
+    int refcount;
+    int shared;                 // Clear for a private copy made after a timeout
+    unsigned long hash;
+    struct file_flight *owner;  // Table the entry belongs to, NULL without one
+    int pooled;                 // Taken from the owner's free list, not the heap
+    struct shared_file *next;   // Bucket chain while loading, then free list
+    char path[FLIGHT_PATH_LEN];
+} shared_file_t;
+
+// Single-flight table of files being opened. The first request for a path
+// opens and stats it; requests for the same path that arrive in the meantime
+// wait for that result instead of going to the disk themselves, and then
+// share the descriptor. An entry leaves the table as soon as its open
+// finishes, so a later request always sees the file as it is now, and the
+// descriptor is closed when the last response using it is done. Entries are
+// recycled through a free list so that a miss does not touch malloc/free.
+typedef struct file_flight {
+    shared_file_t *buckets[FLIGHT_BUCKETS];
+    shared_file_t *files;       // One block holding every pooled entry
+    shared_file_t *free_list;
+    int n_free;
+    long n_overflow;            // Entries that had to be heap allocated
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      // Broadcast whenever an open finishes
+    long n_coalesced;           // Requests that reused another's open
+} file_flight_t;
+
+/*
+ * Initialize an empty single-flight table and preallocate its entries
+ * flight: Pointer to the file_flight_t to be initialized
+ * Returns 0 on success or -1 on error
+ */
+int file_flight_init(file_flight_t *flight);
+
+/*
+ * Open a file for reading, or join an open of the same path that is already
+ * in progress. A request that waits longer than FLIGHT_WAIT_MS opens a
+ * private descriptor instead.
+ * flight: The single-flight table, or NULL to just open the file
+ * path: Path of the file
+ * file: Set to the referenced file on success
+ * Returns 0 on success, or the errno of the failed open or fstat, which every
+ * request that joined it gets as well
+ */
+int file_flight_open(file_flight_t *flight, const char *path, shared_file_t **file);
+
+/*
+ * Drop a reference returned by file_flight_open(), closing the file once the
+ * last one is gone
+ * file: The file
+ */
+void file_flight_release(shared_file_t *file);
+
+/*
+ * Deallocates a single-flight table. Every file must have been released.
+ * Returns 0 on success or -1 on error
+ */
+int file_flight_free(file_flight_t *flight);
+
+#endif // FILE_FLIGHT_H
@@ -0,0 +1,1162 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "connection_queue.h"
+#include "h2.h"
+#include "mime.h"
+#include "probes.h"
+#include "rate_limit.h"
+#include "send_loop.h"
+#include "stats.h"
+#include "timeutil.h"
+#include "trace.h"
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// Error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_UPGRADE_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+// Set by h2_drain() when the server is shutting down
+static volatile int draining;
+// Where connections wait for a worker, NULL to never close idle ones early
+static connection_queue_t *backlog;
+static int backlog_workers;
+// Workers currently serving an HTTP/2 connection
+static int n_serving;
+// Connection objects of finished HTTP/2 connections, kept for the next ones.
+// A connection holds its worker, so there are never more than the workers.
+static h2_conn_t *free_conns;
+static pthread_mutex_t free_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pseudo-headers and headers of a request that the server acts on
+typedef struct {
+    char method[16];
+    char path[RESOURCE_NAME_LEN];
+    int has_method;
+    int has_path;
+    int has_scheme;
+    int path_too_long;
+    int accepts_gzip;
+    int regular_seen;           // A regular header came, no pseudo-header may follow
+    int malformed;
+} h2_request_t;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put_frame_header(uint8_t *p, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, stream_id & H2_MAX_WINDOW);
+}
+
+// Bytes queued for the socket but not written yet, DATA payload included
+static int output_pending(const h2_conn_t *h2) {
+    return h2->out_len > h2->out_sent || h2->data_left > 0;
+}
+
+// Returns how many bytes can be appended to the output buffer
+static size_t out_free(const h2_conn_t *h2) {
+    return sizeof(h2->out) - (h2->out_len - h2->out_sent);
+}
+
+// Makes room for n bytes at the end of the output buffer
+// Returns a pointer to the room, or NULL if the buffer is too full
+static uint8_t *out_space(h2_conn_t *h2, size_t n) {
+    if (h2->out_len + n > sizeof(h2->out)) {
+        memmove(h2->out, h2->out + h2->out_sent, h2->out_len - h2->out_sent);
+        h2->out_len -= h2->out_sent;
+        h2->out_sent = 0;
+        if (h2->out_len + n > sizeof(h2->out)) {
+            return NULL;
+        }
+    }
+    return h2->out + h2->out_len;
+}
+
+// Queues a frame whose payload is already known
+// Returns 0 on success or -1 if the output buffer is full
+static int queue_frame(h2_conn_t *h2, uint8_t type, uint8_t flags, uint32_t stream_id,
+                       const uint8_t *payload, size_t len) {
+    uint8_t *p = out_space(h2, H2_FRAME_HEADER_LEN + len);
+    if (p == NULL) {
+        fprintf(stderr, "HTTP/2 output buffer full\n");
+        return -1;
+    }
+    put_frame_header(p, len, type, flags, stream_id);
+    if (len > 0) {
+        memcpy(p + H2_FRAME_HEADER_LEN, payload, len);
+    }
+    h2->out_len += H2_FRAME_HEADER_LEN + len;
+    return 0;
+}
+
+static int queue_rst_stream(h2_conn_t *h2, uint32_t stream_id, uint32_t error) {
+    uint8_t payload[4];
+    put_u32(payload, error);
+    return queue_frame(h2, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static int queue_window_update(h2_conn_t *h2, uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    put_u32(payload, increment);
+    return queue_frame(h2, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+// Tells the client no stream after the last one it opened will be served,
+// and starts closing the connection
+static void queue_goaway(h2_conn_t *h2, uint32_t error) {
+    uint8_t payload[8];
+    if (h2->goaway_sent) {
+        return;
+    }
+    put_u32(payload, h2->last_stream_id);
+    put_u32(payload + 4, error);
+    if (queue_frame(h2, H2_GOAWAY, 0, 0, payload, sizeof(payload)) == 0) {
+        h2->goaway_sent = 1;
+    }
+    h2->closing = 1;
+    if (error != H2_NO_ERROR) {
+        h2->fatal = 1;
+    }
+}
+
+static h2_stream_t *find_stream(h2_conn_t *h2, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h2->streams[i].id == id) {
+            return &h2->streams[i];
+        }
+    }
+    return NULL;
+}
+
+// Releases what a stream holds, accounts for it and frees its slot
+static void stream_finish(h2_conn_t *h2, h2_stream_t *stream, int completed) {
+    stats_count(completed ? STATS_COMPLETED : STATS_FAILED, 1);
+    http_trace(h2->conn, stream->arrival_ns, stream->status, stream->bytes, completed, TRACE_FLAG_H2,
+               stream->path);
+    if (completed && stream->body_fd != -1) {
+        PROBE_BODY_DONE(h2->fd, stream->end - stream->body_start);
+    }
+    if (stream->file != NULL) {
+        http_release_file(stream->file);
+    }
+    stream->id = 0;
+    h2->n_active--;
+}
+
+// Queues the HEADERS frame of a response
+// Returns 0 on success or -1 on error
+static int queue_response_headers(h2_conn_t *h2, h2_stream_t *stream, int end_stream,
+                                  const char *content_type, uint64_t content_length,
+                                  const char *etag, int gzip) {
+    //the block is small: a few indexed or literal fields
+    uint8_t *frame = out_space(h2, H2_OUT_RESERVE);
+    if (frame == NULL) {
+        return -1;
+    }
+    uint8_t *block = frame + H2_FRAME_HEADER_LEN;
+    size_t cap = H2_OUT_RESERVE - H2_FRAME_HEADER_LEN;
+    size_t len = 0;
+    char status[4];
+    char length[24];
+    int n;
+    snprintf(status, sizeof(status), "%d", stream->status);
+    snprintf(length, sizeof(length), "%llu", (unsigned long long)content_length);
+
+    if ((n = hpack_encode(&h2->encoder, block, cap, ":status", status, 0)) < 0) {
+        return -1;
+    }
+    len += n;
+    //content types and encodings repeat across a page's assets, index them
+    if (content_type != NULL) {
+        if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "content-type", content_type, 1)) < 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "content-length", length, 0)) < 0) {
+        return -1;
+    }
+    len += n;
+    if (etag != NULL) {
+        if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "etag", etag, 0)) < 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if (gzip) {
+        if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "content-encoding", "gzip", 1)) < 0) {
+            return -1;
+        }
+        len += n;
+        if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "vary", "accept-encoding", 1)) < 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if (stream->status == 405) {
+        if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "allow", "GET, HEAD", 1)) < 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if (stream->status == 429) {
+        if ((n = hpack_encode(&h2->encoder, block + len, cap - len, "retry-after", "1", 0)) < 0) {
+            return -1;
+        }
+        len += n;
+    }
+    put_frame_header(frame, len, H2_HEADERS, H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0),
+                     stream->id);
+    h2->out_len += H2_FRAME_HEADER_LEN + len;
+    stream->bytes += H2_FRAME_HEADER_LEN + len;
+    PROBE_HEADER_SENT(h2->fd, H2_FRAME_HEADER_LEN + len);
+    return 0;
+}
+
+// Finds the body of a request and queues the response headers. Responses
+// without a body are finished right away, the others are sent by send_data.
+// Returns 0 on success or -1 on error
+static int stream_respond(h2_conn_t *h2, h2_stream_t *stream, const h2_request_t *request,
+                          int limited) {
+    int head = strcmp(request->method, "HEAD") == 0;
+    const char *content_type = NULL;
+    const char *etag = NULL;
+    char etag_buf[BUNDLE_ETAG_LEN + 1];
+    char mime_buf[BUNDLE_MIME_LEN + 1];
+    int gzip = 0;
+
+    if (limited) {
+        stream->status = 429;
+    } else if (!head && strcmp(request->method, "GET") != 0) {
+        stream->status = 405;
+    } else if (request->path_too_long) {
+        stream->status = 414;
+    } else if (h2->bundle != NULL) {
+        const bundle_entry_t *entry = bundle_lookup(h2->bundle, stream->path);
+        if (entry == NULL) {
+            stream->status = 404;
+        } else {
+            gzip = request->accepts_gzip && entry->gzip_offset != 0;
+            off_t offset = gzip ? entry->gzip_offset : entry->offset;
+            uint64_t length = gzip ? entry->gzip_length : entry->length;
+            if ((uint64_t)offset + length > h2->bundle->map_size) {
+                fprintf(stderr, "bundle entry %s out of bounds\n", stream->path);
+                return -1;
+            }
+            stream->status = 200;
+            stream->body_fd = h2->bundle->fd;
+            stream->body_start = offset;
+            stream->offset = offset;
+            stream->end = offset + length;
+            snprintf(mime_buf, sizeof(mime_buf), "%.*s", BUNDLE_MIME_LEN, entry->mime_type);
+            snprintf(etag_buf, sizeof(etag_buf), "%.*s", BUNDLE_ETAG_LEN, gzip ? entry->gzip_etag : entry->etag);
+            content_type = mime_buf;
+            etag = etag_buf;
+        }
+    } else {
+        char full_path[strlen(h2->serve_dir) + RESOURCE_NAME_LEN];
+        strcpy(full_path, h2->serve_dir);
+        strcat(full_path, stream->path);
+        int error = http_open_file(full_path, &stream->file);
+        if (error == ENOENT || error == ENOTDIR) {
+            stream->status = 404;
+        } else if (error != 0) {
+            fprintf(stderr, "open %s: %s\n", full_path, strerror(error));
+            return -1;
+        } else {
+            stream->status = 200;
+            stream->body_fd = stream->file->fd;
+            stream->end = stream->file->size;
+            const char *mime = get_mime_type(strrchr(stream->path, '.'));
+            content_type = mime != NULL ? mime : DEFAULT_MIME_TYPE;
+        }
+    }
+    if (stream->body_fd != -1) {
+        PROBE_OPEN(h2->fd, stream->path, stream->end - stream->body_start);
+    }
+
+    uint64_t length = stream->end - stream->offset;
+    int end_stream = head || length == 0;
+    if (queue_response_headers(h2, stream, end_stream, content_type, length, etag, gzip) != 0) {
+        return -1;
+    }
+    if (end_stream) {
+        stream_finish(h2, stream, 1);
+    }
+    return 0;
+}
+
+// Charges a new stream to the client's request rate. The connection's own
+// admission paid for its first stream; every later one takes a token, so a
+// client gets the same number of requests over HTTP/2 as over HTTP/1.
+// Returns nonzero if the stream is over the limit
+static int stream_over_limit(h2_conn_t *h2) {
+    http_conn_t *conn = h2->conn;
+    if (h2->n_opened++ == 0 || conn->limiter == NULL) {
+        return 0;
+    }
+    int result = rate_limit_take(conn->limiter, (struct sockaddr *)&conn->addr, conn->addr_len);
+    if (result != RATE_LIMIT_OK) {
+        PROBE_REJECT(h2->fd, result);
+        stats_count(STATS_REJECTED, 1);
+        return 1;
+    }
+    return 0;
+}
+
+// Opens a stream for a request whose headers have been decoded
+// Returns 0 on success or an HTTP/2 error code for the connection
+static int stream_open(h2_conn_t *h2, uint32_t id, const h2_request_t *request, uint64_t arrival_ns) {
+    if (h2->goaway_sent) {
+        //the client will retry it elsewhere
+        return H2_NO_ERROR;
+    }
+    if (request->malformed || !request->has_method || !request->has_path || !request->has_scheme) {
+        return queue_rst_stream(h2, id, H2_PROTOCOL_ERROR) == 0 ? H2_NO_ERROR : H2_INTERNAL_ERROR;
+    }
+    h2_stream_t *stream = find_stream(h2, 0);
+    if (stream == NULL) {
+        return queue_rst_stream(h2, id, H2_REFUSED_STREAM) == 0 ? H2_NO_ERROR : H2_INTERNAL_ERROR;
+    }
+    stream->id = id;
+    snprintf(stream->path, sizeof(stream->path), "%s", request->path);
+    stream->status = 0;
+    stream->body_fd = -1;
+    stream->file = NULL;
+    stream->body_start = 0;
+    stream->offset = 0;
+    stream->end = 0;
+    stream->window = h2->initial_window;
+    stream->done = 0;
+    stream->cancelled = 0;
+    stream->arrival_ns = arrival_ns;
+    stream->bytes = 0;
+    h2->n_active++;
+
+    PROBE_PARSE_DONE(h2->fd, stream->path);
+    stats_count(STATS_REQUESTS, 1);
+    stats_set_state(STATS_SENDING, stream->path);
+    if (stream_respond(h2, stream, request, stream_over_limit(h2)) != 0) {
+        //only this stream fails, the others carry on
+        if (queue_rst_stream(h2, id, H2_INTERNAL_ERROR) != 0) {
+            return H2_INTERNAL_ERROR;
+        }
+        stream_finish(h2, stream, 0);
+    }
+    return H2_NO_ERROR;
+}
+
+// Collects the parts of a request header block the server acts on
+static int collect_header(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    h2_request_t *request = arg;
+    if (name_len > 0 && name[0] == ':') {
+        if (request->regular_seen) {
+            request->malformed = 1;
+        } else if (name_len == 7 && memcmp(name, ":method", 7) == 0 && !request->has_method) {
+            request->has_method = 1;
+            snprintf(request->method, sizeof(request->method), "%.*s", (int)value_len, value);
+        } else if (name_len == 5 && memcmp(name, ":path", 5) == 0 && !request->has_path) {
+            request->has_path = 1;
+            if (value_len == 0 || value[0] != '/') {
+                request->malformed = 1;
+            } else if (value_len >= RESOURCE_NAME_LEN) {
+                request->path_too_long = 1;
+            } else {
+                memcpy(request->path, value, value_len);
+                request->path[value_len] = '\0';
+            }
+        } else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0 && !request->has_scheme) {
+            request->has_scheme = 1;
+        } else if (!(name_len == 10 && memcmp(name, ":authority", 10) == 0)) {
+            request->malformed = 1;
+        }
+        return 0;
+    }
+    request->regular_seen = 1;
+    for (size_t i = 0; i < name_len; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            request->malformed = 1;
+        }
+    }
+    if (name_len == 10 && memcmp(name, "connection", 10) == 0) {
+        request->malformed = 1;
+    }
+    if (name_len == 15 && memcmp(name, "accept-encoding", 15) == 0) {
+        char copy[value_len + 1];
+        memcpy(copy, value, value_len);
+        copy[value_len] = '\0';
+        request->accepts_gzip = strcasestr(copy, "gzip") != NULL;
+    }
+    return 0;
+}
+
+// Decodes a complete header block and opens the stream it starts
+// Returns 0 on success or an HTTP/2 error code for the connection
+static int header_block_done(h2_conn_t *h2, uint32_t stream_id, const uint8_t *block, size_t len) {
+    h2_request_t request;
+    memset(&request, 0, sizeof(request));
+    //decoded even when the stream is refused, to keep the table in step
+    if (hpack_decode(&h2->decoder, block, len, collect_header, &request) != 0) {
+        return H2_COMPRESSION_ERROR;
+    }
+    if (stream_id <= h2->last_stream_id) {
+        //trailers of a request we already answered
+        return H2_NO_ERROR;
+    }
+    h2->last_stream_id = stream_id;
+    return stream_open(h2, stream_id, &request, trace_now());
+}
+
+// Applies the client's settings
+// Returns 0 on success or an HTTP/2 error code for the connection
+static int apply_settings(h2_conn_t *h2, const uint8_t *payload, size_t len) {
+    if (len % 6 != 0) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for (size_t i = 0; i < len; i += 6) {
+        int id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            hpack_set_max_size(&h2->encoder, value);
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return H2_PROTOCOL_ERROR;
+            }
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            //applies to the windows of open streams as well
+            for (int j = 0; j < H2_MAX_STREAMS; j++) {
+                if (h2->streams[j].id != 0) {
+                    h2->streams[j].window += (int64_t)value - h2->initial_window;
+                    if (h2->streams[j].window > H2_MAX_WINDOW) {
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                }
+            }
+            h2->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+                return H2_PROTOCOL_ERROR;
+            }
+            h2->max_frame = value;
+            break;
+        default:
+            //unknown settings must be ignored
+            break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+// Strips the padding of a DATA or HEADERS frame
+// Returns 0 on success or an HTTP/2 error code for the connection
+static int strip_padding(uint8_t flags, const uint8_t **payload, size_t *len) {
+    if ((flags & H2_FLAG_PADDED) == 0) {
+        return H2_NO_ERROR;
+    }
+    if (*len < 1 || (*payload)[0] >= *len) {
+        return H2_PROTOCOL_ERROR;
+    }
+    *len -= 1 + (*payload)[0];
+    (*payload)++;
+    return H2_NO_ERROR;
+}
+
+// Acts on one frame from the client
+// Returns 0 on success or an HTTP/2 error code for the connection
+static int handle_frame(h2_conn_t *h2, uint8_t type, uint8_t flags, uint32_t stream_id,
+                        const uint8_t *payload, size_t len) {
+    int error;
+    h2_stream_t *stream;
+    size_t frame_len = len;
+
+    if (!h2->settings_seen && type != H2_SETTINGS) {
+        return H2_PROTOCOL_ERROR;
+    }
+    //nothing may come between a HEADERS frame and its CONTINUATIONs
+    if (h2->header_stream != 0 && (type != H2_CONTINUATION || stream_id != h2->header_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (type) {
+    case H2_DATA:
+        if (stream_id == 0 || stream_id > h2->last_stream_id) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if ((error = strip_padding(flags, &payload, &len)) != H2_NO_ERROR) {
+            return error;
+        }
+        //request bodies are ignored, but the client gets its window back,
+        //padding included
+        if (frame_len > 0 && queue_window_update(h2, 0, frame_len) != 0) {
+            return H2_INTERNAL_ERROR;
+        }
+        stream = find_stream(h2, stream_id);
+        if (stream != NULL && (flags & H2_FLAG_END_STREAM) == 0 && frame_len > 0 &&
+            queue_window_update(h2, stream_id, frame_len) != 0) {
+            return H2_INTERNAL_ERROR;
+        }
+        return H2_NO_ERROR;
+
+    case H2_HEADERS:
+        if (stream_id == 0 || stream_id % 2 == 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if ((error = strip_padding(flags, &payload, &len)) != H2_NO_ERROR) {
+            return error;
+        }
+        if (flags & H2_FLAG_PRIORITY) {
+            if (len < 5) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            payload += 5;
+            len -= 5;
+        }
+        if (flags & H2_FLAG_END_HEADERS) {
+            return header_block_done(h2, stream_id, payload, len);
+        }
+        if (len > sizeof(h2->header_block)) {
+            return H2_PROTOCOL_ERROR;
+        }
+        memcpy(h2->header_block, payload, len);
+        h2->header_block_len = len;
+        h2->header_stream = stream_id;
+        return H2_NO_ERROR;
+
+    case H2_CONTINUATION:
+        if (h2->header_stream == 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (len > sizeof(h2->header_block) - h2->header_block_len) {
+            return H2_PROTOCOL_ERROR;
+        }
+        memcpy(h2->header_block + h2->header_block_len, payload, len);
+        h2->header_block_len += len;
+        if (flags & H2_FLAG_END_HEADERS) {
+            h2->header_stream = 0;
+            return header_block_done(h2, stream_id, h2->header_block, h2->header_block_len);
+        }
+        return H2_NO_ERROR;
+
+    case H2_PRIORITY:
+        //every stream gets an equal share, priorities are not used
+        if (stream_id == 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (len != 5) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        return H2_NO_ERROR;
+
+    case H2_RST_STREAM:
+        if (stream_id == 0 || stream_id > h2->last_stream_id) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (len != 4) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        stream = find_stream(h2, stream_id);
+        if (stream != NULL) {
+            if (stream == h2->data_stream) {
+                //its frame header is out already, the payload has to follow
+                stream->cancelled = 1;
+            } else {
+                stream_finish(h2, stream, 0);
+            }
+        }
+        return H2_NO_ERROR;
+
+    case H2_SETTINGS:
+        if (stream_id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (flags & H2_FLAG_ACK) {
+            return len == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+        }
+        h2->settings_seen = 1;
+        if ((error = apply_settings(h2, payload, len)) != H2_NO_ERROR) {
+            return error;
+        }
+        return queue_frame(h2, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0) == 0 ? H2_NO_ERROR : H2_INTERNAL_ERROR;
+
+    case H2_PING:
+        if (stream_id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (len != 8) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        if (flags & H2_FLAG_ACK) {
+            return H2_NO_ERROR;
+        }
+        return queue_frame(h2, H2_PING, H2_FLAG_ACK, 0, payload, len) == 0 ? H2_NO_ERROR : H2_INTERNAL_ERROR;
+
+    case H2_GOAWAY:
+        if (stream_id != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        //finish what was asked for, then close
+        h2->closing = 1;
+        return H2_NO_ERROR;
+
+    case H2_WINDOW_UPDATE:
+        if (len != 4) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        uint32_t increment = get_u32(payload) & H2_MAX_WINDOW;
+        if (stream_id == 0) {
+            if (increment == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            h2->send_window += increment;
+            return h2->send_window > H2_MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+        }
+        stream = find_stream(h2, stream_id);
+        if (stream == NULL) {
+            return stream_id > h2->last_stream_id ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+        }
+        stream->window += increment;
+        if (increment == 0 || stream->window > H2_MAX_WINDOW) {
+            if (queue_rst_stream(h2, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR) != 0) {
+                return H2_INTERNAL_ERROR;
+            }
+            if (stream == h2->data_stream) {
+                stream->cancelled = 1;
+            } else {
+                stream_finish(h2, stream, 0);
+            }
+        }
+        return H2_NO_ERROR;
+
+    case H2_PUSH_PROMISE:
+        //clients cannot push
+        return H2_PROTOCOL_ERROR;
+
+    default:
+        //unknown frame types must be ignored
+        return H2_NO_ERROR;
+    }
+}
+
+// Acts on every complete frame received, as long as there is room for what
+// they make us send
+// Returns 0 on success or an HTTP/2 error code for the connection
+static int process_input(h2_conn_t *h2) {
+    size_t pos = 0;
+    int error = H2_NO_ERROR;
+    while (!h2->fatal && h2->data_left == 0 && out_free(h2) >= H2_OUT_RESERVE) {
+        size_t avail = h2->in_len - pos;
+        if (h2->preface_pos < H2_PREFACE_LEN) {
+            size_t n = H2_PREFACE_LEN - h2->preface_pos;
+            if (n > avail) {
+                n = avail;
+            }
+            if (n == 0) {
+                break;
+            }
+            if (memcmp(h2->in + pos, H2_PREFACE + h2->preface_pos, n) != 0) {
+                error = H2_PROTOCOL_ERROR;
+                break;
+            }
+            h2->preface_pos += n;
+            pos += n;
+            continue;
+        }
+        if (avail < H2_FRAME_HEADER_LEN) {
+            break;
+        }
+        const uint8_t *p = h2->in + pos;
+        size_t len = ((size_t)p[0] << 16) | (p[1] << 8) | p[2];
+        if (len > H2_MAX_FRAME_SIZE) {
+            error = H2_FRAME_SIZE_ERROR;
+            break;
+        }
+        if (avail < H2_FRAME_HEADER_LEN + len) {
+            break;
+        }
+        error = handle_frame(h2, p[3], p[4], get_u32(p + 5) & H2_MAX_WINDOW, p + H2_FRAME_HEADER_LEN, len);
+        pos += H2_FRAME_HEADER_LEN + len;
+        if (error != H2_NO_ERROR) {
+            break;
+        }
+    }
+    memmove(h2->in, h2->in + pos, h2->in_len - pos);
+    h2->in_len -= pos;
+    return error;
+}
+
+// Queues DATA frames, taking turns between the streams that have body left
+// and window to send it in. Nothing is sent before the client's SETTINGS:
+// after an upgrade, clients only buffer so much before they start reading
+// frames.
+// Returns the number of frames queued
+static int send_data(h2_conn_t *h2) {
+    int n_frames = 0;
+    while (h2->settings_seen && h2->data_left == 0 && h2->send_window > 0) {
+        h2_stream_t *stream = NULL;
+        int slot = 0;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            slot = (h2->next_turn + i) % H2_MAX_STREAMS;
+            h2_stream_t *candidate = &h2->streams[slot];
+            if (candidate->id != 0 && candidate->status != 0 && candidate->offset < candidate->end &&
+                candidate->window > 0) {
+                stream = candidate;
+                break;
+            }
+        }
+        if (stream == NULL) {
+            return n_frames;
+        }
+
+        int64_t n = stream->end - stream->offset;
+        if (n > stream->window) {
+            n = stream->window;
+        }
+        if (n > h2->send_window) {
+            n = h2->send_window;
+        }
+        if (n > h2->max_frame) {
+            n = h2->max_frame;
+        }
+        int end_stream = stream->offset + n == stream->end;
+        uint8_t *frame = out_space(h2, H2_FRAME_HEADER_LEN + (n <= H2_COPY_MAX ? n : 0));
+        if (frame == NULL) {
+            //wait for the socket to take what is queued
+            return n_frames;
+        }
+        if (n <= H2_COPY_MAX) {
+            //small payloads share a write with the frames around them
+            ssize_t bytes_read = pread(stream->body_fd, frame + H2_FRAME_HEADER_LEN, n, stream->offset);
+            if (bytes_read != n) {
+                perror("pread");
+                if (queue_rst_stream(h2, stream->id, H2_INTERNAL_ERROR) != 0) {
+                    queue_goaway(h2, H2_INTERNAL_ERROR);
+                }
+                stream_finish(h2, stream, 0);
+                continue;
+            }
+            h2->out_len += H2_FRAME_HEADER_LEN + n;
+        } else {
+            h2->out_len += H2_FRAME_HEADER_LEN;
+            h2->data_stream = stream;
+            h2->data_left = n;
+        }
+        put_frame_header(frame, n, H2_DATA, end_stream ? H2_FLAG_END_STREAM : 0, stream->id);
+        if (n <= H2_COPY_MAX) {
+            stream->offset += n;
+        }
+        stream->window -= n;
+        stream->bytes += H2_FRAME_HEADER_LEN + n;
+        h2->send_window -= n;
+        h2->next_turn = slot + 1;
+        n_frames++;
+        if (end_stream) {
+            stream->done = 1;
+            if (h2->data_stream != stream) {
+                stream_finish(h2, stream, 1);
+            }
+        }
+    }
+    return n_frames;
+}
+
+// Writes queued output, then the pending DATA payload, until the socket
+// stops taking it
+// Returns 0 on success or -1 on error
+static int flush_output(h2_conn_t *h2) {
+    while (h2->out_sent < h2->out_len) {
+        ssize_t bytes_written = write(h2->fd, h2->out + h2->out_sent, h2->out_len - h2->out_sent);
+        if (bytes_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        h2->out_sent += bytes_written;
+        h2->last_activity_ms = monotonic_ms();
+        stats_add_bytes(bytes_written);
+    }
+    h2->out_len = 0;
+    h2->out_sent = 0;
+
+    h2_stream_t *stream = h2->data_stream;
+    while (h2->data_left > 0) {
+        ssize_t bytes_sent = sendfile(h2->fd, stream->body_fd, &stream->offset, h2->data_left);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendfile");
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            fprintf(stderr, "%s changed size while being sent\n", stream->path);
+            return -1;
+        }
+        h2->data_left -= bytes_sent;
+        h2->last_activity_ms = monotonic_ms();
+        stats_add_bytes(bytes_sent);
+    }
+    if (stream != NULL) {
+        h2->data_stream = NULL;
+        if (stream->cancelled) {
+            stream_finish(h2, stream, 0);
+        } else if (stream->done) {
+            stream_finish(h2, stream, 1);
+        }
+    }
+    return 0;
+}
+
+// Decodes base64url without padding, as used by the HTTP2-Settings header
+// Returns the decoded length or -1 if the input is not valid
+static int base64url_decode(const char *in, size_t len, uint8_t *out, size_t cap) {
+    uint32_t bits = 0;
+    int n_bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = in[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return -1;
+        }
+        bits = (bits << 6) | value;
+        n_bits += 6;
+        if (n_bits >= 8) {
+            n_bits -= 8;
+            if (n == cap) {
+                return -1;
+            }
+            out[n++] = bits >> n_bits;
+        }
+    }
+    return n;
+}
+
+// Switches an HTTP/1.1 connection that asked for h2c: applies the settings
+// from its HTTP2-Settings header and answers 101
+// Returns 0 on success or -1 if the upgrade cannot be accepted
+static int accept_upgrade(h2_conn_t *h2) {
+    const http_request_t *request = &h2->conn->request;
+    uint8_t settings[H2_MAX_FRAME_SIZE];
+    int len = base64url_decode(request->h2_settings, request->h2_settings_len, settings, sizeof(settings));
+    //the header stands in for a SETTINGS frame and needs no ACK
+    if (len < 0 || apply_settings(h2, settings, len) != H2_NO_ERROR) {
+        fprintf(stderr, "Invalid HTTP2-Settings header\n");
+        return -1;
+    }
+    size_t response_len = strlen(H2_UPGRADE_RESPONSE);
+    memcpy(out_space(h2, response_len), H2_UPGRADE_RESPONSE, response_len);
+    h2->out_len += response_len;
+    return 0;
+}
+
+// Takes a connection object from the free list, or allocates one
+// Returns the object, or NULL on error
+static h2_conn_t *h2_conn_acquire(void) {
+    pthread_mutex_lock(&free_conns_lock);
+    h2_conn_t *h2 = free_conns;
+    if (h2 != NULL) {
+        free_conns = h2->next_free;
+    }
+    pthread_mutex_unlock(&free_conns_lock);
+    if (h2 == NULL) {
+        //too big for the connection's arena, and lives as long as the connection
+        h2 = malloc(sizeof(h2_conn_t));
+        if (h2 == NULL) {
+            perror("malloc");
+        }
+    }
+    return h2;
+}
+
+static void h2_conn_release(h2_conn_t *h2) {
+    pthread_mutex_lock(&free_conns_lock);
+    h2->next_free = free_conns;
+    free_conns = h2;
+    pthread_mutex_unlock(&free_conns_lock);
+}
+
+int h2_serve(http_conn_t *conn, const char *serve_dir, bundle_t *bundle) {
+    h2_conn_t *h2 = h2_conn_acquire();
+    if (h2 == NULL) {
+        http_conn_close(conn);
+        return -1;
+    }
+    memset(h2->streams, 0, sizeof(h2->streams));
+    h2->conn = conn;
+    h2->fd = conn->fd;
+    h2->serve_dir = serve_dir;
+    h2->bundle = bundle;
+    h2->n_active = 0;
+    h2->n_opened = 0;
+    h2->next_turn = 0;
+    h2->last_stream_id = 0;
+    h2->send_window = H2_DEFAULT_WINDOW;
+    h2->initial_window = H2_DEFAULT_WINDOW;
+    h2->max_frame = H2_MAX_FRAME_SIZE;
+    hpack_table_init(&h2->decoder);
+    hpack_table_init(&h2->encoder);
+    h2->preface_pos = 0;
+    h2->settings_seen = 0;
+    h2->in_len = 0;
+    h2->out_len = 0;
+    h2->out_sent = 0;
+    h2->data_stream = NULL;
+    h2->data_left = 0;
+    h2->header_block_len = 0;
+    h2->header_stream = 0;
+    h2->goaway_sent = 0;
+    h2->closing = 0;
+    h2->fatal = 0;
+    h2->peer_closed = 0;
+    h2->last_activity_ms = monotonic_ms();
+    h2->served_since_ms = h2->last_activity_ms;
+    __atomic_fetch_add(&n_serving, 1, __ATOMIC_RELAXED);
+
+    const http_request_t *request = &conn->request;
+    int error = H2_NO_ERROR;
+    int result = 0;
+    if (request->protocol == HTTP_PROTO_H2) {
+        //read_http_request already matched the start of the preface
+        h2->preface_pos = H2_PREFACE_HEAD_LEN;
+    } else if (accept_upgrade(h2) != 0) {
+        result = -1;
+        goto done;
+    }
+    memcpy(h2->in, request->extra, request->extra_len);
+    h2->in_len = request->extra_len;
+
+    //our settings are the first frame either way
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_ENABLE_PUSH;
+    put_u32(settings + 8, 0);
+    queue_frame(h2, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    if (request->protocol == HTTP_PROTO_H2C_UPGRADE) {
+        //the upgraded request is stream 1, answered over HTTP/2
+        h2_request_t upgraded;
+        memset(&upgraded, 0, sizeof(upgraded));
+        snprintf(upgraded.method, sizeof(upgraded.method), "GET");
+        snprintf(upgraded.path, sizeof(upgraded.path), "%s", request->resource_name);
+        upgraded.has_method = upgraded.has_path = upgraded.has_scheme = 1;
+        upgraded.accepts_gzip = request->accepts_gzip;
+        h2->last_stream_id = 1;
+        error = stream_open(h2, 1, &upgraded, conn->accept_ns);
+    }
+
+    while (1) {
+        if (draining && !h2->goaway_sent && h2->data_left == 0) {
+            queue_goaway(h2, H2_NO_ERROR);
+        }
+        if (error == H2_NO_ERROR && !h2->fatal) {
+            error = process_input(h2);
+        }
+        if (error != H2_NO_ERROR && !h2->fatal) {
+            fprintf(stderr, "HTTP/2 connection error %d\n", error);
+            queue_goaway(h2, error);
+            result = -1;
+        }
+        //keep the socket busy until it pushes back or the windows run out
+        int n_frames;
+        int failed;
+        do {
+            n_frames = h2->fatal ? 0 : send_data(h2);
+            failed = flush_output(h2) != 0;
+        } while (!failed && n_frames > 0 && !output_pending(h2));
+        if (failed) {
+            result = -1;
+            break;
+        }
+        int pending = output_pending(h2);
+        if (!pending && h2->closing && (h2->fatal || h2->n_active == 0)) {
+            //frames the client still sends must not reset the connection
+            //before it has read our last ones
+            conn->linger = 1;
+            break;
+        }
+        if (h2->peer_closed) {
+            //nobody left to send the rest to
+            break;
+        }
+
+        long now = monotonic_ms();
+        long idle = now - h2->last_activity_ms;
+        int waiting = backlog != NULL && connection_queue_waiting(backlog) > 0;
+        if (h2->n_active == 0 && !pending && !h2->goaway_sent &&
+            (idle > H2_IDLE_TIMEOUT_MS || (idle > H2_YIELD_MS && waiting))) {
+            queue_goaway(h2, H2_NO_ERROR);
+            continue;
+        }
+        //a busy connection gives the worker up too once nobody else can take
+        //from the queue: it takes no new streams, finishes the ones it has
+        //and the client reconnects behind the queue
+        if (waiting && !h2->goaway_sent && h2->data_left == 0 &&
+            __atomic_load_n(&n_serving, __ATOMIC_RELAXED) >= backlog_workers &&
+            now - h2->served_since_ms > H2_BUSY_YIELD_MS) {
+            queue_goaway(h2, H2_NO_ERROR);
+            continue;
+        }
+        if ((h2->n_active > 0 || pending) && idle > SEND_TIMEOUT_MS) {
+            fprintf(stderr, "HTTP/2 client on fd %d stalled, dropping connection\n", h2->fd);
+            result = -1;
+            break;
+        }
+
+        struct pollfd pfd = { .fd = h2->fd, .events = 0 };
+        if (pending) {
+            pfd.events |= POLLOUT;
+        }
+        if (h2->in_len < sizeof(h2->in) && !h2->fatal) {
+            pfd.events |= POLLIN;
+        }
+        int ready = poll(&pfd, 1, H2_POLL_MS);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            result = -1;
+            break;
+        }
+        if (ready == 0) {
+            continue;
+        }
+        if ((pfd.revents & (POLLERR | POLLHUP)) && !(pfd.events & POLLIN)) {
+            result = -1;
+            break;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t bytes_read = read(h2->fd, h2->in + h2->in_len, sizeof(h2->in) - h2->in_len);
+            if (bytes_read == 0) {
+                h2->peer_closed = 1;
+            } else if (bytes_read > 0) {
+                h2->in_len += bytes_read;
+                h2->last_activity_ms = monotonic_ms();
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                if (errno != ECONNRESET) {
+                    perror("read");
+                }
+                result = -1;
+                break;
+            }
+        }
+    }
+
+done:
+    __atomic_fetch_sub(&n_serving, 1, __ATOMIC_RELAXED);
+    //streams cut off by the close
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h2->streams[i].id != 0) {
+            stream_finish(h2, &h2->streams[i], 0);
+        }
+    }
+    hpack_table_free(&h2->decoder);
+    hpack_table_free(&h2->encoder);
+    h2_conn_release(h2);
+    http_conn_close(conn);
+    return result;
+}
+
+void h2_set_backlog(connection_queue_t *queue, int n_workers) {
+    backlog = queue;
+    backlog_workers = n_workers;
+}
+
+void h2_drain(void) {
+    draining = 1;
+}
+
+void h2_pool_free(void) {
+    pthread_mutex_lock(&free_conns_lock);
+    while (free_conns != NULL) {
+        h2_conn_t *h2 = free_conns;
+        free_conns = h2->next_free;
+        free(h2);
+    }
+    pthread_mutex_unlock(&free_conns_lock);
+}
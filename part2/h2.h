@@ -0,0 +1,139 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "bundle.h"
+#include "file_flight.h"
+#include "hpack.h"
+#include "http.h"
+
+struct connection_queue;
+
+/*
+ * Cleartext HTTP/2 (h2c, RFC 7540), either with prior knowledge, where the
+ * client opens with the connection preface, or upgraded from an HTTP/1.1
+ * request carrying "Upgrade: h2c".
+ *
+ * An HTTP/2 connection stays with the worker that read its first request
+ * until it is closed. The worker multiplexes every stream on it: request
+ * headers are answered as soon as they arrive, and response bodies are sent
+ * round-robin, one DATA frame per stream at a time, within the flow control
+ * windows of the stream and the connection. Small bodies are copied into the
+ * output buffer so that many of them go out in one write; larger DATA
+ * frames follow their frame header straight from the file with sendfile().
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_PREFACE_HEAD_LEN 18      // Part of the preface that looks like a request
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_FRAME_SIZE 16384     // Largest frame we accept, the protocol default
+#define H2_HEADER_BLOCK_MAX 16384   // Largest header block, CONTINUATIONs included
+#define H2_MAX_STREAMS 100          // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_OUT_BUFSIZE 32768
+#define H2_OUT_RESERVE 1024         // Output room needed before reading a frame
+#define H2_COPY_MAX 4096            // DATA payloads up to this size are copied
+#define H2_IDLE_TIMEOUT_MS 10000    // A connection with no streams is closed after this
+#define H2_YIELD_MS 100             // Idle time after which a connection closes early for
+                                    // others if new connections are waiting for a worker
+#define H2_BUSY_YIELD_MS 1000       // Time a busy connection may hold its worker while
+                                    // every worker is held by HTTP/2 and others wait
+#define H2_POLL_MS 100              // How often a waiting connection checks the above
+
+// One request and its response
+typedef struct h2_stream {
+    uint32_t id;                // 0 if the slot is free
+    char path[RESOURCE_NAME_LEN];
+    int status;
+    int body_fd;                // Body source, -1 if there is no body
+    shared_file_t *file;        // File to release when done, or NULL
+    off_t body_start;
+    off_t offset;               // Next body byte to send
+    off_t end;                  // One past the last body byte
+    int64_t window;             // Bytes the client lets us send on this stream
+    int done;                   // The last frame has been queued
+    int cancelled;              // Reset by the client while a frame was in flight
+    uint64_t arrival_ns;        // On the trace clock
+    uint64_t bytes;             // Frame bytes queued, headers included
+} h2_stream_t;
+
+// State of one HTTP/2 connection
+typedef struct h2_conn {
+    http_conn_t *conn;
+    int fd;
+    const char *serve_dir;      // Directory files are served from, or NULL
+    bundle_t *bundle;           // Bundle served from instead, or NULL
+    h2_stream_t streams[H2_MAX_STREAMS];
+    int n_active;
+    uint32_t n_opened;          // Streams opened so far, for the rate limit
+    int next_turn;              // Stream slot that sends the next DATA frame
+    uint32_t last_stream_id;    // Highest stream the client has opened
+    int64_t send_window;        // Connection flow control window
+    int64_t initial_window;     // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame;         // Peer's SETTINGS_MAX_FRAME_SIZE
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    int preface_pos;            // Bytes of the client preface seen so far
+    int settings_seen;          // The client's first SETTINGS arrived
+    uint8_t in[H2_FRAME_HEADER_LEN + H2_MAX_FRAME_SIZE];
+    size_t in_len;
+    uint8_t out[H2_OUT_BUFSIZE];
+    size_t out_len;
+    size_t out_sent;
+    h2_stream_t *data_stream;   // Stream whose DATA payload follows the output
+    size_t data_left;           // Bytes of that payload still to sendfile()
+    uint8_t header_block[H2_HEADER_BLOCK_MAX];
+    size_t header_block_len;
+    uint32_t header_stream;     // Stream a CONTINUATION is expected for, or 0
+    int goaway_sent;
+    int closing;                // Finish the open streams, then close
+    int fatal;                  // Close as soon as the GOAWAY is out
+    int peer_closed;
+    long last_activity_ms;
+    long served_since_ms;       // When this worker took the connection
+    struct h2_conn *next_free;  // Next in the free list while not in use
+} h2_conn_t;
+
+/*
+ * Serve a connection over HTTP/2 until either side closes it, then close it
+ * and release it
+ * conn: The connection, whose request was either the start of the preface or
+ *       an h2c upgrade (see http_request_t.protocol)
+ * serve_dir: The directory to serve files from, NULL when serving a bundle
+ * bundle: The bundle to serve from, NULL when serving serve_dir. The caller
+ *         keeps its reference until this returns.
+ * Returns 0 if the connection ended cleanly or -1 on error
+ */
+int h2_serve(http_conn_t *conn, const char *serve_dir, bundle_t *bundle);
+
+/*
+ * While new connections are waiting in a queue, let HTTP/2 connections go
+ * (GOAWAY) once they have been idle for H2_YIELD_MS instead of
+ * H2_IDLE_TIMEOUT_MS, so that a client keeping a connection open does not
+ * hold a worker others need. A busy connection is only asked to go when every
+ * worker is held by an HTTP/2 connection, since otherwise the other workers
+ * still reach the queue, and only after it has held its worker for
+ * H2_BUSY_YIELD_MS. It finishes its open streams first. Queued connections
+ * therefore wait at most about H2_BUSY_YIELD_MS plus the time to finish those
+ * streams for a worker held by HTTP/2.
+ * queue: The queue workers take connections from, or NULL
+ * n_workers: The number of workers taking from it
+ */
+void h2_set_backlog(struct connection_queue *queue, int n_workers);
+
+/*
+ * Ask every HTTP/2 connection to stop taking new streams and close once the
+ * streams it has are done (GOAWAY)
+ */
+void h2_drain(void);
+
+/*
+ * Deallocates the connection objects kept for reuse. Every h2_serve() call
+ * must have returned.
+ */
+void h2_pool_free(void);
+
+#endif // H2_H
@@ -0,0 +1,440 @@
+#include <string.h>
+#include "hpack.h"
+
+typedef struct {
+    const char *name;
+    const char *value;
+} hpack_static_t;
+
+// RFC 7541 Appendix A, index 1 is static_table[0]
+static const hpack_static_t static_table[HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" },
+    { ":status", "200" }, { ":status", "204" }, { ":status", "206" }, { ":status", "304" },
+    { ":status", "400" }, { ":status", "404" }, { ":status", "500" },
+    { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+    { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" },
+    { "content-length", "" }, { "content-location", "" }, { "content-range", "" },
+    { "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" }, { "expect", "" },
+    { "expires", "" }, { "from", "" }, { "host", "" }, { "if-match", "" },
+    { "if-modified-since", "" }, { "if-none-match", "" }, { "if-range", "" },
+    { "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" }, { "location", "" },
+    { "max-forwards", "" }, { "proxy-authenticate", "" }, { "proxy-authorization", "" },
+    { "range", "" }, { "referer", "" }, { "refresh", "" }, { "retry-after", "" },
+    { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// The Huffman code of RFC 7541 Appendix B is canonical, so it is fully
+// described by how many codes there are of each length and the symbols in
+// code order. Symbol 256 is EOS.
+#define HUFFMAN_MAX_BITS 30
+static const uint16_t huffman_count[HUFFMAN_MAX_BITS + 1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+#define HUFFMAN_EOS 256
+
+// Decodes a Huffman coded string into out
+// Returns the decoded length or -1 if the string is invalid or too long
+static int huffman_decode(const uint8_t *in, size_t len, char *out, size_t cap) {
+    size_t n_out = 0;
+    int code = 0;           // Bits of the current symbol read so far
+    int first = 0;          // First code of the current length
+    int index = 0;          // Index in huffman_symbols of that first code
+    int bits = 0;           // Length of the current symbol so far
+    int all_ones = 1;       // Whether those bits are all ones, as padding must be
+    for (size_t i = 0; i < len; i++) {
+        for (int shift = 7; shift >= 0; shift--) {
+            int bit = (in[i] >> shift) & 1;
+            code |= bit;
+            all_ones &= bit;
+            bits++;
+            int count = huffman_count[bits];
+            if (code - first < count) {
+                int symbol = huffman_symbols[index + code - first];
+                if (symbol == HUFFMAN_EOS || n_out == cap) {
+                    return -1;
+                }
+                out[n_out++] = symbol;
+                code = first = index = bits = 0;
+                all_ones = 1;
+                continue;
+            }
+            if (bits == HUFFMAN_MAX_BITS) {
+                return -1;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    //whatever is left over must be a short run of EOS's leading ones
+    if (bits > 7 || !all_ones) {
+        return -1;
+    }
+    return n_out;
+}
+
+// Reads an integer with an n-bit prefix
+// Returns 0 on success or -1 if the input ends early or the value is too big
+static int decode_int(const uint8_t **pos, const uint8_t *end, int prefix_bits, size_t *value) {
+    if (*pos >= end) {
+        return -1;
+    }
+    size_t max_prefix = (1 << prefix_bits) - 1;
+    *value = **pos & max_prefix;
+    (*pos)++;
+    if (*value < max_prefix) {
+        return 0;
+    }
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*pos >= end) {
+            return -1;
+        }
+        uint8_t b = **pos;
+        (*pos)++;
+        *value += (size_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reads a string literal, Huffman decoding it if needed
+// Returns its length or -1 on error
+static int decode_string(const uint8_t **pos, const uint8_t *end, char *out, size_t cap) {
+    if (*pos >= end) {
+        return -1;
+    }
+    int huffman = **pos & 0x80;
+    size_t len;
+    if (decode_int(pos, end, 7, &len) != 0 || len > (size_t)(end - *pos)) {
+        return -1;
+    }
+    const uint8_t *data = *pos;
+    *pos += len;
+    if (huffman) {
+        return huffman_decode(data, len, out, cap);
+    }
+    if (len > cap) {
+        return -1;
+    }
+    memcpy(out, data, len);
+    return len;
+}
+
+// Drops the oldest entries until the table fits in 'limit' bytes
+static void evict_to(hpack_table_t *table, size_t limit) {
+    while (table->size > limit) {
+        int oldest = (table->first + table->count - 1) % HPACK_MAX_ENTRIES;
+        hpack_entry_t *entry = &table->entries[oldest];
+        table->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+        table->count--;
+    }
+    if (table->count == 0) {
+        table->data_end = 0;
+    }
+}
+
+// Moves the names and values of the live entries to the start of the data
+static void compact(hpack_table_t *table) {
+    int oldest = (table->first + table->count - 1) % HPACK_MAX_ENTRIES;
+    size_t start = table->entries[oldest].offset;
+    memmove(table->data, table->data + start, table->data_end - start);
+    for (int i = 0; i < table->count; i++) {
+        table->entries[(table->first + i) % HPACK_MAX_ENTRIES].offset -= start;
+    }
+    table->data_end -= start;
+}
+
+// Inserts a header as the newest entry, evicting as needed
+// Returns 0 on success or -1 on error
+static int table_insert(hpack_table_t *table, const char *name, size_t name_len,
+                        const char *value, size_t value_len) {
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > table->max_size) {
+        //not an error, the entry just empties the table
+        evict_to(table, 0);
+        return 0;
+    }
+    //copy first, the name may point into the data that compact() moves
+    char copy[HPACK_TABLE_SIZE];
+    memcpy(copy, name, name_len);
+    memcpy(copy + name_len, value, value_len);
+    evict_to(table, table->max_size - entry_size);
+    if (table->data_end + name_len + value_len > sizeof(table->data)) {
+        compact(table);
+    }
+    table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    hpack_entry_t *entry = &table->entries[table->first];
+    entry->offset = table->data_end;
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    memcpy(table->data + table->data_end, copy, name_len + value_len);
+    table->data_end += name_len + value_len;
+    table->count++;
+    table->size += entry_size;
+    return 0;
+}
+
+// Looks up a header by its index in the combined static and dynamic table
+// Returns 0 on success or -1 if there is no such index
+static int table_get(const hpack_table_t *table, size_t index, const char **name, size_t *name_len,
+                     const char **value, size_t *value_len) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (size_t)table->count) {
+        return -1;
+    }
+    const hpack_entry_t *entry = &table->entries[(table->first + index) % HPACK_MAX_ENTRIES];
+    *name = table->data + entry->offset;
+    *name_len = entry->name_len;
+    *value = table->data + entry->offset + entry->name_len;
+    *value_len = entry->value_len;
+    return 0;
+}
+
+void hpack_table_init(hpack_table_t *table) {
+    table->first = 0;
+    table->count = 0;
+    table->data_end = 0;
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+    table->min_pending_size = SIZE_MAX;
+    table->pending_max_size = SIZE_MAX;
+}
+
+void hpack_table_free(hpack_table_t *table) {
+    evict_to(table, 0);
+}
+
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len,
+                 hpack_header_fn fn, void *arg) {
+    const uint8_t *pos = block;
+    const uint8_t *end = block + len;
+    char name_buf[HPACK_STRING_MAX];
+    char value_buf[HPACK_STRING_MAX];
+    int seen_header = 0;
+    while (pos < end) {
+        uint8_t b = *pos;
+        size_t index;
+        const char *name;
+        const char *value;
+        size_t name_len;
+        size_t value_len;
+
+        if (b & 0x80) {
+            //indexed header field
+            if (decode_int(&pos, end, 7, &index) != 0 ||
+                table_get(table, index, &name, &name_len, &value, &value_len) != 0) {
+                return -1;
+            }
+        } else if ((b & 0xe0) == 0x20) {
+            //dynamic table size update, only allowed before the first header
+            size_t size;
+            if (seen_header || decode_int(&pos, end, 5, &size) != 0 || size > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            table->max_size = size;
+            evict_to(table, size);
+            continue;
+        } else {
+            //literal, with incremental indexing (01) or without (0000, 0001)
+            int indexing = (b & 0xc0) == 0x40;
+            if (decode_int(&pos, end, indexing ? 6 : 4, &index) != 0) {
+                return -1;
+            }
+            if (index == 0) {
+                int n = decode_string(&pos, end, name_buf, sizeof(name_buf));
+                if (n < 0) {
+                    return -1;
+                }
+                name = name_buf;
+                name_len = n;
+            } else if (table_get(table, index, &name, &name_len, &value, &value_len) != 0) {
+                return -1;
+            }
+            int n = decode_string(&pos, end, value_buf, sizeof(value_buf));
+            if (n < 0) {
+                return -1;
+            }
+            value = value_buf;
+            value_len = n;
+            if (indexing) {
+                //the callback gets the copy in name_buf, the entry may be evicted
+                if (name != name_buf) {
+                    memcpy(name_buf, name, name_len);
+                    name = name_buf;
+                }
+                if (table_insert(table, name, name_len, value, value_len) != 0) {
+                    return -1;
+                }
+            }
+        }
+        seen_header = 1;
+        if (fn(arg, name, name_len, value, value_len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void hpack_set_max_size(hpack_table_t *table, size_t size) {
+    if (size > HPACK_TABLE_SIZE) {
+        size = HPACK_TABLE_SIZE;
+    }
+    //a shrink the peer has not heard about yet still has to be announced
+    if (size < table->min_pending_size) {
+        table->min_pending_size = size;
+    }
+    table->pending_max_size = size;
+}
+
+// Writes an integer with an n-bit prefix, the high bits of the first byte
+// taken from 'flags'
+// Returns the number of bytes written or -1 if they would not fit
+static int encode_int(uint8_t *out, size_t cap, int prefix_bits, uint8_t flags, size_t value) {
+    size_t max_prefix = (1 << prefix_bits) - 1;
+    size_t n = 0;
+    if (cap == 0) {
+        return -1;
+    }
+    if (value < max_prefix) {
+        out[n++] = flags | value;
+        return n;
+    }
+    out[n++] = flags | max_prefix;
+    value -= max_prefix;
+    while (value >= 0x80) {
+        if (n == cap) {
+            return -1;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == cap) {
+        return -1;
+    }
+    out[n++] = value;
+    return n;
+}
+
+// Writes a string literal without Huffman coding
+// Returns the number of bytes written or -1 if they would not fit
+static int encode_string(uint8_t *out, size_t cap, const char *str, size_t len) {
+    int n = encode_int(out, cap, 7, 0, len);
+    if (n < 0 || len > cap - n) {
+        return -1;
+    }
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+int hpack_encode(hpack_table_t *table, uint8_t *out, size_t cap,
+                 const char *name, const char *value, int indexing) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    size_t n = 0;
+    int result;
+
+    if (table->pending_max_size != SIZE_MAX) {
+        if (table->min_pending_size < table->pending_max_size) {
+            if ((result = encode_int(out, cap, 5, 0x20, table->min_pending_size)) < 0) {
+                return -1;
+            }
+            n += result;
+        }
+        if ((result = encode_int(out + n, cap - n, 5, 0x20, table->pending_max_size)) < 0) {
+            return -1;
+        }
+        n += result;
+        table->max_size = table->pending_max_size;
+        evict_to(table, table->max_size);
+        table->min_pending_size = SIZE_MAX;
+        table->pending_max_size = SIZE_MAX;
+    }
+
+    size_t name_index = 0;
+    size_t full_index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES && full_index == 0; i++) {
+        if (strcmp(static_table[i].name, name) == 0) {
+            if (name_index == 0) {
+                name_index = i + 1;
+            }
+            if (strcmp(static_table[i].value, value) == 0) {
+                full_index = i + 1;
+            }
+        }
+    }
+    for (int i = 0; i < table->count && full_index == 0; i++) {
+        const hpack_entry_t *entry = &table->entries[(table->first + i) % HPACK_MAX_ENTRIES];
+        const char *data = table->data + entry->offset;
+        if (entry->name_len == name_len && memcmp(data, name, name_len) == 0) {
+            if (name_index == 0) {
+                name_index = HPACK_STATIC_ENTRIES + 1 + i;
+            }
+            if (entry->value_len == value_len &&
+                memcmp(data + name_len, value, value_len) == 0) {
+                full_index = HPACK_STATIC_ENTRIES + 1 + i;
+            }
+        }
+    }
+
+    if (full_index != 0) {
+        if ((result = encode_int(out + n, cap - n, 7, 0x80, full_index)) < 0) {
+            return -1;
+        }
+        return n + result;
+    }
+    if ((result = encode_int(out + n, cap - n, indexing ? 6 : 4, indexing ? 0x40 : 0x00, name_index)) < 0) {
+        return -1;
+    }
+    n += result;
+    if (name_index == 0) {
+        if ((result = encode_string(out + n, cap - n, name, name_len)) < 0) {
+            return -1;
+        }
+        n += result;
+    }
+    if ((result = encode_string(out + n, cap - n, value, value_len)) < 0) {
+        return -1;
+    }
+    n += result;
+    if (indexing && table_insert(table, name, name_len, value, value_len) != 0) {
+        return -1;
+    }
+    return n;
+}
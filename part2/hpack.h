@@ -0,0 +1,102 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541).
+ *
+ * Each direction of a connection has its own dynamic table: the decoder's
+ * mirrors what the client's encoder inserted, the encoder's mirrors what the
+ * client's decoder will hold after reading our header blocks. The decoder
+ * understands every representation, including Huffman coded strings. The
+ * encoder never Huffman codes, and only inserts headers that are likely to
+ * repeat on a connection, such as content types.
+ */
+
+#define HPACK_TABLE_SIZE 4096           // Default and largest dynamic table size
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_STRING_MAX 4096           // Longest decoded name or value accepted
+
+typedef struct {
+    size_t offset;              // Where the name starts in the table's data
+    size_t name_len;
+    size_t value_len;           // The value follows the name, neither terminated
+} hpack_entry_t;
+
+// Entries live in the table itself, so inserting and evicting never allocate.
+// Names and values are appended to data oldest first; when the end is reached
+// the live ones, at most HPACK_TABLE_SIZE bytes, move back to the start.
+typedef struct {
+    hpack_entry_t entries[HPACK_MAX_ENTRIES];   // Ring, entries[first] is newest
+    int first;
+    int count;
+    char data[2 * HPACK_TABLE_SIZE];
+    size_t data_end;            // Where the next name and value go
+    size_t size;                // Sum of the entry sizes
+    size_t max_size;            // Current limit, at most HPACK_TABLE_SIZE
+    size_t min_pending_size;    // Encoder only: smallest limit since the last
+    size_t pending_max_size;    // announcement and the one to announce, or SIZE_MAX
+} hpack_table_t;
+
+/*
+ * Called for each header decoded from a header block. Neither string is NUL
+ * terminated and both are only valid during the call.
+ * Returns 0 to continue or -1 to stop decoding with an error
+ */
+typedef int (*hpack_header_fn)(void *arg, const char *name, size_t name_len,
+                               const char *value, size_t value_len);
+
+/*
+ * Initialize an empty dynamic table of the default size
+ * table: Pointer to the hpack_table_t to be initialized
+ */
+void hpack_table_init(hpack_table_t *table);
+
+/*
+ * Empty a dynamic table. It holds no memory of its own, this only exists so
+ * that every init has a matching free.
+ * table: The table
+ */
+void hpack_table_free(hpack_table_t *table);
+
+/*
+ * Decode a complete header block
+ * table: The decoder's dynamic table, updated as the block says
+ * block: The header block, from a HEADERS frame and its CONTINUATIONs
+ * len: Length of the block in bytes
+ * fn: Called for every header, in order
+ * arg: Passed to fn
+ * Returns 0 on success or -1 if the block is malformed (a COMPRESSION_ERROR)
+ * or fn failed
+ */
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len,
+                 hpack_header_fn fn, void *arg);
+
+/*
+ * Change the dynamic table size the peer's decoder allows
+ * (SETTINGS_HEADER_TABLE_SIZE). The encoder announces the change at the start
+ * of its next header block.
+ * table: The encoder's dynamic table
+ * size: The peer's setting, capped at HPACK_TABLE_SIZE
+ */
+void hpack_set_max_size(hpack_table_t *table, size_t size);
+
+/*
+ * Append one header to a header block being built
+ * table: The encoder's dynamic table
+ * out: Where to write the encoded header
+ * cap: Bytes available at out
+ * name: Header name, lower case
+ * value: Header value
+ * indexing: Set to insert the header into the dynamic table, so that later
+ *           blocks can refer to it by index
+ * Returns the number of bytes written, or -1 if they would not fit
+ */
+int hpack_encode(hpack_table_t *table, uint8_t *out, size_t cap,
+                 const char *name, const char *value, int indexing);
+
+#endif // HPACK_H
@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "hpack.h"
+
+/*
+ * Checks hpack.c against the request examples of RFC 7541 appendix C: the
+ * three header blocks of C.3 (plain literals) and C.4 (Huffman coded) are
+ * decoded in order on one table each, and the C.3 blocks are encoded again
+ * from their header lists. Prints one line per check, for testius.
+ */
+
+#define MAX_HEADERS 8
+#define LIST_BUFSIZE 512
+
+typedef struct {
+    const char *name;
+    const char *value;
+} header_t;
+
+typedef struct {
+    const char *label;
+    const uint8_t *block;
+    size_t len;
+    header_t headers[MAX_HEADERS];
+    int indexing[MAX_HEADERS];      // Which headers the encoder inserts
+    size_t table_size;              // Dynamic table size afterwards
+} example_t;
+
+static const uint8_t c3_1[] = {
+    0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77, 0x77, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+    0x2e, 0x63, 0x6f, 0x6d,
+};
+static const uint8_t c3_2[] = {
+    0x82, 0x86, 0x84, 0xbe, 0x58, 0x08, 0x6e, 0x6f, 0x2d, 0x63, 0x61, 0x63, 0x68, 0x65,
+};
+static const uint8_t c3_3[] = {
+    0x82, 0x87, 0x85, 0xbf, 0x40, 0x0a, 0x63, 0x75, 0x73, 0x74, 0x6f, 0x6d, 0x2d, 0x6b, 0x65, 0x79,
+    0x0c, 0x63, 0x75, 0x73, 0x74, 0x6f, 0x6d, 0x2d, 0x76, 0x61, 0x6c, 0x75, 0x65,
+};
+static const uint8_t c4_1[] = {
+    0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4,
+    0xff,
+};
+static const uint8_t c4_2[] = {
+    0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf,
+};
+static const uint8_t c4_3[] = {
+    0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25,
+    0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf,
+};
+
+#define FIRST_REQUEST { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, \
+                        { ":authority", "www.example.com" } }
+#define SECOND_REQUEST { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, \
+                         { ":authority", "www.example.com" }, { "cache-control", "no-cache" } }
+#define THIRD_REQUEST { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, \
+                        { ":authority", "www.example.com" }, { "custom-key", "custom-value" } }
+
+static const example_t plain[] = {
+    { "C.3.1", c3_1, sizeof(c3_1), FIRST_REQUEST, { 0, 0, 0, 1 }, 57 },
+    { "C.3.2", c3_2, sizeof(c3_2), SECOND_REQUEST, { 0, 0, 0, 1, 1 }, 110 },
+    { "C.3.3", c3_3, sizeof(c3_3), THIRD_REQUEST, { 0, 0, 0, 1, 1 }, 164 },
+};
+static const example_t huffman[] = {
+    { "C.4.1", c4_1, sizeof(c4_1), FIRST_REQUEST, { 0 }, 57 },
+    { "C.4.2", c4_2, sizeof(c4_2), SECOND_REQUEST, { 0 }, 110 },
+    { "C.4.3", c4_3, sizeof(c4_3), THIRD_REQUEST, { 0 }, 164 },
+};
+
+// The dynamic table after C.3.3 and C.4.3, newest first
+static const header_t final_table[] = {
+    { "custom-key", "custom-value" },
+    { "cache-control", "no-cache" },
+    { ":authority", "www.example.com" },
+};
+
+// Decoded headers as "name: value" lines
+typedef struct {
+    char buf[LIST_BUFSIZE];
+    size_t len;
+} header_list_t;
+
+static int collect(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    header_list_t *list = arg;
+    int n = snprintf(list->buf + list->len, sizeof(list->buf) - list->len, "%.*s: %.*s\n",
+                     (int)name_len, name, (int)value_len, value);
+    if (n < 0 || (size_t)n >= sizeof(list->buf) - list->len) {
+        return -1;
+    }
+    list->len += n;
+    return 0;
+}
+
+static void expected_list(const header_t *headers, int n, header_list_t *list) {
+    list->len = 0;
+    list->buf[0] = '\0';
+    for (int i = 0; i < n && headers[i].name != NULL; i++) {
+        collect(list, headers[i].name, strlen(headers[i].name), headers[i].value, strlen(headers[i].value));
+    }
+}
+
+// Decodes each example in turn on a single table
+// Returns the number of mismatches
+static int check_decode(const example_t *examples, int n) {
+    hpack_table_t table;
+    int failures = 0;
+    hpack_table_init(&table);
+    for (int i = 0; i < n; i++) {
+        header_list_t got = { .len = 0 };
+        header_list_t want;
+        expected_list(examples[i].headers, MAX_HEADERS, &want);
+        if (hpack_decode(&table, examples[i].block, examples[i].len, collect, &got) != 0) {
+            printf("%s decode: malformed\n", examples[i].label);
+            failures++;
+            continue;
+        }
+        int match = got.len == want.len && memcmp(got.buf, want.buf, got.len) == 0;
+        int size_match = table.size == examples[i].table_size;
+        printf("%s decode: %s, table size %s\n", examples[i].label, match ? "match" : "mismatch",
+               size_match ? "match" : "mismatch");
+        if (!match) {
+            printf("%.*s", (int)got.len, got.buf);
+        }
+        failures += !match + !size_match;
+    }
+
+    //indexes 62 on are the dynamic table, newest first
+    uint8_t indexed[] = { 0x80 | 62, 0x80 | 63, 0x80 | 64 };
+    header_list_t got = { .len = 0 };
+    header_list_t want;
+    expected_list(final_table, 3, &want);
+    int match = hpack_decode(&table, indexed, sizeof(indexed), collect, &got) == 0 &&
+                got.len == want.len && memcmp(got.buf, want.buf, got.len) == 0;
+    printf("%s dynamic table: %s\n", examples[n - 1].label, match ? "match" : "mismatch");
+    failures += !match;
+    hpack_table_free(&table);
+    return failures;
+}
+
+// Encodes the header lists of the plain examples and compares the blocks
+// Returns the number of mismatches
+static int check_encode(const example_t *examples, int n) {
+    hpack_table_t table;
+    int failures = 0;
+    hpack_table_init(&table);
+    for (int i = 0; i < n; i++) {
+        uint8_t block[LIST_BUFSIZE];
+        size_t len = 0;
+        int ok = 1;
+        for (int j = 0; j < MAX_HEADERS && examples[i].headers[j].name != NULL; j++) {
+            int result = hpack_encode(&table, block + len, sizeof(block) - len, examples[i].headers[j].name,
+                                      examples[i].headers[j].value, examples[i].indexing[j]);
+            if (result < 0) {
+                ok = 0;
+                break;
+            }
+            len += result;
+        }
+        int match = ok && len == examples[i].len && memcmp(block, examples[i].block, len) == 0;
+        printf("%s encode: %s\n", examples[i].label, match ? "match" : "mismatch");
+        failures += !match;
+    }
+    hpack_table_free(&table);
+    return failures;
+}
+
+int main(void) {
+    int failures = 0;
+    failures += check_decode(plain, 3);
+    failures += check_decode(huffman, 3);
+    failures += check_encode(plain, 3);
+    return failures == 0 ? 0 : 1;
+}
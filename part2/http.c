@@ -1,121 +1,678 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
+#include "conn_pool.h"
+#include "connection_queue.h"
+#include "h2.h"
 #include "http.h"
+#include "mime.h"
+#include "io_pool.h"
+#include "path_filter.h"
+#include "probes.h"
+#include "rate_limit.h"
+#include "send_loop.h"
+#include "stats.h"
+#include "tar.h"
+#include "timeutil.h"
+#include "trace.h"
 
-#define BUFSIZE 512
+#define REQUEST_BUFSIZE 2048
+#define RECV_TIMEOUT_MS 10000
+#define SENDFILE_CHUNK 65536
+#define DEFAULT_MIME_TYPE "application/octet-stream"
 
-const char *get_mime_type(const char *file_extension) {
-    if (strcmp(".txt", file_extension) == 0) {
-        return "text/plain";
-    } else if (strcmp(".html", file_extension) == 0) {
-        return "text/html";
-    } else if (strcmp(".jpg", file_extension) == 0) {
-        return "image/jpeg";
-    } else if (strcmp(".png", file_extension) == 0) {
-        return "image/png";
-    } else if (strcmp(".pdf", file_extension) == 0) {
-        return "application/pdf";
-    }
+// Where blocked responses are handed off to, NULL to wait on the calling thread
+static io_pool_t *disk_pool;
+static send_loop_t *send_loop;
+// Where responses go between slices, NULL when not scheduling by size
+static connection_queue_t *scheduler;
+// Where files being served are shared between requests, NULL to not share
+static file_flight_t *file_flight;
+// Which files exist, NULL to ask the file system every time
+static path_filter_t *path_filter;
 
+// Finds a header in a header block by its name, case-insensitively
+// Returns a pointer to its value, with leading spaces skipped, and sets *len
+// to the length of the value, or returns NULL if there is no such header
+static const char *find_header(const char *headers, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *line = headers;
+    while ((line = strstr(line, "\r\n")) != NULL) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            const char *end = strstr(value, "\r\n");
+            *len = end != NULL ? (size_t)(end - value) : strlen(value);
+            return value;
+        }
+    }
     return NULL;
 }
 
-int read_http_request(int fd, char *resource_name) {
-    char buf[BUFSIZE];
-    if (read(fd,buf,sizeof(buf)) <= 0) {
-        perror("Read 0 bytes\n");
+// Returns 1 if a header is present and its value contains 'token', 0 otherwise
+static int header_contains(const char *headers, const char *name, const char *token) {
+    size_t len;
+    const char *found = find_header(headers, name, &len);
+    if (found == NULL) {
+        return 0;
+    }
+    char value[len + 1];
+    memcpy(value, found, len);
+    value[len] = '\0';
+    return strcasestr(value, token) != NULL;
+}
+
+// Waits until the socket is ready for 'events' or the timeout expires
+// Returns 1 if ready, 0 on timeout, -1 on error
+static int wait_for_socket(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int result;
+    do {
+        result = poll(&pfd, 1, timeout_ms);
+    } while (result == -1 && errno == EINTR);
+    if (result == -1) {
+        perror("poll");
+    }
+    return result;
+}
+
+int read_http_request(http_conn_t *conn) {
+    int fd = conn->fd;
+    http_request_t *request = &conn->request;
+    char *buf = arena_alloc(&conn->arena, REQUEST_BUFSIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "Request arena exhausted\n");
+        return -1;
+    }
+    size_t total = 0;
+
+    // read until the blank line that ends the header block
+    while (total < REQUEST_BUFSIZE - 1) {
+        ssize_t bytes_read = read(fd, buf + total, REQUEST_BUFSIZE - 1 - total);
+        if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_for_socket(fd, POLLIN, RECV_TIMEOUT_MS) <= 0) {
+                    fprintf(stderr, "Timed out waiting for request\n");
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read\n");
+            return -1;
+        }
+        total += bytes_read;
+        buf[total] = '\0';
+        if (bytes_read == 0 || strstr(buf, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    if (total == 0) {
+        fprintf(stderr, "Read 0 bytes\n");
         return -1;
     }
+    buf[total] = '\0';
     //printf("Read request:\n%s",buf);
+    request->protocol = HTTP_PROTO_1;
+    request->extra = NULL;
+    request->extra_len = 0;
+    request->h2_settings = NULL;
+    request->h2_settings_len = 0;
+    //an HTTP/2 client with prior knowledge opens with the connection preface,
+    //whose first lines read like a request
+    if (total >= H2_PREFACE_HEAD_LEN && memcmp(buf, H2_PREFACE, H2_PREFACE_HEAD_LEN) == 0) {
+        request->protocol = HTTP_PROTO_H2;
+        request->resource_name[0] = '\0';
+        request->extra = buf + H2_PREFACE_HEAD_LEN;
+        request->extra_len = total - H2_PREFACE_HEAD_LEN;
+        return 0;
+    }
     // get name of requested file
-    if (sscanf(buf, "GET %s HTTP/1.0\r\n", resource_name) != 1) {
+    if (sscanf(buf, "GET %511s HTTP/1.0\r\n", request->resource_name) != 1) {
         fprintf(stderr, "Invalid request\n");
         return -1;
     }
-    while (strstr(buf,"\r\n\0") == NULL) {
-        if (read(fd,buf,sizeof(buf)) < 0) {
-            perror("read\n");
-            return -1;
+    const char *line_end = strstr(buf, "\r\n");
+    request->minor_version = line_end != NULL && line_end - buf >= 8 && memcmp(line_end - 8, "HTTP/1.1", 8) == 0;
+    request->accepts_gzip = header_contains(buf, "Accept-Encoding", "gzip");
+    if (header_contains(buf, "Upgrade", "h2c")) {
+        request->h2_settings = find_header(buf, "HTTP2-Settings", &request->h2_settings_len);
+        if (request->h2_settings != NULL) {
+            request->protocol = HTTP_PROTO_H2C_UPGRADE;
+            const char *end = strstr(buf, "\r\n\r\n");
+            request->extra = end + 4;
+            request->extra_len = total - (end + 4 - buf);
         }
-
     }
 
     return 0;
 }
 
-int write_http_response(int fd, const char *resource_path) {
-    if (access(resource_path, F_OK) != -1) {
-        //File exists
-        int localfd = open(resource_path, O_RDONLY);
-        if (localfd == -1) {
-            fprintf(stderr,"open\n");
-            return -1;
+// Returns 1 if every page backing map[offset, offset + len) is in the page
+// cache, 0 if touching it would go to disk
+static int range_is_resident(const void *map, off_t offset, size_t len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t first = offset / page_size * page_size;
+    size_t span = offset + len - first;
+    size_t n_pages = (span + page_size - 1) / page_size;
+    unsigned char residency[SENDFILE_CHUNK / 4096 + 2];
+    if (n_pages > sizeof(residency)) {
+        n_pages = sizeof(residency);
+    }
+    if (mincore((char *)map + first, n_pages * page_size, residency) == -1) {
+        return 1;
+    }
+    for (size_t i = 0; i < n_pages; i++) {
+        if ((residency[i] & 1) == 0) {
+            return 0;
         }
-        struct stat st;
-        if (fstat(localfd,&st) == -1) {
-            perror("fstat\n");
-            close(localfd);
-            return -1;
+    }
+    return 1;
+}
+
+// Resets a connection's response state to no header and no body
+static http_send_t *http_send_init(http_conn_t *conn) {
+    http_send_t *send = &conn->send;
+    send->conn = conn;
+    send->client_fd = conn->fd;
+    send->header_len = 0;
+    send->header_sent = 0;
+    send->status = 0;
+    send->file_fd = -1;
+    send->file = NULL;
+    send->use_sendfile = 0;
+    send->bundle = NULL;
+    send->map = NULL;
+    send->body_start = 0;
+    send->offset = 0;
+    send->end = 0;
+    send->buf_len = 0;
+    send->buf_sent = 0;
+    send->parts = NULL;
+    send->parts_sent = 0;
+    send->last_progress_ms = monotonic_ms();
+    send->sliced = 0;
+    send->slice_end = 0;
+    send->arrival_ms = send->last_progress_ms;
+    send->sched_key = 0;
+    send->linger_until_ms = 0;
+    send->prev = NULL;
+    send->next = NULL;
+    return send;
+}
+
+// Writes as much of buf[*sent, len) as the socket takes
+// Returns HTTP_SEND_DONE once everything is written, HTTP_SEND_NET_BLOCKED or
+// HTTP_SEND_ERROR otherwise
+static int write_some(http_send_t *send, const char *buf, size_t len, size_t *sent) {
+    while (*sent < len) {
+        ssize_t bytes_written = write(send->client_fd, buf + *sent, len - *sent);
+        if (bytes_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return HTTP_SEND_NET_BLOCKED;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Write failed\n");
+            return HTTP_SEND_ERROR;
         }
-        long fileSize = st.st_size;
-        long fileBytesWritten = 0;
-        char response[BUFSIZE] = "HTTP/1.0 200OK\r\n";
-        char str[100];
-        const char *dot =  strrchr(resource_path,'.');
-        sprintf(str,"Content-Type %s\r\n",get_mime_type(dot));
-        strcat(response,str);
-        sprintf(str,"Content-Length: %ld\r\n\r\n",fileSize);
-        strcat(response,str);
-
-        //printf("- - - - -\nResponding header length %ld:\n%s",strlen(response),response);
-        if (write(fd,response,strlen(response)) <= 0) {
-            perror("writing header failed\n");
-            close(localfd);
-            return -1;
+        *sent += bytes_written;
+        send->last_progress_ms = monotonic_ms();
+        stats_add_bytes(bytes_written);
+    }
+    return HTTP_SEND_DONE;
+}
+
+int http_send_progress(http_send_t *send, int nowait) {
+    int result;
+    if (send->header_sent < send->header_len) {
+        if ((result = write_some(send, send->header, send->header_len, &send->header_sent)) != HTTP_SEND_DONE) {
+            return result;
+        }
+        PROBE_HEADER_SENT(send->client_fd, send->header_len);
+    }
+
+    while (1) {
+        //first get rid of body bytes already read
+        if ((result = write_some(send, send->buf, send->buf_len, &send->buf_sent)) != HTTP_SEND_DONE) {
+            return result;
+        }
+        if (send->offset >= send->end) {
+            if (send->parts == NULL) {
+                return HTTP_SEND_DONE;
+            }
+            int more = send->parts->next(send->parts, send, nowait);
+            if (more == HTTP_SEND_DISK_BLOCKED) {
+                return more;
+            }
+            if (more <= 0) {
+                return more == 0 ? HTTP_SEND_DONE : HTTP_SEND_ERROR;
+            }
+            continue;
+        }
+        if (send->sliced && send->offset >= send->slice_end) {
+            return HTTP_SEND_YIELD;
         }
-        char buf[BUFSIZE];
-        int bytes_read;
 
-        while ((bytes_read = read(localfd, buf, sizeof(buf))) > 0) {
-            int bytes_written = write(fd, buf, bytes_read);
-            fileBytesWritten += bytes_written;
-            //printf("Written bytes: %d, Total bytes: %ld",bytes_read,fileBytesWritten);
-            if (bytes_written <= 0 || bytes_written != bytes_read) {
-                perror("Write failed\n");
-                close(localfd);
-                return -1;
+        if (send->use_sendfile) {
+            size_t chunk = (send->sliced ? send->slice_end : send->end) - send->offset;
+            if (nowait) {
+                if (chunk > SENDFILE_CHUNK) {
+                    chunk = SENDFILE_CHUNK;
+                }
+                if (send->map != NULL && !range_is_resident(send->map, send->offset, chunk)) {
+                    return HTTP_SEND_DISK_BLOCKED;
+                }
+            }
+            ssize_t bytes_sent = sendfile(send->client_fd, send->file_fd, &send->offset, chunk);
+            if (bytes_sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return HTTP_SEND_NET_BLOCKED;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("sendfile");
+                return HTTP_SEND_ERROR;
             }
+            if (bytes_sent == 0) {
+                printf("Sent wrong number of bytes\n");
+                return HTTP_SEND_ERROR;
+            }
+            send->last_progress_ms = monotonic_ms();
+            stats_add_bytes(bytes_sent);
+            continue;
+        }
 
+        size_t want = (send->sliced ? send->slice_end : send->end) - send->offset;
+        if (want > sizeof(send->buf)) {
+            want = sizeof(send->buf);
+        }
+        ssize_t bytes_read;
+        if (nowait) {
+            //only take data that is already in the page cache
+            struct iovec iov = { .iov_base = send->buf, .iov_len = want };
+            bytes_read = preadv2(send->file_fd, &iov, 1, send->offset, RWF_NOWAIT);
+            if (bytes_read < 0 && errno == EAGAIN) {
+                return HTTP_SEND_DISK_BLOCKED;
+            }
+            if (bytes_read < 0 && errno == EOPNOTSUPP) {
+                //file system can't tell, just read normally
+                bytes_read = pread(send->file_fd, send->buf, want, send->offset);
+            }
+        } else {
+            bytes_read = pread(send->file_fd, send->buf, want, send->offset);
         }
         if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("read");
-            close(localfd);
-            return -1;
+            return HTTP_SEND_ERROR;
         }
-        if (fileBytesWritten != fileSize) {
+        if (bytes_read == 0) {
             printf("Sent wrong number of bytes\n");
+            return HTTP_SEND_ERROR;
         }
-        memset(buf,0,sizeof(buf));
+        send->buf_len = bytes_read;
+        send->buf_sent = 0;
+        send->offset += bytes_read;
     }
-    else {
-        //File doesn't exist, write 404 error back
-        const char* error404 = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        if (write(fd,error404,strlen(error404)) <= 0) {
-            perror("404 message failed to write\n");
-            return -1;
+}
+
+// Hashes the client's IP address, so a trace can group its connections
+// without recording who the client was
+static uint32_t client_id(const http_conn_t *conn) {
+    const unsigned char *bytes;
+    size_t len;
+    if (conn->addr.ss_family == AF_INET) {
+        bytes = (const unsigned char *)&((const struct sockaddr_in *)&conn->addr)->sin_addr;
+        len = 4;
+    } else if (conn->addr.ss_family == AF_INET6) {
+        bytes = (const unsigned char *)&((const struct sockaddr_in6 *)&conn->addr)->sin6_addr;
+        len = 16;
+    } else {
+        return 0;
+    }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void http_trace(const http_conn_t *conn, uint64_t arrival_ns, int status, uint64_t bytes,
+                int completed, int flags, const char *path) {
+    uint64_t now = trace_now();
+    if (now == 0) {
+        return;
+    }
+    trace_record_t record;
+    record.arrival_ns = arrival_ns;
+    record.service_ns = now - arrival_ns;
+    record.response_bytes = bytes;
+    record.conn_id = conn->conn_id;
+    record.client_id = client_id(conn);
+    record.status = status;
+    record.completed = completed;
+    record.flags = flags;
+    trace_write(&record, path);
+}
+
+// Returns the number of bytes of a response written so far
+static uint64_t bytes_written(const http_send_t *send) {
+    uint64_t body = send->offset - send->body_start;
+    if (send->parts != NULL) {
+        //buf holds the bytes that go in front of each part's file range
+        return send->header_sent + send->parts_sent + send->buf_sent + body;
+    }
+    //buf holds file bytes read ahead of the socket
+    return send->header_sent + body - (send->buf_len - send->buf_sent);
+}
+
+void http_send_finish(http_send_t *send, int completed) {
+    http_conn_t *conn = send->conn;
+    uint64_t bytes = bytes_written(send);
+    stats_count(completed ? STATS_COMPLETED : STATS_FAILED, 1);
+    http_trace(conn, conn->accept_ns, send->status, bytes, completed, 0, conn->request.resource_name);
+    if (completed && (send->file_fd != -1 || send->parts != NULL)) {
+        PROBE_BODY_DONE(send->client_fd, bytes - send->header_sent);
+    }
+    if (send->file != NULL) {
+        http_release_file(send->file);
+    }
+    if (send->parts != NULL) {
+        send->parts->free(send->parts);
+    }
+    if (send->bundle != NULL) {
+        bundle_release(send->bundle);
+    }
+    http_conn_close(conn);
+}
+
+// Waits up to LINGER_MS for the client to close its side of a socket that
+// was shut down for writing, discarding whatever it still sends
+static void linger_socket(int fd) {
+    char discard[512];
+    long deadline = monotonic_ms() + LINGER_MS;
+    while (1) {
+        long left = deadline - monotonic_ms();
+        if (left <= 0) {
+            return;
+        }
+        if (wait_for_socket(fd, POLLIN, left) <= 0) {
+            return;
+        }
+        ssize_t n = read(fd, discard, sizeof(discard));
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+            return;
         }
-        
     }
-    
-    if(close(fd) != 0){
+}
+
+void http_conn_close(http_conn_t *conn) {
+    if (conn->linger) {
+        conn->linger = 0;
+        shutdown(conn->fd, SHUT_WR);
+        //the send loop waits without holding up this thread, and closes the
+        //connection again once the client is done
+        http_send_t *send = &conn->send;
+        send->conn = conn;
+        send->client_fd = conn->fd;
+        if (send_loop != NULL && send_loop_linger(send_loop, send) == 0) {
+            return;
+        }
+        linger_socket(conn->fd);
+    }
+    PROBE_CLOSE(conn->fd);
+    if (close(conn->fd) != 0) {
         perror("close");
+    }
+    stats_count(STATS_OPEN, -1);
+    if (conn->limiter != NULL) {
+        rate_limit_release(conn->limiter, (struct sockaddr *)&conn->addr, conn->addr_len,
+                           conn->limit_counted);
+    }
+    conn_release(conn);
+}
+
+int http_send_dispatch(http_send_t *send, int nowait) {
+    while (1) {
+        int result = http_send_progress(send, nowait);
+        if (result == HTTP_SEND_DONE) {
+            http_send_finish(send, 1);
+            return 0;
+        }
+        if (result == HTTP_SEND_ERROR) {
+            http_send_finish(send, 0);
+            return -1;
+        }
+        if (result == HTTP_SEND_YIELD) {
+            //let smaller responses go first, unless the queue has no room
+            if (scheduler != NULL && connection_requeue(scheduler, send) == 0) {
+                return 0;
+            }
+            send->sliced = 0;
+            continue;
+        }
+        if (result == HTTP_SEND_DISK_BLOCKED) {
+            //start reading ahead now, before an I/O thread even picks it up,
+            //unless what blocked was loading the next part
+            if (send->offset < send->end) {
+                posix_fadvise(send->file_fd, send->offset, send->end - send->offset, POSIX_FADV_SEQUENTIAL);
+                posix_fadvise(send->file_fd, send->offset, send->end - send->offset, POSIX_FADV_WILLNEED);
+            }
+            if (disk_pool != NULL && io_pool_submit(disk_pool, send) == 0) {
+                return 0;
+            }
+            //the queue is full: a caller that must not block, which may be
+            //the send loop itself, leaves the read for when there is room
+            if (nowait && send_loop != NULL && send_loop_defer(send_loop, send) == 0) {
+                return 0;
+            }
+            nowait = 0;
+            continue;
+        }
+        //HTTP_SEND_NET_BLOCKED: park it until the client catches up
+        if (send_loop != NULL && send_loop_add(send_loop, send) == 0) {
+            return 0;
+        }
+        if (wait_for_socket(send->client_fd, POLLOUT, SEND_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "Client on fd %d stalled, dropping response\n", send->client_fd);
+            http_send_finish(send, 0);
+            return -1;
+        }
+    }
+}
+
+// Fills in the header of a response with no body
+static void set_error_header(http_send_t *send, int status) {
+    const char *header;
+    switch (status) {
+    case 400:
+        header = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        break;
+    case 429:
+        header = "HTTP/1.0 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+        break;
+    default:
+        header = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        break;
+    }
+    send->status = status == 400 || status == 429 ? status : 404;
+    send->header_len = strlen(header);
+    memcpy(send->header, header, send->header_len);
+}
+
+int write_http_error(http_conn_t *conn, int status) {
+    http_send_t *send = http_send_init(conn);
+    set_error_header(send, status);
+    return http_send_dispatch(send, 1);
+}
+
+void http_set_offload(io_pool_t *pool, send_loop_t *loop) {
+    disk_pool = pool;
+    send_loop = loop;
+}
+
+void http_set_file_flight(file_flight_t *flight) {
+    file_flight = flight;
+}
+
+void http_set_path_filter(path_filter_t *filter) {
+    path_filter = filter;
+}
+
+int http_open_file(const char *path, shared_file_t **file) {
+    uint64_t generation;
+    //known misses never reach the file system
+    if (path_filter != NULL && !path_filter_check(path_filter, path, &generation)) {
+        return ENOENT;
+    }
+    int error = file_flight_open(file_flight, path, file);
+    if (path_filter != NULL && (error == ENOENT || error == ENOTDIR)) {
+        path_filter_add_miss(path_filter, path, generation);
+    }
+    return error;
+}
+
+void http_release_file(shared_file_t *file) {
+    file_flight_release(file);
+}
+
+void http_set_scheduler(connection_queue_t *queue) {
+    scheduler = queue;
+}
+
+int http_send_slice(http_send_t *send) {
+    //without a scheduler the whole body goes out in one go
+    send->sliced = scheduler != NULL;
+    send->slice_end = send->offset + SRPT_SLICE_BYTES;
+    return http_send_dispatch(send, disk_pool != NULL);
+}
+
+int write_http_response(http_conn_t *conn, const char *resource_path) {
+    int fd = conn->fd;
+    http_send_t *send = http_send_init(conn);
+    //joins an open of the same file already in flight, if there is one
+    shared_file_t *file;
+    int error = http_open_file(resource_path, &file);
+    if (error == 0) {
+        send->file = file;
+        send->status = 200;
+        send->file_fd = file->fd;
+        long fileSize = file->size;
+        send->end = fileSize;
+        PROBE_OPEN(fd, resource_path, fileSize);
+        const char *mime = get_mime_type(strrchr(resource_path,'.'));
+        send->header_len = snprintf(send->header, sizeof(send->header),
+                                    "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
+                                    mime != NULL ? mime : DEFAULT_MIME_TYPE, fileSize);
+        //printf("- - - - -\nResponding header length %ld:\n%s",send->header_len,send->header);
+    }
+    else if (error == ENOENT || error == ENOTDIR) {
+        //File doesn't exist, write 404 error back
+        set_error_header(send, 404);
+    }
+    else {
+        fprintf(stderr, "open %s: %s\n", resource_path, strerror(error));
+        http_send_finish(send, 0);
         return -1;
     }
 
-    return 0;
+    //hot data goes out right here, anything that blocks is handed off
+    return http_send_slice(send);
+}
+
+int write_bundle_response(http_conn_t *conn, bundle_t *bundle) {
+    int fd = conn->fd;
+    const http_request_t *request = &conn->request;
+    http_send_t *send = http_send_init(conn);
+    const bundle_entry_t *entry = bundle_lookup(bundle, request->resource_name);
+    if (entry == NULL) {
+        set_error_header(send, 404);
+        return http_send_dispatch(send, disk_pool != NULL);
+    }
+
+    int use_gzip = request->accepts_gzip && entry->gzip_offset != 0;
+    off_t offset = use_gzip ? entry->gzip_offset : entry->offset;
+    uint64_t length = use_gzip ? entry->gzip_length : entry->length;
+    if ((uint64_t)offset + length > bundle->map_size) {
+        fprintf(stderr, "bundle entry %s out of bounds\n", request->resource_name);
+        http_send_finish(send, 0);
+        return -1;
+    }
+    PROBE_OPEN(fd, request->resource_name, length);
+
+    bundle_retain(bundle);
+    send->bundle = bundle;
+    send->status = 200;
+    send->file_fd = bundle->fd;
+    send->map = bundle->map;
+    send->use_sendfile = 1;
+    send->body_start = offset;
+    send->offset = offset;
+    send->end = offset + length;
+    send->header_len = snprintf(send->header, sizeof(send->header),
+                                "HTTP/1.0 200 OK\r\nContent-Type: %.*s\r\nContent-Length: %llu\r\n"
+                                "ETag: %.*s\r\n%s\r\n",
+                                BUNDLE_MIME_LEN, entry->mime_type, (unsigned long long)length,
+                                BUNDLE_ETAG_LEN, use_gzip ? entry->gzip_etag : entry->etag,
+                                use_gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "");
+    return http_send_slice(send);
+}
+
+int write_tar_response(http_conn_t *conn, const char *serve_dir) {
+    http_request_t *request = &conn->request;
+    http_send_t *send = http_send_init(conn);
+    const char *query = strchr(request->resource_name, '?');
+    tar_archive_t *archive;
+    int error = tar_archive_open(&archive, serve_dir, query != NULL ? query + 1 : "");
+    if (error != 0) {
+        if (error == ENOENT || error == ENOTDIR) {
+            set_error_header(send, 404);
+        } else if (error == EINVAL || error == E2BIG || error == ENAMETOOLONG) {
+            set_error_header(send, 400);
+        } else {
+            fprintf(stderr, "archive %s: %s\n", request->resource_name, strerror(error));
+            http_send_finish(send, 0);
+            return -1;
+        }
+        return http_send_dispatch(send, disk_pool != NULL);
+    }
+    //chunks need an HTTP/1.1 client
+    archive->chunked = archive->chunked && request->minor_version == 1;
+    send->parts = &archive->parts;
+    send->status = 200;
+    uint64_t size = tar_archive_size(archive);
+    PROBE_OPEN(conn->fd, request->resource_name, size);
+    if (archive->chunked) {
+        send->header_len = snprintf(send->header, sizeof(send->header),
+                                    "HTTP/1.1 200 OK\r\nContent-Type: application/x-tar\r\n"
+                                    "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+    } else {
+        send->header_len = snprintf(send->header, sizeof(send->header),
+                                    "HTTP/1.0 200 OK\r\nContent-Type: application/x-tar\r\n"
+                                    "Content-Length: %llu\r\n\r\n", (unsigned long long)size);
+    }
+    //parts follow one another, so the archive is not sliced for the scheduler
+    return http_send_dispatch(send, disk_pool != NULL);
 }
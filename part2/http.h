@@ -1,20 +1,283 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "arena.h"
+#include "bundle.h"
+#include "file_flight.h"
+
+#define RESOURCE_NAME_LEN 512
+#define HEADER_BUFSIZE 512
+#define FILE_BUFSIZE 16384
+#define ARENA_SIZE 4096
+// How long a connection closed with linger set waits for the client to close
+// its side first
+#define LINGER_MS 100
+// Body bytes a response may send before yielding to smaller ones when
+// responses are scheduled by size
+#define SRPT_SLICE_BYTES 65536
+
+// Results of http_send_progress()
+#define HTTP_SEND_DONE 0
+#define HTTP_SEND_NET_BLOCKED 1     // The socket's send buffer is full
+#define HTTP_SEND_DISK_BLOCKED 2    // The next read would wait for the disk
+#define HTTP_SEND_YIELD 3           // The response used up its time slice
+#define HTTP_SEND_ERROR -1
+
+struct io_pool;
+struct send_loop;
+struct connection_queue;
+struct conn_pool;
+struct http_conn;
+struct rate_limiter;
+struct path_filter;
+
+// Protocols a connection can speak after its first request
+#define HTTP_PROTO_1 0              // HTTP/1.x, one request per connection
+#define HTTP_PROTO_H2 1             // HTTP/2 with prior knowledge, the preface began
+#define HTTP_PROTO_H2C_UPGRADE 2    // HTTP/1.1 request asking to switch to h2c
+
+// The parts of an HTTP request that the server acts on
+typedef struct {
+    char resource_name[RESOURCE_NAME_LEN];
+    int minor_version;          // 1 for an HTTP/1.1 request, 0 for HTTP/1.0
+    int accepts_gzip;           // Set if Accept-Encoding lists gzip
+    int protocol;               // One of HTTP_PROTO_*
+    const char *extra;          // Bytes read past the request header, in the arena
+    size_t extra_len;
+    const char *h2_settings;    // HTTP2-Settings header of an upgrade, in the arena
+    size_t h2_settings_len;
+} http_request_t;
+
+struct http_send;
+
+// A body sent as a series of parts, such as a tar archive built on the fly.
+// Each part is some bytes in send->buf followed by a range of send->file_fd.
+typedef struct http_parts {
+    // Loads the next part into the response state. With nowait set it must
+    // not do anything that can wait for the disk, such as opening a file.
+    // Returns 1 if there is one, 0 once the body is complete,
+    // HTTP_SEND_DISK_BLOCKED if loading it needs the disk and nowait is set,
+    // or -1 on error
+    int (*next)(struct http_parts *parts, struct http_send *send, int nowait);
+    // Releases the parts once the response is finished
+    void (*free)(struct http_parts *parts);
+} http_parts_t;
+
+// Everything needed to resume a response on a non-blocking socket after a
+// partial write. Whoever holds the state owns the client socket.
+typedef struct http_send {
+    struct http_conn *conn;     // Connection this response belongs to
+    int client_fd;
+    char header[HEADER_BUFSIZE];
+    size_t header_len;
+    size_t header_sent;
+    int status;                 // HTTP status of the header, 0 until one is built
+    int file_fd;                // Body source, -1 for a header-only response
+    shared_file_t *file;        // File to release when done, or NULL
+    int use_sendfile;           // Send the body with sendfile() instead of copying
+    bundle_t *bundle;           // Bundle reference to drop when done, or NULL
+    const void *map;            // file_fd mapped, to check which pages of a
+                                // sendfile() range are cached, or NULL
+    off_t body_start;
+    off_t offset;               // Next body byte to read from file_fd
+    off_t end;                  // One past the last body byte
+    char buf[FILE_BUFSIZE];     // Body bytes read but not yet written
+    size_t buf_len;
+    size_t buf_sent;
+    http_parts_t *parts;        // Where the rest of the body comes from, or NULL
+    uint64_t parts_sent;        // Bytes of the parts before the current one
+    long last_progress_ms;
+    int sliced;                 // Stop with HTTP_SEND_YIELD at slice_end
+    off_t slice_end;
+    long arrival_ms;            // When the response was started, for aging
+    long long sched_key;        // Priority in the scheduler, lowest goes first
+    long linger_until_ms;       // Set while the send loop waits for the client
+                                // to close, 0 otherwise
+    struct http_send *prev;     // Links used by the send loop
+    struct http_send *next;
+} http_send_t;
+
+// Everything the server keeps for one client connection. Connection objects
+// come from a conn_pool and are recycled, so the request path needs no heap
+// allocations: per-request scratch memory comes from the arena, which is
+// reset when the connection is released.
+typedef struct http_conn {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint32_t conn_id;           // Accept order, for request traces
+    uint64_t accept_ns;         // Accept time on the trace clock (trace_now)
+    http_request_t request;
+    http_send_t send;
+    arena_t arena;
+    char arena_mem[ARENA_SIZE];
+    struct rate_limiter *limiter;   // Limiter the connection was admitted by, or NULL
+    int limit_counted;          // RATE_LIMIT_KEY_* bits to release on close
+    int linger;                 // Wait for the client to close before closing
+    struct conn_pool *pool;     // Pool to return to, NULL if heap allocated
+    struct http_conn *next_free;
+} http_conn_t;
+
 /*
- * Read an HTTP request from an active TCP connection socket
- * fd: The socket's file descriptor
- * resource_name: Set to the name of the requested resource on success
+ * Read an HTTP request from a client connection into conn->request
+ * conn: The connection, whose socket may be non-blocking
  * Returns 0 on success or -1 on error
  */
-int read_http_request(int fd, char *resource_name);
+int read_http_request(http_conn_t *conn);
 
 /*
- * Write an HTTP response to an active TCP connection socket
- * fd: The socket's file descriptor
+ * Write an HTTP response to a client connection. The socket is closed and the
+ * connection released once the response has been sent, which may happen later
+ * on another thread if the client or the disk is slow.
+ * conn: The connection
  * resource_path: The path to the requested resource in the server's file system
  * Returns 0 on success or -1 on error
  */
-int write_http_response(int fd, const char *resource_path);
+int write_http_response(http_conn_t *conn, const char *resource_path);
+
+/*
+ * Write an HTTP response for a resource stored in an asset bundle. The body is
+ * sent with sendfile() straight from the bundle file, using the precompressed
+ * variant if there is one and the client accepts gzip. The response keeps its
+ * own reference to the bundle until it is done.
+ * conn: The connection, with conn->request already read
+ * bundle: The bundle to serve from
+ * Returns 0 on success or -1 on error
+ */
+int write_bundle_response(http_conn_t *conn, bundle_t *bundle);
+
+/*
+ * Write a tar archive of files in a directory, built as it is sent: the
+ * member headers are generated in memory and the file contents go out with
+ * sendfile(). The files are listed in the query string of the request, either
+ * as files=<path>,<path>... or as every file under prefix=<path>.
+ * conn: The connection, with conn->request already read
+ * serve_dir: The directory the paths are relative to
+ * Returns 0 on success or -1 on error
+ */
+int write_tar_response(http_conn_t *conn, const char *serve_dir);
+
+/*
+ * Write a response with no body, such as a 404 or a 429, to a client
+ * connection. The socket is closed once it has been sent, as for
+ * write_http_response().
+ * conn: The connection
+ * status: The HTTP status code, 400, 404 or 429
+ * Returns 0 on success or -1 on error
+ */
+int write_http_error(http_conn_t *conn, int status);
+
+/*
+ * Close a connection's socket and release it. With conn->linger set the
+ * socket is shut down for writing first, and closed once the client has
+ * closed its side or LINGER_MS have passed, so that request bytes still
+ * arriving do not make the kernel reset the connection before the client has
+ * read the response. The send loop does the waiting if there is one.
+ * conn: The connection
+ */
+void http_conn_close(http_conn_t *conn);
+
+/*
+ * Open a file to be served, sharing the open with concurrent requests for the
+ * same path (see http_set_file_flight), unless the path filter knows that it
+ * does not exist (see http_set_path_filter)
+ * path: Path of the file
+ * file: Set to the referenced file on success
+ * Returns 0 on success or the errno of the failed open
+ */
+int http_open_file(const char *path, shared_file_t **file);
+
+/*
+ * Drop a reference returned by http_open_file()
+ * file: The file
+ */
+void http_release_file(shared_file_t *file);
+
+/*
+ * Append a finished response to the request trace, if one is being written
+ * conn: The connection the request came in on
+ * arrival_ns: When the request arrived, on the trace clock (trace_now)
+ * status: HTTP status of the response, 0 if none was started
+ * bytes: Bytes of the response that were written
+ * completed: Set if the whole response was written
+ * flags: TRACE_FLAG_* bits describing the request
+ * path: The requested resource
+ */
+void http_trace(const http_conn_t *conn, uint64_t arrival_ns, int status, uint64_t bytes,
+                int completed, int flags, const char *path);
+
+/*
+ * Set where responses go when they cannot make progress on the calling
+ * thread: bodies of files that are not in the page cache go to the disk I/O
+ * pool, responses to clients whose socket buffer is full go to the send loop.
+ * Either may be NULL, in which case the calling thread waits instead.
+ * pool: The disk I/O pool
+ * loop: The send loop
+ */
+void http_set_offload(struct io_pool *pool, struct send_loop *loop);
+
+/*
+ * Coalesce concurrent opens of the same file: while a file is being opened or
+ * served, other requests for it share its descriptor
+ * flight: The single-flight table, NULL to open every file separately
+ */
+void http_set_file_flight(file_flight_t *flight);
+
+/*
+ * Answer requests for files that do not exist without touching the file
+ * system: http_open_file() fails with ENOENT for any path the filter rules
+ * out, and files it lets through but that turn out to be missing are added
+ * to its negative cache
+ * filter: The filter for the served directory, NULL to open every file
+ */
+void http_set_path_filter(struct path_filter *filter);
+
+/*
+ * Schedule responses by size: bodies are sent in slices of SRPT_SLICE_BYTES,
+ * and between slices a response goes back to the queue, which hands out the
+ * one with the fewest bytes left first (see connection_requeue).
+ * queue: The queue to put unfinished responses back on, NULL to send every
+ *        response in one go
+ */
+void http_set_scheduler(struct connection_queue *queue);
+
+/*
+ * Send the next slice of a response, handing it back to the scheduler if
+ * there is more to send afterwards
+ * send: The response state, owned by the callee from now on
+ * Returns 0 if the slice was sent or handed off, -1 on error
+ */
+int http_send_slice(http_send_t *send);
+
+/*
+ * Write as much of a response as possible without blocking
+ * send: The response state, advanced past whatever was written
+ * nowait: If set, stop with HTTP_SEND_DISK_BLOCKED instead of reading file
+ *         data that is not in the page cache or loading a part that needs
+ *         the disk
+ * Returns one of the HTTP_SEND_* results
+ */
+int http_send_progress(http_send_t *send, int nowait);
+
+/*
+ * Drive a response forward and, whenever it blocks, hand it to the thread that
+ * can wait for the resource it needs (see http_set_offload). The response is
+ * finished and its connection released by whichever thread completes it.
+ * send: The response state, owned by the callee from now on
+ * nowait: Whether the caller must not block on disk reads
+ * Returns 0 if the response was sent or handed off, -1 on error
+ */
+int http_send_dispatch(http_send_t *send, int nowait);
+
+/*
+ * Close the descriptors held by a response, release its bundle reference and
+ * release the connection it belongs to
+ * send: The response state
+ * completed: Set if the whole response was sent
+ */
+void http_send_finish(http_send_t *send, int completed);
 
 #endif // HTTP_H
@@ -7,10 +7,28 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "conn_pool.h"
 #include "connection_queue.h"
+#include "h2.h"
 #include "http.h"
+#include "io_pool.h"
+#include "path_filter.h"
+#include "probes.h"
+#include "proxy_protocol.h"
+#include "rate_limit.h"
+#include "send_loop.h"
+#include "stats.h"
+#include "tar.h"
+#include "trace.h"
 
 #define BUFSIZE 512
 #define LISTEN_QUEUE_LEN 5
@@ -19,63 +37,512 @@
 int keep_going = 1;
 const char *serve_dir;
 
+// Asset bundle being served in bundle mode (-b), NULL when serving serve_dir
+const char *bundle_path;
+bundle_t *current_bundle;
+pthread_mutex_t bundle_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t reload_requested = 0;
+
+// Client socket tuning (-S, -L), 0 keeps the kernel default
+int send_buffer_size = 0;
+int send_lowat = 0;
+
+// Per client rate and connection limits (-r, -c), checked right after accept
+// or, with -l parse, once the request has been read
+rate_limiter_t limiter;
+int limiting = 0;
+int limit_after_parse = 0;
+
+// Send the smallest responses first, in slices (-s)
+int size_scheduling = 0;
+
+// Shared memory object the live statistics are published in (-m), or NULL
+const char *stats_name;
+
+// File every request is recorded in for trace_replay (-t), or NULL
+const char *trace_path;
+
+// Unix domain socket to listen on as well as or instead of the port (-u), or
+// NULL. A leading '@' puts it in the abstract namespace.
+const char *unix_path;
+int unix_mode = -1;             // Permissions of the socket file (-U), -1 for the umask
+int proxy_protocol = 0;         // Unix socket clients send a PROXY v2 header (-P)
+
+// Answer requests for missing files from a filter of the files in serve_dir (-n)
+int path_filtering = 0;
+
 
 void handle_sigint(int signo) {
     keep_going = 0;
     //printf("SIGINT Received\n");
 }
 
+void handle_sighup(int signo) {
+    reload_requested = 1;
+}
+
+// Returns a referenced pointer to the bundle currently being served
+bundle_t *acquire_bundle(void) {
+    pthread_mutex_lock(&bundle_lock);
+    bundle_t *bundle = current_bundle;
+    bundle_retain(bundle);
+    pthread_mutex_unlock(&bundle_lock);
+    return bundle;
+}
+
+// Maps the bundle file again and swaps it in for new requests. Responses in
+// progress keep using the old bundle until they release it.
+void reload_bundle(void) {
+    bundle_t *fresh = bundle_open(bundle_path);
+    if (fresh == NULL) {
+        fprintf(stderr, "Keeping the current bundle\n");
+        return;
+    }
+    pthread_mutex_lock(&bundle_lock);
+    bundle_t *old = current_bundle;
+    current_bundle = fresh;
+    pthread_mutex_unlock(&bundle_lock);
+    bundle_release(old);
+}
+
+// Puts a client socket in non-blocking mode and applies the send buffer
+// settings. Returns 0 on success or -1 on error
+int configure_client_socket(http_conn_t *conn) {
+    int fd = conn->fd;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    if (send_buffer_size > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer_size, sizeof(send_buffer_size)) == -1) {
+        perror("setsockopt SO_SNDBUF");
+        return -1;
+    }
+    //Linux ignores SO_SNDLOWAT, TCP_NOTSENT_LOWAT is its send low-water mark
+    if (send_lowat > 0 && conn->addr.ss_family != AF_UNIX &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &send_lowat, sizeof(send_lowat)) == -1) {
+        perror("setsockopt TCP_NOTSENT_LOWAT");
+        return -1;
+    }
+    return 0;
+}
+
+// Charges a connection to its client's limits, which are released again when
+// the connection is closed
+// Returns RATE_LIMIT_OK or the limit that was hit
+int admit_client(http_conn_t *conn) {
+    int counted;
+    int result = rate_limit_admit(&limiter, (struct sockaddr *)&conn->addr, conn->addr_len, &counted);
+    if (result != RATE_LIMIT_OK) {
+        PROBE_REJECT(conn->fd, result);
+        stats_count(STATS_REJECTED, 1);
+        return result;
+    }
+    conn->limiter = &limiter;
+    conn->limit_counted = counted;
+    return RATE_LIMIT_OK;
+}
+
+// Answers a connection whose request has not been read with a 429. The
+// connection lingers: closing it while request bytes are still arriving would
+// reset it before the client has read the 429.
+void refuse_unread(http_conn_t *conn) {
+    conn->linger = 1;
+    write_http_error(conn, 429);
+}
+
+// Refuses a connection from the accept loop without handing it to a worker
+void reject_at_accept(http_conn_t *conn) {
+    if (configure_client_socket(conn) != 0) {
+        http_conn_close(conn);
+        return;
+    }
+    refuse_unread(conn);
+}
+
+// Serves a connection that switched to HTTP/2 for as long as it stays open
+void serve_http2(http_conn_t *conn) {
+    bundle_t *bundle = bundle_path != NULL ? acquire_bundle() : NULL;
+    if (h2_serve(conn, serve_dir, bundle) != 0) {
+        fprintf(stderr,"HTTP/2 connection failed\n");
+    }
+    if (bundle != NULL) {
+        bundle_release(bundle);
+    }
+}
+
 void *thread_func(void *queue){
         queue = (connection_queue_t *)queue;
-        while(keep_going){
-            int client_fd = connection_dequeue(queue);
-            if(client_fd == -1){
+        stats_thread_start("worker");
+        //run until the queue is shut down and every scheduled response is done
+        while(1){
+            http_conn_t *conn;
+            http_send_t *send;
+            stats_set_state(STATS_IDLE, NULL);
+            if(connection_dequeue_work(queue, &conn, &send) != 0){
                 return (void *)1;
             }
+            if (send != NULL) {
+                //next slice of a response waiting behind smaller ones
+                stats_set_state(STATS_SENDING, send->conn->request.resource_name);
+                if (http_send_slice(send) != 0) {
+                    fprintf(stderr,"Failed to write http request\n");
+                }
+                continue;
+            }
+            stats_count(STATS_QUEUED, -1);
+            stats_set_state(STATS_READING, NULL);
+
+            if (configure_client_socket(conn) != 0) {
+                http_conn_close(conn);
+                continue;
+            }
+            //a proxy on the Unix socket says who the client is, whose limits
+            //could not be checked at accept
+            if (proxy_protocol && conn->addr.ss_family == AF_UNIX) {
+                if (proxy_read_header(conn) != 0) {
+                    http_conn_close(conn);
+                    continue;
+                }
+                if (limiting && !limit_after_parse && admit_client(conn) != RATE_LIMIT_OK) {
+                    refuse_unread(conn);
+                    continue;
+                }
+            }
 
             //Call read_http_request()
-            char localpath[BUFSIZE];
-            if (read_http_request(client_fd,localpath) != 0) {
+            char *localpath = conn->request.resource_name;
+            if (read_http_request(conn) != 0) {
                 fprintf(stderr,"Read http request failed\n");
+                http_conn_close(conn);
+                continue;
+            }
+            if (conn->request.protocol == HTTP_PROTO_H2) {
+                //this admits the connection and its first stream, h2_serve
+                //charges every later stream to the client's rate
+                if (limiting && limit_after_parse && admit_client(conn) != RATE_LIMIT_OK) {
+                    http_conn_close(conn);
+                    continue;
+                }
+                serve_http2(conn);
+                continue;
+            }
+            PROBE_PARSE_DONE(conn->fd, localpath);
+            stats_count(STATS_REQUESTS, 1);
+            stats_set_state(STATS_SENDING, localpath);
+            if (limiting && limit_after_parse && admit_client(conn) != RATE_LIMIT_OK) {
+                write_http_error(conn, 429);
+                continue;
+            }
+            if (conn->request.protocol == HTTP_PROTO_H2C_UPGRADE) {
+                //h2_serve counts the upgraded request as stream 1
+                stats_count(STATS_REQUESTS, -1);
+                serve_http2(conn);
+                continue;
+            }
+            if (bundle_path != NULL) {
+                //Serve straight out of the mapped bundle
+                bundle_t *bundle = acquire_bundle();
+                int result = write_bundle_response(conn, bundle);
+                bundle_release(bundle);
+                if (result != 0) {
+                    fprintf(stderr,"Failed to write http request\n");
+                }
+                continue;
+            }
+            if (tar_is_request(localpath)) {
+                //several files in one response, built from serve_dir
+                if (write_tar_response(conn, serve_dir) != 0) {
+                    fprintf(stderr,"Failed to write tar archive\n");
+                }
                 continue;
             }
             //printf("thread func %s\n%s\n",localpath,serve_dir);
             //Convert requested resource name to proper file path
-            char fullPath[strlen(serve_dir)+strlen(localpath)+1];
+            char *fullPath = arena_alloc(&conn->arena, strlen(serve_dir)+strlen(localpath)+1);
+            if (fullPath == NULL) {
+                fprintf(stderr,"Request arena exhausted\n");
+                http_conn_close(conn);
+                continue;
+            }
             strcpy(fullPath,serve_dir);
             strcat(fullPath,localpath);
-            //Call write_http_response()
-            if (write_http_response(client_fd,fullPath) != 0) {
+            //Call write_http_response(), which also closes the client socket
+            if (write_http_response(conn,fullPath) != 0) {
                 fprintf(stderr,"Failed to write http request\n");
                 continue;
             }
-            //if(
-            close(client_fd);
-                //perror("close");
-                //return (void *)1;
-            //}
             //printf("Response sent\n");
 
         }
+}
+
+
 
-        return (void *)0;
+// Creates a listening TCP socket on a port, on every local address
+// Returns the socket or -1 on error
+int open_tcp_listener(const char *port) {
+    //Setup addrinfo structs
+    struct addrinfo hints;
+    struct addrinfo *res;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int status = getaddrinfo(NULL,port,&hints,&res);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+    //creates socket
+    int sockfd = socket(res->ai_family,res->ai_socktype, res->ai_protocol);
+    if (sockfd == -1) {
+        perror("socket\n");
+        freeaddrinfo(res);
+        return -1;
+    }
+    //lets a restarted server bind while old connections are in TIME_WAIT
+    int reuse = 1;
+    if (setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse)) == -1) {
+        perror("setsockopt\n");
+        close(sockfd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    //binds to socket
+    if (bind(sockfd,res->ai_addr,res->ai_addrlen) == -1) {
+        perror("bind\n");
+        close(sockfd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    if (listen(sockfd,LISTEN_QUEUE_LEN) == -1) { //backlog = 5 maximum connections is 10
+        perror("listen\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
 }
 
+// Closes whichever listening sockets are open, removing the Unix socket file
+void close_listeners(int tcp_fd, int unix_fd) {
+    if (tcp_fd != -1 && close(tcp_fd) == -1) {
+        perror("close");
+    }
+    if (unix_fd != -1) {
+        if (close(unix_fd) == -1) {
+            perror("close");
+        }
+        if (unix_path[0] != '@') {
+            unlink(unix_path);
+        }
+    }
+}
+
+// Creates a listening Unix domain socket. A path starting with '@' names a
+// socket in the abstract namespace, which has no file and no permissions;
+// otherwise the socket file is created with the given mode, replacing a
+// socket that no server is listening on anymore. Any other file is left alone.
+// Returns the socket or -1 on error
+int open_unix_listener(const char *path, int mode) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path must be 1 to %zu bytes\n", sizeof(addr.sun_path) - 1);
+        return -1;
+    }
+    //abstract names start with a NUL byte instead of the '@'
+    memcpy(addr.sun_path, path, len);
+    int abstract = path[0] == '@';
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+        if (mode >= 0) {
+            fprintf(stderr, "Abstract sockets have no permissions, ignoring -U\n");
+        }
+    }
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + len + !abstract;
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (!abstract && connect(sockfd, (struct sockaddr *)&addr, addr_len) == -1 && errno == ECONNREFUSED) {
+        //left behind by a server that was killed, unless it is not a socket
+        //at all: connect() refuses regular files too, never remove those
+        struct stat st;
+        if (lstat(path, &st) == -1) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "lstat %s: %s\n", path, strerror(errno));
+                close(sockfd);
+                return -1;
+            }
+        } else if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", path);
+            close(sockfd);
+            return -1;
+        } else {
+            unlink(path);
+        }
+    }
+    close(sockfd);
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    //bind creates the socket file with whatever permissions the umask
+    //leaves, so set one that leaves exactly 'mode'
+    int set_mode = mode >= 0 && !abstract;
+    mode_t old_mask = set_mode ? umask(~mode & 0777) : 0;
+    int result = bind(sockfd, (struct sockaddr *)&addr, addr_len);
+    if (set_mode) {
+        umask(old_mask);
+    }
+    if (result == -1) {
+        fprintf(stderr, "bind %s: %s\n", path, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    if (listen(sockfd, LISTEN_QUEUE_LEN) == -1) {
+        perror("listen");
+        close_listeners(-1, sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
+void print_usage(const char *program) {
+    printf("Usage: %s <directory> <port>\n", program);
+    printf("       %s -b <bundle> <port>\n", program);
+    printf("       the port may be left out when listening on a Unix socket (-u)\n");
+    printf("Options:\n");
+    printf("  -u <path>   also listen on a Unix domain socket, @<name> for the abstract namespace\n");
+    printf("  -U <mode>   permissions of the Unix socket file, in octal\n");
+    printf("  -P          clients on the Unix socket start with a PROXY protocol v2 header\n");
+    printf("  -S <bytes>  client socket send buffer size (SO_SNDBUF)\n");
+    printf("  -L <bytes>  send low-water mark (TCP_NOTSENT_LOWAT)\n");
+    printf("  -m <name>   publish live statistics in shared memory for http_top\n");
+    printf("  -t <file>   record a trace of every request for trace_replay\n");
+    printf("  -s          schedule responses by size, smallest remaining first\n");
+    printf("  -n          answer requests for missing files without touching the file system\n");
+    printf("  -r <rate>[:<burst>]  requests per second allowed per client address\n");
+    printf("  -c <conns>  connections allowed open at once per client address\n");
+    printf("  -l <accept|parse>  refuse over-limit clients right after accept (default)\n");
+    printf("              or after reading their request\n");
+    printf("              a client's /24 or /64 prefix gets %d times these limits\n",
+           RATE_LIMIT_PREFIX_FACTOR);
+}
 
 int main(int argc, char **argv) {
-    // First command is directory to serve, second command is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
+    // Options come first, then the directory to serve (unless a bundle is
+    // served instead) and the port
+    int opt;
+    double rate = 0;
+    double burst = 0;
+    int max_conns = 0;
+    char *end;
+    while ((opt = getopt(argc, argv, "b:m:t:u:U:PnsS:L:r:c:l:")) != -1) {
+        switch (opt) {
+        case 'b':
+            bundle_path = optarg;
+            break;
+        case 'm':
+            stats_name = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'U':
+            unix_mode = strtol(optarg, &end, 8);
+            if (*end != '\0' || unix_mode < 0 || unix_mode > 0777) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'P':
+            proxy_protocol = 1;
+            break;
+        case 'n':
+            path_filtering = 1;
+            break;
+        case 's':
+            size_scheduling = 1;
+            break;
+        case 'S':
+            send_buffer_size = atoi(optarg);
+            break;
+        case 'L':
+            send_lowat = atoi(optarg);
+            break;
+        case 'r':
+            rate = strtod(optarg, &end);
+            burst = *end == ':' ? strtod(end + 1, NULL) : rate;
+            break;
+        case 'c':
+            max_conns = atoi(optarg);
+            break;
+        case 'l':
+            if (strcmp(optarg, "accept") != 0 && strcmp(optarg, "parse") != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            limit_after_parse = strcmp(optarg, "parse") == 0;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    int n_args = bundle_path != NULL ? 1 : 2;
+    if (unix_path != NULL && argc - optind == n_args - 1) {
+        n_args--;
+    }
+    if (argc - optind != n_args || (proxy_protocol && unix_path == NULL) ||
+        (path_filtering && bundle_path != NULL)) {
+        print_usage(argv[0]);
         return 1;
     }
     
     int error;
 
+    if (rate > 0 || max_conns > 0) {
+        if (rate_limit_init(&limiter, rate, burst, max_conns) != 0) {
+            return 1;
+        }
+        limiting = 1;
+    }
+
+    if (bundle_path != NULL) {
+        //map the bundle once up front, lookups never touch the file system
+        current_bundle = bundle_open(bundle_path);
+        if (current_bundle == NULL) {
+            return 1;
+        }
+    }
+
     connection_queue_t queue;
     if(connection_queue_init(&queue) != 0){
         return 1;
     }
+    //connection objects are recycled instead of allocated per client
+    conn_pool_t conn_pool;
+    if(conn_pool_init(&conn_pool, CONN_POOL_SIZE) != 0){
+        connection_queue_free(&queue);
+        return 1;
+    }
+    //concurrent requests for the same file share one open
+    file_flight_t file_flight;
+    if(file_flight_init(&file_flight) != 0){
+        connection_queue_free(&queue);
+        return 1;
+    }
 
 
     struct sigaction sact;
@@ -92,65 +559,112 @@ int main(int argc, char **argv) {
         connection_queue_free(&queue);
         return 1;
     }
+    //Setup SIGHUP handler to reload the bundle
+    sact.sa_handler = handle_sighup;
+    if (sigaction(SIGHUP, &sact, NULL) == -1) {
+        perror("sigaction\n");
+        connection_queue_free(&queue);
+        return 1;
+    }
 
-    serve_dir = argv[1];
-    const char *port = argv[2];
+    //the port is the last argument, if there is one
+    serve_dir = bundle_path != NULL ? NULL : argv[optind];
+    const char *port = argc - optind > (bundle_path != NULL ? 0 : 1) ? argv[argc - 1] : NULL;
 
-    //Setup addrinfo structs
-    struct addrinfo hints;
-    struct addrinfo *res;
-    memset(&hints,0,sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    int status = getaddrinfo(NULL,port,&hints,&res);
-    if (status != 0) {
-        perror("getaddrinfo\n");
+    int sockfd = -1;
+    if (port != NULL && (sockfd = open_tcp_listener(port)) == -1) {
         connection_queue_free(&queue);
         return 1;
     }
-    //creates socket
-    int sockfd = socket(res->ai_family,res->ai_socktype, res->ai_protocol);
-    if (sockfd == -1) {
-        perror("socket\n");
-        freeaddrinfo(res);
+    int unix_fd = -1;
+    if (unix_path != NULL && (unix_fd = open_unix_listener(unix_path, unix_mode)) == -1) {
+        close_listeners(sockfd, -1);
         connection_queue_free(&queue);
         return 1;
     }
-    //binds to socket
-    if (bind(sockfd,res->ai_addr,res->ai_addrlen) == -1) {
-        perror("bind\n");
-        close(sockfd);
-        freeaddrinfo(res);
+    //accept only when poll says a connection is waiting, on either socket
+    struct pollfd listeners[2];
+    int n_listeners = 0;
+    int listen_fds[2] = { sockfd, unix_fd };
+    for (int i = 0; i < 2; i++) {
+        if (listen_fds[i] == -1) {
+            continue;
+        }
+        int flags = fcntl(listen_fds[i], F_GETFL);
+        if (flags == -1 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl");
+            close_listeners(sockfd, unix_fd);
+            connection_queue_free(&queue);
+            return 1;
+        }
+        listeners[n_listeners].fd = listen_fds[i];
+        listeners[n_listeners].events = POLLIN;
+        n_listeners++;
+    }
+
+    if (stats_name != NULL && stats_open(stats_name) != 0) {
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
-
-    if (listen(sockfd,LISTEN_QUEUE_LEN) == -1) { //backlog = 5 maximum connections is 10
-        perror("listen\n");
-        close(sockfd);
-        freeaddrinfo(res);
+    if (trace_path != NULL && trace_open(trace_path) != 0) {
+        stats_close();
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
 
-    freeaddrinfo(res);
-
     //set process mask to all signals before creating threads
     sigset_t oldset;
     sigset_t newset;
     if(sigfillset(&newset) != 0){
         perror("sigfillset");
-        close(sockfd);
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
     if(sigprocmask(SIG_SETMASK, &newset, &oldset) != 0){
         perror("sigprocmask");
-        close(sockfd);
+        close_listeners(sockfd, unix_fd);
+        connection_queue_free(&queue);
+        return 1;
+    }
+    //start the disk I/O threads that take over responses for cold files
+    io_pool_t io_pool;
+    if(io_pool_init(&io_pool) != 0){
+        close_listeners(sockfd, unix_fd);
+        connection_queue_free(&queue);
+        return 1;
+    }
+    //and the thread that resumes responses to slow clients
+    send_loop_t send_loop;
+    if(send_loop_init(&send_loop) != 0){
+        io_pool_shutdown(&io_pool);
+        io_pool_free(&io_pool);
+        close_listeners(sockfd, unix_fd);
+        connection_queue_free(&queue);
+        return 1;
+    }
+    //and the thread that keeps the filter of existing files current
+    path_filter_t path_filter;
+    if(path_filtering && path_filter_init(&path_filter, serve_dir) != 0){
+        send_loop_shutdown(&send_loop);
+        send_loop_free(&send_loop);
+        io_pool_shutdown(&io_pool);
+        io_pool_free(&io_pool);
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
+    http_set_offload(&io_pool, &send_loop);
+    http_set_file_flight(&file_flight);
+    if (path_filtering) {
+        http_set_path_filter(&path_filter);
+    }
+    h2_set_backlog(&queue, N_THREADS);
+    if (size_scheduling) {
+        http_set_scheduler(&queue);
+    }
     pthread_t threads[N_THREADS];
     for(int i = 0; i < N_THREADS; i++){
         if((error = pthread_create(threads+i, NULL, thread_func, &queue)) != 0){
@@ -158,7 +672,7 @@ int main(int argc, char **argv) {
             for(int y = 0; y < i; y++){
                 pthread_cancel(threads[y]);
             }
-            close(sockfd);
+            close_listeners(sockfd, unix_fd);
             connection_queue_free(&queue);
             return 1;
         }
@@ -166,47 +680,93 @@ int main(int argc, char **argv) {
     //return process mask after creating threads
     if(sigprocmask(SIG_SETMASK, &oldset, NULL) != 0){
         perror("sigprocmask");
-        close(sockfd);
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
 
+    uint32_t next_conn_id = 0;
     while(keep_going) { //Server loop
-        //get client info
-        struct sockaddr_storage clientaddr;
-        socklen_t addr_size = sizeof(clientaddr);
-        //accept and get client fd
-        int client_fd = accept(sockfd,(struct sockaddr *)&clientaddr,&addr_size);
-        if (client_fd == -1) {
-            if (errno != EINTR) { // Checks whether accept failed or was interrupted
-                perror("accept");
+        //wait for a client on either socket
+        if (poll(listeners, n_listeners, -1) == -1) {
+            if (errno != EINTR) { // Checks whether poll failed or was interrupted
+                perror("poll");
                 for(int y = 0; y < N_THREADS; y++){
                     pthread_cancel(threads[y]);
                 }
-                close(sockfd);
+                close_listeners(sockfd, unix_fd);
                 connection_queue_free(&queue);
                 return 1;
             }
+            if (keep_going && reload_requested) { // SIGHUP, not SIGINT
+                reload_requested = 0;
+                if (bundle_path != NULL) {
+                    reload_bundle();
+                }
+                continue;
+            }
             break;
         }
-        //printf("Client connected\n");
-        if(connection_enqueue(&queue, client_fd) == -1){
-            for(int y = 0; y < N_THREADS; y++){
-                pthread_cancel(threads[y]);
+        for (int i = 0; i < n_listeners; i++) {
+            if ((listeners[i].revents & POLLIN) == 0) {
+                continue;
             }
-            close(sockfd);
-            connection_queue_free(&queue);
-            return 1;
+            //get client info
+            struct sockaddr_storage clientaddr;
+            socklen_t addr_size = sizeof(clientaddr);
+            //accept and get client fd
+            int client_fd = accept(listeners[i].fd,(struct sockaddr *)&clientaddr,&addr_size);
+            if (client_fd == -1) {
+                //the client may have given up since poll saw it
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR) {
+                    continue;
+                }
+                perror("accept");
+                for(int y = 0; y < N_THREADS; y++){
+                    pthread_cancel(threads[y]);
+                }
+                close_listeners(sockfd, unix_fd);
+                connection_queue_free(&queue);
+                return 1;
+            }
+            //printf("Client connected\n");
+            PROBE_ACCEPT(client_fd);
+            http_conn_t *conn = conn_acquire(&conn_pool, client_fd, (struct sockaddr *)&clientaddr, addr_size);
+            if (conn == NULL) {
+                PROBE_CLOSE(client_fd);
+                close(client_fd);
+                continue;
+            }
+            conn->conn_id = next_conn_id++;
+            conn->accept_ns = trace_now();
+            stats_count(STATS_ACCEPTED, 1);
+            stats_count(STATS_OPEN, 1);
+            //an over-limit client never takes up a queue slot or a worker
+            if (limiting && !limit_after_parse && admit_client(conn) != RATE_LIMIT_OK) {
+                reject_at_accept(conn);
+                continue;
+            }
+            stats_count(STATS_QUEUED, 1);
+            if(connection_enqueue(&queue, conn) == -1){
+                for(int y = 0; y < N_THREADS; y++){
+                    pthread_cancel(threads[y]);
+                }
+                close_listeners(sockfd, unix_fd);
+                connection_queue_free(&queue);
+                return 1;
 
+            }
         }
 
     }
+    //HTTP/2 connections finish their streams and close
+    h2_drain();
     //shutdown queue
     if(connection_queue_shutdown(&queue) != 0){
         for(int i = 0; i < N_THREADS; i++){
             pthread_cancel(threads[i]);
         }
-        close(sockfd);
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
@@ -218,7 +778,7 @@ int main(int argc, char **argv) {
             for(int j = i; j < N_THREADS; j++){
                 pthread_cancel(threads[j]);
             }
-            close(sockfd);
+            close_listeners(sockfd, unix_fd);
             connection_queue_free(&queue);
             return 1;
         }
@@ -226,18 +786,53 @@ int main(int argc, char **argv) {
     }
 
     
-    //close server fd
-    if(close(sockfd) == -1){
-        perror("close");
+    //finish the responses waiting on slow clients or on room in the I/O
+    //pool, which hands the latter to the I/O threads
+    if(send_loop_shutdown(&send_loop) != 0){
+        close_listeners(sockfd, unix_fd);
         connection_queue_free(&queue);
         return 1;
     }
+    //then those still being sent by the I/O threads, which wait on their
+    //clients themselves now
+    if(io_pool_shutdown(&io_pool) != 0){
+        close_listeners(sockfd, unix_fd);
+        connection_queue_free(&queue);
+        return 1;
+    }
+    http_set_offload(NULL, NULL);
+    http_set_scheduler(NULL);
+    http_set_file_flight(NULL);
+    http_set_path_filter(NULL);
+    h2_set_backlog(NULL, 0);
+    h2_pool_free();
+    if (path_filtering) {
+        path_filter_shutdown(&path_filter);
+        path_filter_free(&path_filter);
+    }
+    io_pool_free(&io_pool);
+    send_loop_free(&send_loop);
+    //every response is finished, so every connection and file has been released
+    conn_pool_free(&conn_pool);
+    file_flight_free(&file_flight);
+    if (limiting) {
+        rate_limit_free(&limiter);
+    }
+    stats_close();
+    trace_close();
+
+    //close server sockets
+    close_listeners(sockfd, unix_fd);
 
     //free queue
     if(connection_queue_free(&queue) != 0){
         return 1;
     }
 
+    if (current_bundle != NULL) {
+        bundle_release(current_bundle);
+    }
+
     return 0;
 }
 
@@ -0,0 +1,153 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stats.h"
+#include "timeutil.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+
+volatile sig_atomic_t keep_going = 1;
+
+void handle_sigint(int signo) {
+    keep_going = 0;
+}
+
+// Formats a byte count with a binary unit suffix
+void format_bytes(uint64_t bytes, char *out, size_t len) {
+    const char *units[] = { "B", "K", "M", "G", "T" };
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(out, len, unit == 0 ? "%.0f%s" : "%.1f%s", value, units[unit]);
+}
+
+// Prints one screen of statistics. prev holds the counters from the last
+// screen, elapsed_ms the time since then, to show rates.
+void render(const stats_segment_t *segment, int64_t *prev, long elapsed_ms) {
+    uint64_t now = monotonic_ns();
+    uint64_t uptime = (now - segment->start_ns) / 1000000000ull;
+    char bytes[16];
+
+    printf("http_server pid %d  up %02llu:%02llu:%02llu\n", segment->pid,
+           (unsigned long long)(uptime / 3600), (unsigned long long)(uptime / 60 % 60),
+           (unsigned long long)(uptime % 60));
+    for (int i = 0; i < STATS_N_COUNTERS; i++) {
+        int64_t value = __atomic_load_n(&segment->counters[i], __ATOMIC_RELAXED);
+        if (i == STATS_QUEUED || i == STATS_OPEN) {
+            printf("%s %lld  ", stats_counter_names[i], (long long)value);
+        } else if (i == STATS_BYTES) {
+            format_bytes(value, bytes, sizeof(bytes));
+            printf("%s %s", stats_counter_names[i], bytes);
+            if (elapsed_ms > 0) {
+                format_bytes((value - prev[i]) * 1000 / elapsed_ms, bytes, sizeof(bytes));
+                printf(" (%s/s)", bytes);
+            }
+            printf("  ");
+        } else {
+            printf("%s %lld", stats_counter_names[i], (long long)value);
+            if (elapsed_ms > 0) {
+                printf(" (%.0f/s)", (value - prev[i]) * 1000.0 / elapsed_ms);
+            }
+            printf("  ");
+        }
+        if (i == STATS_REJECTED) {
+            printf("\n");
+        }
+        prev[i] = value;
+    }
+    printf("\n\n%3s  %-7s %-8s %8s %9s %7s  %s\n", "#", "ROLE", "STATE", "TIME", "BYTES", "REQS", "PATH");
+
+    uint32_t n_threads = __atomic_load_n(&segment->n_threads, __ATOMIC_RELAXED);
+    if (n_threads > STATS_MAX_THREADS) {
+        n_threads = STATS_MAX_THREADS;
+    }
+    for (uint32_t i = 0; i < n_threads; i++) {
+        stats_thread_t slot;
+        if (stats_read_thread(&segment->threads[i], &slot) != 0) {
+            printf("%3u  (slot busy)\n", i);
+            continue;
+        }
+        if (slot.role[0] == '\0') {
+            continue;
+        }
+        double in_state = now > slot.state_since_ns ? (now - slot.state_since_ns) / 1e9 : 0;
+        format_bytes(slot.bytes_sent, bytes, sizeof(bytes));
+        printf("%3u  %-7.*s %-8s %7.1fs %9s %7llu  %.*s\n", i, STATS_ROLE_LEN, slot.role,
+               slot.state >= STATS_IDLE && slot.state <= STATS_SENDING ? stats_state_names[slot.state] : "?",
+               in_state, bytes, (unsigned long long)slot.requests, STATS_PATH_LEN, slot.path);
+    }
+    fflush(stdout);
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [-i <interval ms>] [-n <count>] <name>\n", program);
+    printf("Shows the live statistics of a server started with -m <name>\n");
+    printf("  -i <ms>     refresh interval (default %d)\n", DEFAULT_INTERVAL_MS);
+    printf("  -n <count>  exit after this many screens\n");
+}
+
+int main(int argc, char **argv) {
+    int interval_ms = DEFAULT_INTERVAL_MS;
+    int count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1 || interval_ms <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const stats_segment_t *segment = stats_attach(argv[optind]);
+    if (segment == NULL) {
+        return 1;
+    }
+
+    struct sigaction sact;
+    memset(&sact, 0, sizeof(sact));
+    sact.sa_handler = handle_sigint;
+    sigemptyset(&sact.sa_mask);
+    if (sigaction(SIGINT, &sact, NULL) == -1) {
+        perror("sigaction");
+        return 1;
+    }
+
+    //only redraw in place on a terminal, piped output just appends screens
+    int clear = isatty(STDOUT_FILENO);
+    int64_t prev[STATS_N_COUNTERS] = {0};
+    long last_ms = 0;
+    for (int screen = 0; keep_going && (count == 0 || screen < count); screen++) {
+        if (screen > 0) {
+            usleep(interval_ms * 1000);
+        }
+        if (kill(segment->pid, 0) == -1) {
+            fprintf(stderr, "Server %d is not running\n", segment->pid);
+            return 1;
+        }
+        long now_ms = monotonic_ms();
+        if (clear) {
+            printf("\033[H\033[2J");
+        }
+        render(segment, prev, screen > 0 ? now_ms - last_ms : 0);
+        if (!clear) {
+            printf("\n");
+        }
+        last_ms = now_ms;
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include "io_pool.h"
+#include "stats.h"
+
+static void *io_thread_func(void *arg) {
+    io_pool_t *pool = arg;
+    int error;
+    stats_thread_start("io");
+    while (1) {
+        if ((error = pthread_mutex_lock(&pool->lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+            return (void *)1;
+        }
+        //wait while queue is empty, but drain it before shutting down
+        while (pool->length == 0 && !pool->shutdown) {
+            if ((error = pthread_cond_wait(&pool->queue_empty, &pool->lock)) != 0) {
+                fprintf(stderr, "pthread_cond_wait failed: %s\n", strerror(error));
+                pthread_mutex_unlock(&pool->lock);
+                return (void *)1;
+            }
+        }
+        if (pool->length == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return (void *)0;
+        }
+        http_send_t *send = pool->jobs[pool->read_idx];
+        pool->read_idx = (pool->read_idx + 1) % IO_QUEUE_CAPACITY;
+        pool->length--;
+        if ((error = pthread_mutex_unlock(&pool->lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+            return (void *)1;
+        }
+
+        //blocking disk reads are fine here, that is what this thread is for
+        stats_set_state(STATS_SENDING, send->conn->request.resource_name);
+        if (http_send_dispatch(send, 0) != 0) {
+            fprintf(stderr, "Failed to write http request\n");
+        }
+        stats_set_state(STATS_IDLE, NULL);
+    }
+}
+
+int io_pool_init(io_pool_t *pool) {
+    pool->length = 0;
+    pool->read_idx = 0;
+    pool->write_idx = 0;
+    pool->shutdown = 0;
+    pool->n_threads = 0;
+    int error;
+
+    if ((error = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+        return -1;
+    }
+    if ((error = pthread_cond_init(&pool->queue_empty, NULL)) != 0) {
+        fprintf(stderr, "pthread_cond_init failed: %s\n", strerror(error));
+        pthread_mutex_destroy(&pool->lock);
+        return -1;
+    }
+    for (int i = 0; i < N_IO_THREADS; i++) {
+        if ((error = pthread_create(&pool->threads[i], NULL, io_thread_func, pool)) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            io_pool_shutdown(pool);
+            io_pool_free(pool);
+            return -1;
+        }
+        pool->n_threads++;
+    }
+    return 0;
+}
+
+int io_pool_submit(io_pool_t *pool, http_send_t *send) {
+    int error;
+    if ((error = pthread_mutex_lock(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    if (pool->length == IO_QUEUE_CAPACITY || pool->shutdown) {
+        pthread_mutex_unlock(&pool->lock);
+        return 1;
+    }
+
+    pool->jobs[pool->write_idx] = send;
+    pool->write_idx = (pool->write_idx + 1) % IO_QUEUE_CAPACITY;
+    pool->length++;
+
+    //signal queue_empty
+    if ((error = pthread_cond_signal(&pool->queue_empty)) != 0) {
+        fprintf(stderr, "pthread_cond_signal failed: %s\n", strerror(error));
+    }
+    if ((error = pthread_mutex_unlock(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+int io_pool_shutdown(io_pool_t *pool) {
+    int error;
+    if ((error = pthread_mutex_lock(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    pool->shutdown = 1;
+    if ((error = pthread_cond_broadcast(&pool->queue_empty)) != 0) {
+        fprintf(stderr, "pthread_cond_broadcast failed: %s\n", strerror(error));
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    if ((error = pthread_mutex_unlock(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < pool->n_threads; i++) {
+        if ((error = pthread_join(pool->threads[i], NULL)) != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(error));
+            result = -1;
+        }
+    }
+    pool->n_threads = 0;
+    return result;
+}
+
+int io_pool_free(io_pool_t *pool) {
+    int error;
+    if ((error = pthread_mutex_destroy(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(error));
+        pthread_cond_destroy(&pool->queue_empty);
+        return -1;
+    }
+    if ((error = pthread_cond_destroy(&pool->queue_empty)) != 0) {
+        fprintf(stderr, "pthread_cond_destroy failed: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
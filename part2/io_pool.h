@@ -0,0 +1,56 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <pthread.h>
+#include "http.h"
+
+#define IO_QUEUE_CAPACITY 16
+#define N_IO_THREADS 2
+
+// Bounded pool of threads dedicated to blocking disk reads, so that network
+// workers never wait on a cold file. Each job is a response whose next body
+// bytes are not in the page cache; the I/O thread that picks it up owns it.
+typedef struct io_pool {
+    http_send_t *jobs[IO_QUEUE_CAPACITY];
+    int length;
+    int read_idx;
+    int write_idx;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t queue_empty;
+    pthread_t threads[N_IO_THREADS];
+    int n_threads;
+} io_pool_t;
+
+/*
+ * Initialize an I/O pool and start its threads
+ * pool: Pointer to the io_pool_t to be initialized
+ * Returns 0 on success or -1 on error
+ */
+int io_pool_init(io_pool_t *pool);
+
+/*
+ * Hand a response off to the I/O threads. Never blocks: if the queue is full
+ * the caller keeps the response, and either reads the file itself or, if it
+ * must not block, has the send loop retry (see send_loop_defer).
+ * pool: The pool to submit to
+ * send: The response to continue
+ * Returns 0 if the job was queued, 1 if the queue is full or shut down, or -1
+ * on error
+ */
+int io_pool_submit(io_pool_t *pool, http_send_t *send);
+
+/*
+ * Finish all queued jobs, then stop and join the I/O threads
+ * pool: The pool to shut down
+ * Returns 0 on success or -1 on error
+ */
+int io_pool_shutdown(io_pool_t *pool);
+
+/*
+ * Deallocates and cleans up any resources associated with an I/O pool.
+ * Returns 0 on success or -1 on error
+ */
+int io_pool_free(io_pool_t *pool);
+
+#endif // IO_POOL_H
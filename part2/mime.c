@@ -0,0 +1,22 @@
+#include <stddef.h>
+#include <string.h>
+#include "mime.h"
+
+const char *get_mime_type(const char *file_extension) {
+    if (file_extension == NULL) {
+        return NULL;
+    }
+    if (strcmp(".txt", file_extension) == 0) {
+        return "text/plain";
+    } else if (strcmp(".html", file_extension) == 0) {
+        return "text/html";
+    } else if (strcmp(".jpg", file_extension) == 0) {
+        return "image/jpeg";
+    } else if (strcmp(".png", file_extension) == 0) {
+        return "image/png";
+    } else if (strcmp(".pdf", file_extension) == 0) {
+        return "application/pdf";
+    }
+
+    return NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef MIME_H
+#define MIME_H
+
+/*
+ * Look up the MIME type for a file extension
+ * file_extension: The extension including the leading '.', e.g. ".txt"
+ * Returns the MIME type string or NULL if the extension is unknown
+ */
+const char *get_mime_type(const char *file_extension);
+
+#endif // MIME_H
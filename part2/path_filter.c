@@ -0,0 +1,537 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "path_filter.h"
+
+#define WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+#define MAX_DEPTH 64
+
+// Hashes for the Bloom filter collected while walking the tree
+typedef struct {
+    uint64_t *hashes;
+    size_t n;
+    size_t capacity;
+} hash_list_t;
+
+// Directories from the root down to the one being walked, so that symbolic
+// links back up the tree are not followed around in circles
+typedef struct {
+    dev_t dev[MAX_DEPTH];
+    ino_t ino[MAX_DEPTH];
+    int depth;
+} walk_path_t;
+
+// Hashes a path below the root, reading runs of '/' as one like open() does
+static uint64_t path_hash(const char *rel) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)rel; *c != '\0'; c++) {
+        if (*c == '/' && c[1] == '/') {
+            continue;
+        }
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns 1 if a path has a "." or ".." segment. The filter holds every file
+// under one name only, and resolving ".." past a symbolic link is up to the
+// file system, so such paths are never hashed.
+static int has_dot_segment(const char *rel) {
+    for (const char *segment = rel; *segment != '\0'; segment++) {
+        if (segment != rel && segment[-1] != '/') {
+            continue;
+        }
+        size_t dots = strspn(segment, ".");
+        if ((dots == 1 || dots == 2) && (segment[dots] == '/' || segment[dots] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Derives the second hash for double hashing from the first. Odd, so that
+// every probe lands on a different bit.
+static uint64_t probe_step(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash | 1;
+}
+
+// Allocates an empty Bloom filter with room for twice as many paths
+static path_bloom_t *bloom_new(size_t n_paths) {
+    uint64_t n_bits = PATH_FILTER_MIN_BITS;
+    while (n_bits < 2 * n_paths * PATH_FILTER_BITS_PER_PATH) {
+        n_bits *= 2;
+    }
+    path_bloom_t *bloom = malloc(sizeof(path_bloom_t));
+    if (bloom == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    bloom->bits = calloc(n_bits / 64, sizeof(uint64_t));
+    if (bloom->bits == NULL) {
+        perror("calloc");
+        free(bloom);
+        return NULL;
+    }
+    bloom->mask = n_bits - 1;
+    bloom->capacity = n_bits / PATH_FILTER_BITS_PER_PATH;
+    bloom->n_paths = 0;
+    return bloom;
+}
+
+static void bloom_free(path_bloom_t *bloom) {
+    if (bloom != NULL) {
+        free(bloom->bits);
+        free(bloom);
+    }
+}
+
+static void bloom_add(path_bloom_t *bloom, uint64_t hash) {
+    uint64_t step = probe_step(hash);
+    for (int i = 0; i < PATH_FILTER_HASHES; i++) {
+        uint64_t bit = (hash + i * step) & bloom->mask;
+        bloom->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    bloom->n_paths++;
+}
+
+// Returns 1 if every bit of the path is set, 0 if the path was never added
+static int bloom_test(const path_bloom_t *bloom, uint64_t hash) {
+    uint64_t step = probe_step(hash);
+    for (int i = 0; i < PATH_FILTER_HASHES; i++) {
+        uint64_t bit = (hash + i * step) & bloom->mask;
+        if ((bloom->bits[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int hash_list_push(hash_list_t *list, uint64_t hash) {
+    if (list->n == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        uint64_t *grown = realloc(list->hashes, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->hashes = grown;
+        list->capacity = capacity;
+    }
+    list->hashes[list->n++] = hash;
+    return 0;
+}
+
+// Returns the watch with a descriptor, or NULL
+static path_watch_t *find_watch(path_filter_t *filter, int wd) {
+    for (size_t i = 0; i < filter->n_watches; i++) {
+        if (filter->watches[i].wd == wd) {
+            return &filter->watches[i];
+        }
+    }
+    return NULL;
+}
+
+// Watches a directory for files coming and going. A directory that is
+// already watched, under this name or another, keeps its one watch, which
+// takes the new name.
+// Returns 0 on success or -1 on error
+static int add_watch(path_filter_t *filter, const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", filter->root, dir);
+    int wd = inotify_add_watch(filter->inotify_fd, path, WATCH_MASK);
+    if (wd == -1) {
+        fprintf(stderr, "inotify_add_watch %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char *name = strdup(dir);
+    if (name == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    path_watch_t *watch = find_watch(filter, wd);
+    if (watch != NULL) {
+        free(watch->dir);
+        watch->dir = name;
+        return 0;
+    }
+    if (filter->n_watches == filter->watch_capacity) {
+        size_t capacity = filter->watch_capacity == 0 ? 16 : filter->watch_capacity * 2;
+        path_watch_t *grown = realloc(filter->watches, capacity * sizeof(path_watch_t));
+        if (grown == NULL) {
+            perror("realloc");
+            free(name);
+            return -1;
+        }
+        filter->watches = grown;
+        filter->watch_capacity = capacity;
+    }
+    filter->watches[filter->n_watches].wd = wd;
+    filter->watches[filter->n_watches].dir = name;
+    filter->n_watches++;
+    return 0;
+}
+
+// Watches a directory and everything below it, and collects the hashes of
+// the regular files in it. The watch is added before the directory is read,
+// so a file created meanwhile is either read or reported.
+// Returns 0 on success or -1 on error
+static int walk(path_filter_t *filter, const char *dir, hash_list_t *list, walk_path_t *ancestors) {
+    char path[PATH_MAX];
+    char rel[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s%s", filter->root, dir);
+    if (stat(path, &st) != 0) {
+        //gone already, its parent's watch reports that
+        return 0;
+    }
+    for (int i = 0; i < ancestors->depth; i++) {
+        if (ancestors->dev[i] == st.st_dev && ancestors->ino[i] == st.st_ino) {
+            return 0;
+        }
+    }
+    if (ancestors->depth == MAX_DEPTH) {
+        fprintf(stderr, "%s is nested too deep to watch\n", path);
+        return -1;
+    }
+    if (add_watch(filter, dir) != 0) {
+        return -1;
+    }
+    DIR *dirp = opendir(path);
+    if (dirp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    ancestors->dev[ancestors->depth] = st.st_dev;
+    ancestors->ino[ancestors->depth] = st.st_ino;
+    ancestors->depth++;
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dirp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if ((size_t)snprintf(rel, sizeof(rel), "%s/%s", dir, entry->d_name) >= sizeof(rel) ||
+            (size_t)snprintf(path, sizeof(path), "%s%s", filter->root, rel) >= sizeof(path)) {
+            continue;
+        }
+        //follows symbolic links the way open() will
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            result = walk(filter, rel, list, ancestors);
+        } else if (S_ISREG(st.st_mode)) {
+            result = hash_list_push(list, path_hash(rel));
+        }
+    }
+    ancestors->depth--;
+    closedir(dirp);
+    return result;
+}
+
+// Builds a filter of every file below the root, watching every directory
+// Returns the filter or NULL on error
+static path_bloom_t *build(path_filter_t *filter) {
+    hash_list_t list = { NULL, 0, 0 };
+    walk_path_t ancestors;
+    ancestors.depth = 0;
+    if (walk(filter, "", &list, &ancestors) != 0) {
+        free(list.hashes);
+        return NULL;
+    }
+    path_bloom_t *bloom = bloom_new(list.n);
+    if (bloom != NULL) {
+        for (size_t i = 0; i < list.n; i++) {
+            bloom_add(bloom, list.hashes[i]);
+        }
+    }
+    free(list.hashes);
+    filter->n_removed = 0;
+    return bloom;
+}
+
+// Makes files that appeared count: nothing cached as missing stays so
+static void bump_generation(path_filter_t *filter) {
+    pthread_mutex_lock(&filter->lock);
+    filter->generation++;
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Swaps in a freshly built filter. Without one every path may exist, which
+// is slower but never wrong.
+static void install(path_filter_t *filter, path_bloom_t *bloom) {
+    if (bloom == NULL) {
+        fprintf(stderr, "Could not rebuild the path filter, every path may exist until it is\n");
+    }
+    pthread_rwlock_wrlock(&filter->bloom_lock);
+    path_bloom_t *old = filter->bloom;
+    filter->bloom = bloom;
+    pthread_rwlock_unlock(&filter->bloom_lock);
+    bloom_free(old);
+    bump_generation(filter);
+}
+
+// Adds the files a walk found to the current filter
+static void add_hashes(path_filter_t *filter, const hash_list_t *list) {
+    pthread_rwlock_wrlock(&filter->bloom_lock);
+    if (filter->bloom != NULL) {
+        for (size_t i = 0; i < list->n; i++) {
+            bloom_add(filter->bloom, list->hashes[i]);
+        }
+    }
+    pthread_rwlock_unlock(&filter->bloom_lock);
+}
+
+// Applies a file or directory appearing in a watched directory. A symbolic
+// link counts as whatever it points to, as for open().
+// Returns 0 on success or -1 if the filter needs to be rebuilt
+static int file_appeared(path_filter_t *filter, const char *rel) {
+    char path[PATH_MAX];
+    struct stat st;
+    hash_list_t list = { NULL, 0, 0 };
+    int result = 0;
+    if ((size_t)snprintf(path, sizeof(path), "%s%s", filter->root, rel) >= sizeof(path) ||
+        stat(path, &st) != 0) {
+        //gone again already
+    } else if (S_ISDIR(st.st_mode)) {
+        walk_path_t ancestors;
+        ancestors.depth = 0;
+        result = walk(filter, rel, &list, &ancestors);
+    } else if (S_ISREG(st.st_mode)) {
+        result = hash_list_push(&list, path_hash(rel));
+    }
+    if (result == 0) {
+        add_hashes(filter, &list);
+    }
+    free(list.hashes);
+    bump_generation(filter);
+    return result;
+}
+
+// Applies a batch of inotify events
+// Returns 1 if the filter needs to be rebuilt, 0 otherwise
+static int handle_events(path_filter_t *filter, const char *buf, size_t len) {
+    int rebuild = 0;
+    char rel[PATH_MAX];
+    const struct inotify_event *event;
+    for (size_t pos = 0; pos < len; pos += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event *)(buf + pos);
+        if (event->mask & IN_Q_OVERFLOW) {
+            rebuild = 1;
+            continue;
+        }
+        path_watch_t *watch = find_watch(filter, event->wd);
+        if (watch == NULL) {
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            //the directory is gone
+            free(watch->dir);
+            *watch = filter->watches[--filter->n_watches];
+            continue;
+        }
+        if (event->len == 0 ||
+            (size_t)snprintf(rel, sizeof(rel), "%s/%s", watch->dir, event->name) >= sizeof(rel)) {
+            continue;
+        }
+        int is_dir = (event->mask & IN_ISDIR) != 0;
+        if (is_dir && (event->mask & (IN_MOVED_FROM | IN_MOVED_TO))) {
+            //a moved tree keeps its watches under its old name
+            rebuild = 1;
+        } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            if (file_appeared(filter, rel) != 0) {
+                rebuild = 1;
+            }
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            filter->n_removed++;
+        }
+    }
+    return rebuild;
+}
+
+static void *watch_func(void *arg) {
+    path_filter_t *filter = arg;
+    char buf[PATH_FILTER_EVENT_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        pthread_mutex_lock(&filter->lock);
+        if (filter->shutdown) {
+            pthread_mutex_unlock(&filter->lock);
+            return (void *)0;
+        }
+        pthread_mutex_unlock(&filter->lock);
+
+        struct pollfd pfd = { .fd = filter->inotify_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, PATH_FILTER_TICK_MS);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        //a failed rebuild is retried with the next change
+        int rebuild = filter->bloom == NULL;
+        ssize_t n;
+        while ((n = read(filter->inotify_fd, buf, sizeof(buf))) > 0) {
+            rebuild |= handle_events(filter, buf, n);
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            perror("read");
+        }
+        //deleted files stay in the filter until it is rebuilt, and a full
+        //one lets too many misses through
+        const path_bloom_t *bloom = filter->bloom;
+        if (rebuild || bloom->n_paths > bloom->capacity || filter->n_removed > bloom->capacity / 4) {
+            install(filter, build(filter));
+        }
+    }
+}
+
+// Returns the part of a path below the root, or NULL if it is not below it
+static const char *relative_path(const path_filter_t *filter, const char *path) {
+    if (strncmp(path, filter->root, filter->root_len) != 0 || path[filter->root_len] != '/') {
+        return NULL;
+    }
+    return path + filter->root_len;
+}
+
+int path_filter_init(path_filter_t *filter, const char *root) {
+    int error;
+    memset(filter, 0, sizeof(*filter));
+    filter->root = strdup(root);
+    if (filter->root == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    filter->root_len = strlen(filter->root);
+    while (filter->root_len > 1 && filter->root[filter->root_len - 1] == '/') {
+        filter->root[--filter->root_len] = '\0';
+    }
+    //empty slots belong to generation 0 and never match
+    filter->generation = 1;
+    filter->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (filter->inotify_fd == -1) {
+        perror("inotify_init1");
+        free(filter->root);
+        return -1;
+    }
+    if ((error = pthread_rwlock_init(&filter->bloom_lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_rwlock_init failed: %s\n", strerror(error));
+        close(filter->inotify_fd);
+        free(filter->root);
+        return -1;
+    }
+    if ((error = pthread_mutex_init(&filter->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+        pthread_rwlock_destroy(&filter->bloom_lock);
+        close(filter->inotify_fd);
+        free(filter->root);
+        return -1;
+    }
+    filter->bloom = build(filter);
+    if (filter->bloom == NULL ||
+        (error = pthread_create(&filter->thread, NULL, watch_func, filter)) != 0) {
+        if (filter->bloom != NULL) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+        }
+        path_filter_free(filter);
+        return -1;
+    }
+    return 0;
+}
+
+int path_filter_check(path_filter_t *filter, const char *path, uint64_t *generation) {
+    const char *rel = relative_path(filter, path);
+    //generation 0 is never current, so these are never cached as misses
+    *generation = 0;
+    if (rel == NULL || has_dot_segment(rel)) {
+        return 1;
+    }
+    uint64_t hash = path_hash(rel);
+    pthread_rwlock_rdlock(&filter->bloom_lock);
+    int may_exist = filter->bloom == NULL || bloom_test(filter->bloom, hash);
+    pthread_rwlock_unlock(&filter->bloom_lock);
+    if (!may_exist) {
+        return 0;
+    }
+
+    //one of the few paths the filter lets through by mistake, maybe
+    pthread_mutex_lock(&filter->lock);
+    *generation = filter->generation;
+    const path_miss_t *miss = &filter->misses[hash & (PATH_FILTER_MISSES - 1)];
+    int cached = miss->generation == filter->generation && miss->hash == hash &&
+                 strcmp(miss->path, rel) == 0;
+    pthread_mutex_unlock(&filter->lock);
+    return !cached;
+}
+
+void path_filter_add_miss(path_filter_t *filter, const char *path, uint64_t generation) {
+    const char *rel = relative_path(filter, path);
+    if (rel == NULL || strlen(rel) >= PATH_FILTER_MISS_LEN) {
+        return;
+    }
+    uint64_t hash = path_hash(rel);
+    pthread_mutex_lock(&filter->lock);
+    //a file that appeared since the check may be this one
+    if (generation == filter->generation) {
+        path_miss_t *miss = &filter->misses[hash & (PATH_FILTER_MISSES - 1)];
+        miss->hash = hash;
+        miss->generation = generation;
+        strcpy(miss->path, rel);
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+int path_filter_shutdown(path_filter_t *filter) {
+    int error;
+    if ((error = pthread_mutex_lock(&filter->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    filter->shutdown = 1;
+    if ((error = pthread_mutex_unlock(&filter->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+    //the thread notices within one tick
+    if ((error = pthread_join(filter->thread, NULL)) != 0) {
+        fprintf(stderr, "pthread_join failed: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+int path_filter_free(path_filter_t *filter) {
+    int error;
+    int result = 0;
+    bloom_free(filter->bloom);
+    for (size_t i = 0; i < filter->n_watches; i++) {
+        free(filter->watches[i].dir);
+    }
+    free(filter->watches);
+    free(filter->root);
+    if (close(filter->inotify_fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+    if ((error = pthread_rwlock_destroy(&filter->bloom_lock)) != 0) {
+        fprintf(stderr, "pthread_rwlock_destroy failed: %s\n", strerror(error));
+        result = -1;
+    }
+    if ((error = pthread_mutex_destroy(&filter->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(error));
+        result = -1;
+    }
+    return result;
+}
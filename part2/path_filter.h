@@ -0,0 +1,103 @@
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PATH_FILTER_BITS_PER_PATH 16    // About 0.05% false positives when full
+#define PATH_FILTER_HASHES 8
+#define PATH_FILTER_MIN_BITS 65536      // Power of two
+#define PATH_FILTER_MISSES 1024         // Negative cache slots, power of two
+#define PATH_FILTER_MISS_LEN 128        // Longest path the negative cache holds
+#define PATH_FILTER_TICK_MS 200         // How often the watcher checks for shutdown
+#define PATH_FILTER_EVENT_BUFSIZE 16384
+
+// Bloom filter over the paths of every regular file below the root
+typedef struct {
+    uint64_t *bits;
+    uint64_t mask;              // Number of bits - 1
+    size_t capacity;            // Paths it holds at the intended error rate
+    size_t n_paths;
+} path_bloom_t;
+
+// A path that passed the Bloom filter but turned out not to exist
+typedef struct {
+    uint64_t hash;
+    uint64_t generation;        // Valid while it matches the filter's
+    char path[PATH_FILTER_MISS_LEN];
+} path_miss_t;
+
+// A watched directory
+typedef struct {
+    int wd;
+    char *dir;                  // Relative to the root, "" for the root itself
+} path_watch_t;
+
+// Knows which files exist below a directory without asking the file system,
+// so that requests for paths that do not exist, such as a scanner's, are
+// answered without a single system call. A Bloom filter of every file is
+// built at startup; a path it rules out definitely does not exist. The
+// paths it lets through by mistake are remembered in a small negative cache
+// once an open has failed for them. A thread keeps both current with
+// inotify: new files are added to the filter right away, and the filter is
+// rebuilt once enough files were removed or it has filled up.
+typedef struct path_filter {
+    char *root;                 // Without a trailing '/'
+    size_t root_len;
+    path_bloom_t *bloom;
+    pthread_rwlock_t bloom_lock;
+    path_miss_t misses[PATH_FILTER_MISSES];
+    uint64_t generation;        // Bumped whenever a file appears
+    int shutdown;
+    pthread_mutex_t lock;       // Guards misses, generation and shutdown
+    int inotify_fd;
+    path_watch_t *watches;      // Only touched by the thread after init
+    size_t n_watches;
+    size_t watch_capacity;
+    size_t n_removed;           // Files removed since the filter was built
+    pthread_t thread;
+} path_filter_t;
+
+/*
+ * Build the filter for every file below a directory and start the thread
+ * that keeps it current
+ * filter: Pointer to the path_filter_t to be initialized
+ * root: The directory, as it starts the paths that will be checked
+ * Returns 0 on success or -1 on error
+ */
+int path_filter_init(path_filter_t *filter, const char *root);
+
+/*
+ * Check whether a file may exist
+ * filter: The filter
+ * path: Path of the file, starting with the root. Paths outside the root
+ *       and paths with a "." or ".." segment always may exist.
+ * generation: Set to pass to path_filter_add_miss() if the open fails
+ * Returns 1 if the file may exist, 0 if it definitely does not
+ */
+int path_filter_check(path_filter_t *filter, const char *path, uint64_t *generation);
+
+/*
+ * Remember that a file the filter let through does not exist, unless a file
+ * appeared since it was checked
+ * filter: The filter
+ * path: The path given to path_filter_check()
+ * generation: What path_filter_check() set
+ */
+void path_filter_add_miss(path_filter_t *filter, const char *path, uint64_t generation);
+
+/*
+ * Stop and join the thread that keeps the filter current
+ * filter: The filter
+ * Returns 0 on success or -1 on error
+ */
+int path_filter_shutdown(path_filter_t *filter);
+
+/*
+ * Deallocates and cleans up any resources associated with a filter
+ * Returns 0 on success or -1 on error
+ */
+int path_filter_free(path_filter_t *filter);
+
+#endif // PATH_FILTER_H
@@ -0,0 +1,54 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static (USDT) probe points on the request lifecycle.
+ *
+ * When <sys/sdt.h> is available (systemtap-sdt-dev), the Makefile defines
+ * HAVE_SYS_SDT_H and every probe compiles down to a single nop plus a note in
+ * the .note.stapsdt section. Tools such as bpftrace, perf and SystemTap can
+ * attach to the probes of a running server without recompiling it:
+ *   sudo bpftrace tracing/stage_latency.bt
+ * Without the header the probes only evaluate (and discard) their arguments.
+ *
+ * All probes belong to the 'http_server' provider. Probe arguments:
+ *   accept(fd)                      connection accepted by the main thread
+ *   enqueue(fd, queue_length)       connection added to the connection queue
+ *   dequeue(fd, queue_length)       connection removed by a worker thread
+ *   parse_done(fd, path)            request line parsed, path is the resource
+ *   open(fd, path, file_size)       requested file opened and stat'ed
+ *   header_sent(fd, header_bytes)   response header written
+ *   body_done(fd, body_bytes)       response body fully written
+ *   reject(fd, reason)              request refused by the rate limiter, reason
+ *                                   is RATE_LIMIT_RATE or RATE_LIMIT_CONNS
+ *   close(fd)                       connection socket closed
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE_ACCEPT(fd) DTRACE_PROBE1(http_server, accept, fd)
+#define PROBE_ENQUEUE(fd, len) DTRACE_PROBE2(http_server, enqueue, fd, len)
+#define PROBE_DEQUEUE(fd, len) DTRACE_PROBE2(http_server, dequeue, fd, len)
+#define PROBE_PARSE_DONE(fd, path) DTRACE_PROBE2(http_server, parse_done, fd, path)
+#define PROBE_OPEN(fd, path, size) DTRACE_PROBE3(http_server, open, fd, path, size)
+#define PROBE_HEADER_SENT(fd, bytes) DTRACE_PROBE2(http_server, header_sent, fd, bytes)
+#define PROBE_BODY_DONE(fd, bytes) DTRACE_PROBE2(http_server, body_done, fd, bytes)
+#define PROBE_REJECT(fd, reason) DTRACE_PROBE2(http_server, reject, fd, reason)
+#define PROBE_CLOSE(fd) DTRACE_PROBE1(http_server, close, fd)
+
+#else
+
+#define PROBE_ACCEPT(fd) do { (void)(fd); } while (0)
+#define PROBE_ENQUEUE(fd, len) do { (void)(fd); (void)(len); } while (0)
+#define PROBE_DEQUEUE(fd, len) do { (void)(fd); (void)(len); } while (0)
+#define PROBE_PARSE_DONE(fd, path) do { (void)(fd); (void)(path); } while (0)
+#define PROBE_OPEN(fd, path, size) do { (void)(fd); (void)(path); (void)(size); } while (0)
+#define PROBE_HEADER_SENT(fd, bytes) do { (void)(fd); (void)(bytes); } while (0)
+#define PROBE_BODY_DONE(fd, bytes) do { (void)(fd); (void)(bytes); } while (0)
+#define PROBE_REJECT(fd, reason) do { (void)(fd); (void)(reason); } while (0)
+#define PROBE_CLOSE(fd) do { (void)(fd); } while (0)
+
+#endif // HAVE_SYS_SDT_H
+
+#endif // PROBES_H
@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "proxy_protocol.h"
+#include "timeutil.h"
+
+#define PROXY_CMD_LOCAL 0x20
+#define PROXY_CMD_PROXY 0x21
+#define PROXY_FAMILY_TCP4 0x11
+#define PROXY_FAMILY_TCP6 0x21
+
+// Address block of a PROXY header for TCP over IPv4
+typedef struct {
+    uint8_t src_addr[4];
+    uint8_t dst_addr[4];
+    uint8_t src_port[2];
+    uint8_t dst_port[2];
+} proxy_ipv4_t;
+
+// And for TCP over IPv6
+typedef struct {
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+    uint8_t src_port[2];
+    uint8_t dst_port[2];
+} proxy_ipv6_t;
+
+// Reads exactly len bytes, waiting for them to arrive until deadline_ms on
+// the monotonic clock
+// Returns 0 on success or -1 on error, timeout or end of stream
+static int recv_exact(int fd, void *buf, size_t len, long deadline_ms) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = recv(fd, (char *)buf + total, len - total, 0);
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Connection closed inside the PROXY header\n");
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recv");
+            return -1;
+        }
+        //a client trickling bytes still has to finish in time
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int result;
+        do {
+            long remaining = deadline_ms - monotonic_ms();
+            result = remaining > 0 ? poll(&pfd, 1, (int)remaining) : 0;
+        } while (result == -1 && errno == EINTR);
+        if (result <= 0) {
+            fprintf(stderr, "Timed out waiting for the PROXY header\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int proxy_read_header(http_conn_t *conn) {
+    long deadline_ms = monotonic_ms() + PROXY_RECV_TIMEOUT_MS;
+    uint8_t header[PROXY_V2_HEADER_LEN];
+    if (recv_exact(conn->fd, header, sizeof(header), deadline_ms) != 0) {
+        return -1;
+    }
+    if (memcmp(header, PROXY_V2_SIGNATURE, PROXY_V2_SIGNATURE_LEN) != 0) {
+        fprintf(stderr, "Connection did not start with a PROXY v2 header\n");
+        return -1;
+    }
+    uint8_t command = header[12];
+    uint8_t family = header[13];
+    size_t len = (size_t)header[14] << 8 | header[15];
+    if (command != PROXY_CMD_LOCAL && command != PROXY_CMD_PROXY) {
+        fprintf(stderr, "Unknown PROXY command 0x%02x\n", command);
+        return -1;
+    }
+
+    //large enough for every address block, the TLVs after it are skipped
+    union {
+        proxy_ipv4_t ipv4;
+        proxy_ipv6_t ipv6;
+        uint8_t bytes[256];
+    } block;
+    size_t left = len;
+    size_t block_len = left < sizeof(block) ? left : sizeof(block);
+    if (recv_exact(conn->fd, &block, block_len, deadline_ms) != 0) {
+        return -1;
+    }
+    left -= block_len;
+    while (left > 0) {
+        uint8_t discard[256];
+        size_t n = left < sizeof(discard) ? left : sizeof(discard);
+        if (recv_exact(conn->fd, discard, n, deadline_ms) != 0) {
+            return -1;
+        }
+        left -= n;
+    }
+    if (command == PROXY_CMD_LOCAL) {
+        return 0;
+    }
+
+    if (family == PROXY_FAMILY_TCP4 && len >= sizeof(proxy_ipv4_t)) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&conn->addr;
+        memset(&conn->addr, 0, sizeof(conn->addr));
+        in->sin_family = AF_INET;
+        memcpy(&in->sin_addr, block.ipv4.src_addr, 4);
+        memcpy(&in->sin_port, block.ipv4.src_port, 2);
+        conn->addr_len = sizeof(struct sockaddr_in);
+    } else if (family == PROXY_FAMILY_TCP6 && len >= sizeof(proxy_ipv6_t)) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&conn->addr;
+        memset(&conn->addr, 0, sizeof(conn->addr));
+        in6->sin6_family = AF_INET6;
+        memcpy(&in6->sin6_addr, block.ipv6.src_addr, 16);
+        memcpy(&in6->sin6_port, block.ipv6.src_port, 2);
+        conn->addr_len = sizeof(struct sockaddr_in6);
+    }
+    return 0;
+}
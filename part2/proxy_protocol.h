@@ -0,0 +1,31 @@
+#ifndef PROXY_PROTOCOL_H
+#define PROXY_PROTOCOL_H
+
+#include "http.h"
+
+/*
+ * PROXY protocol version 2, which a reverse proxy uses to pass on the address
+ * of the client it accepted. The proxy sends a binary header before the
+ * client's first byte: a fixed signature, the command, the address family,
+ * and the length of the address block that follows.
+ */
+
+#define PROXY_V2_SIGNATURE "\r\n\r\n\0\r\nQUIT\n"
+#define PROXY_V2_SIGNATURE_LEN 12
+#define PROXY_V2_HEADER_LEN 16      // Signature, command, family and length
+#define PROXY_RECV_TIMEOUT_MS 10000 // Time the whole header may take to arrive
+
+/*
+ * Read the PROXY protocol header at the start of a connection, and make the
+ * client address it carries the connection's address, so that rate limits
+ * and traces see the real client instead of the proxy. A LOCAL command, as
+ * the proxy sends for its own health checks, or an address family other than
+ * IPv4 or IPv6 leaves the address alone.
+ * conn: The connection, whose socket may be non-blocking. Nothing past the
+ *       header is read.
+ * Returns 0 on success or -1 if the header is malformed, missing or not
+ * complete within PROXY_RECV_TIMEOUT_MS
+ */
+int proxy_read_header(http_conn_t *conn);
+
+#endif // PROXY_PROTOCOL_H
@@ -0,0 +1,243 @@
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rate_limit.h"
+#include "timeutil.h"
+
+// Builds the address key for a client, mapping IPv4 into IPv6 form
+// Returns 0 on success or -1 for other address families
+static int make_key(const struct sockaddr *addr, socklen_t addr_len, rate_key_t *key) {
+    memset(key, 0, sizeof(*key));
+    key->prefix_len = 128;
+    if (addr->sa_family == AF_INET && addr_len >= sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        key->addr[10] = 0xff;
+        key->addr[11] = 0xff;
+        memcpy(&key->addr[12], &in->sin_addr, 4);
+        return 0;
+    }
+    if (addr->sa_family == AF_INET6 && addr_len >= sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key->addr, &in6->sin6_addr, 16);
+        return 0;
+    }
+    return -1;
+}
+
+// Turns an address key into the key of its /24 (IPv4) or /64 (IPv6) prefix
+static void make_prefix_key(const rate_key_t *addr_key, rate_key_t *key) {
+    *key = *addr_key;
+    int is_v4 = IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr_key->addr);
+    key->prefix_len = is_v4 ? 96 + 24 : 64;
+    for (int bit = key->prefix_len; bit < 128; bit += 8) {
+        key->addr[bit / 8] = 0;
+    }
+}
+
+static uint64_t key_hash(const rate_key_t *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 16; i++) {
+        hash = (hash ^ key->addr[i]) * 1099511628211ULL;
+    }
+    return (hash ^ key->prefix_len) * 1099511628211ULL;
+}
+
+// Finds the entry for a key, claiming an unused or expired slot for it if
+// create is set. Must be called with the shard's lock held.
+// Returns the entry, or NULL if the key has none
+static rate_entry_t *find_entry(rate_shard_t *shard, uint64_t hash, const rate_key_t *key,
+                                int create, long now) {
+    rate_entry_t *reusable = NULL;
+    for (int i = 0; i < RATE_LIMIT_PROBE; i++) {
+        rate_entry_t *entry = &shard->entries[(hash + i) & (RATE_LIMIT_SLOTS - 1)];
+        if (entry->in_use && memcmp(&entry->key, key, sizeof(*key)) == 0) {
+            return entry;
+        }
+        int expired = !entry->in_use ||
+                      (entry->active == 0 && now - entry->last_seen_ms > RATE_LIMIT_EXPIRY_MS);
+        if (expired && reusable == NULL) {
+            reusable = entry;
+        }
+    }
+    if (!create || reusable == NULL) {
+        return NULL;
+    }
+    reusable->key = *key;
+    reusable->in_use = 1;
+    reusable->active = 0;
+    reusable->tokens = -1;      // Filled on first refill
+    reusable->last_refill_ms = now;
+    reusable->last_seen_ms = now;
+    return reusable;
+}
+
+// Charges one request to a key with the given limits, and a connection to its
+// open count if connection is set
+// Returns RATE_LIMIT_OK or the limit hit, and sets *counted if it was charged
+static int charge(rate_limiter_t *limiter, const rate_key_t *key, int factor, int connection,
+                  int *counted) {
+    uint64_t hash = key_hash(key);
+    rate_shard_t *shard = &limiter->shards[hash & (RATE_LIMIT_SHARDS - 1)];
+    double rate = limiter->rate * factor;
+    double burst = limiter->burst * factor;
+    int max_conns = limiter->max_conns * factor;
+    long now = monotonic_ms();
+    int result = RATE_LIMIT_OK;
+
+    *counted = 0;
+    pthread_mutex_lock(&shard->lock);
+    rate_entry_t *entry = find_entry(shard, hash / RATE_LIMIT_SHARDS, key, 1, now);
+    if (entry == NULL) {
+        //table is full around this key, fail open rather than lock clients out
+        pthread_mutex_unlock(&shard->lock);
+        return RATE_LIMIT_OK;
+    }
+    //refill lazily, from the time since the bucket was last looked at
+    if (entry->tokens < 0) {
+        entry->tokens = burst;
+    } else {
+        entry->tokens += (now - entry->last_refill_ms) * rate / 1000.0;
+        if (entry->tokens > burst) {
+            entry->tokens = burst;
+        }
+    }
+    entry->last_refill_ms = now;
+    entry->last_seen_ms = now;
+
+    if (connection && max_conns > 0 && entry->active >= max_conns) {
+        result = RATE_LIMIT_CONNS;
+    } else if (rate > 0 && entry->tokens < 1) {
+        result = RATE_LIMIT_RATE;
+    } else {
+        if (rate > 0) {
+            entry->tokens -= 1;
+        }
+        if (connection) {
+            entry->active++;
+        }
+        *counted = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+// Takes a connection off a key's open count if connection is set, refunding
+// its token if asked
+static void uncharge(rate_limiter_t *limiter, const rate_key_t *key, int connection, int refund) {
+    uint64_t hash = key_hash(key);
+    rate_shard_t *shard = &limiter->shards[hash & (RATE_LIMIT_SHARDS - 1)];
+    long now = monotonic_ms();
+
+    pthread_mutex_lock(&shard->lock);
+    rate_entry_t *entry = find_entry(shard, hash / RATE_LIMIT_SHARDS, key, 0, now);
+    if (entry != NULL) {
+        if (connection && entry->active > 0) {
+            entry->active--;
+        }
+        if (refund && limiter->rate > 0) {
+            entry->tokens += 1;
+        }
+        entry->last_seen_ms = now;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int rate_limit_init(rate_limiter_t *limiter, double rate, double burst, int max_conns) {
+    int error;
+    limiter->rate = rate;
+    limiter->burst = burst < 1 ? 1 : burst;
+    limiter->max_conns = max_conns;
+    limiter->table = calloc(RATE_LIMIT_SHARDS * RATE_LIMIT_SLOTS, sizeof(rate_entry_t));
+    if (limiter->table == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < RATE_LIMIT_SHARDS; i++) {
+        if ((error = pthread_mutex_init(&limiter->shards[i].lock, NULL)) != 0) {
+            fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&limiter->shards[j].lock);
+            }
+            free(limiter->table);
+            return -1;
+        }
+        limiter->shards[i].entries = limiter->table + i * RATE_LIMIT_SLOTS;
+    }
+    return 0;
+}
+
+// Charges a request, and a connection if connection is set, to an address and
+// its prefix, or to neither
+// Returns RATE_LIMIT_OK or the limit that was hit
+static int charge_client(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len,
+                         int connection, int *counted) {
+    rate_key_t addr_key;
+    rate_key_t prefix_key;
+    int charged;
+    *counted = 0;
+    if (make_key(addr, addr_len, &addr_key) != 0) {
+        return RATE_LIMIT_OK;
+    }
+    make_prefix_key(&addr_key, &prefix_key);
+
+    int result = charge(limiter, &addr_key, 1, connection, &charged);
+    if (result != RATE_LIMIT_OK) {
+        return result;
+    }
+    if (charged) {
+        *counted |= RATE_LIMIT_KEY_ADDR;
+    }
+    result = charge(limiter, &prefix_key, RATE_LIMIT_PREFIX_FACTOR, connection, &charged);
+    if (result != RATE_LIMIT_OK) {
+        //the whole request is rejected, so the address gets its token back
+        if (*counted & RATE_LIMIT_KEY_ADDR) {
+            uncharge(limiter, &addr_key, connection, 1);
+        }
+        *counted = 0;
+        return result;
+    }
+    if (charged) {
+        *counted |= RATE_LIMIT_KEY_PREFIX;
+    }
+    return RATE_LIMIT_OK;
+}
+
+int rate_limit_admit(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len,
+                     int *counted) {
+    return charge_client(limiter, addr, addr_len, 1, counted);
+}
+
+int rate_limit_take(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len) {
+    int counted;
+    return charge_client(limiter, addr, addr_len, 0, &counted);
+}
+
+void rate_limit_release(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len,
+                        int counted) {
+    rate_key_t addr_key;
+    rate_key_t prefix_key;
+    if (counted == 0 || make_key(addr, addr_len, &addr_key) != 0) {
+        return;
+    }
+    if (counted & RATE_LIMIT_KEY_ADDR) {
+        uncharge(limiter, &addr_key, 1, 0);
+    }
+    if (counted & RATE_LIMIT_KEY_PREFIX) {
+        make_prefix_key(&addr_key, &prefix_key);
+        uncharge(limiter, &prefix_key, 1, 0);
+    }
+}
+
+int rate_limit_free(rate_limiter_t *limiter) {
+    int error;
+    int result = 0;
+    for (int i = 0; i < RATE_LIMIT_SHARDS; i++) {
+        if ((error = pthread_mutex_destroy(&limiter->shards[i].lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(error));
+            result = -1;
+        }
+    }
+    free(limiter->table);
+    return result;
+}
@@ -0,0 +1,109 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RATE_LIMIT_SHARDS 16        // Power of two
+#define RATE_LIMIT_SLOTS 512        // Entries per shard, power of two
+#define RATE_LIMIT_PROBE 16         // Slots searched before giving up on a key
+#define RATE_LIMIT_EXPIRY_MS 60000  // Idle entries are reused after this long
+#define RATE_LIMIT_PREFIX_FACTOR 8  // A /24 or /64 gets this many times an address's limits
+#define CACHE_LINE_SIZE 64
+
+// Results of rate_limit_admit() and rate_limit_take()
+#define RATE_LIMIT_OK 0
+#define RATE_LIMIT_RATE 1           // Out of tokens
+#define RATE_LIMIT_CONNS 2          // Too many connections open at once
+
+// Bits of rate_limit_admit()'s counted result, one per key charged
+#define RATE_LIMIT_KEY_ADDR 1
+#define RATE_LIMIT_KEY_PREFIX 2
+
+// A client address or address prefix, in IPv6 form
+typedef struct {
+    uint8_t addr[16];
+    uint8_t prefix_len;         // 128 for a single address
+} rate_key_t;
+
+// Token bucket and open connection count for one key
+typedef struct {
+    rate_key_t key;
+    int in_use;
+    int active;
+    double tokens;
+    long last_refill_ms;
+    long last_seen_ms;
+} rate_entry_t;
+
+// Each shard has its own lock and sits on its own cache line, so workers
+// admitting different clients rarely contend
+typedef struct {
+    pthread_mutex_t lock;
+    rate_entry_t *entries;
+} __attribute__((aligned(CACHE_LINE_SIZE))) rate_shard_t;
+
+// Per client address and per /24 (IPv4) or /64 (IPv6) prefix limits on the
+// request rate and on the number of connections open at once. Entries are
+// never removed; one that has been idle for RATE_LIMIT_EXPIRY_MS is simply
+// overwritten by the next key that hashes near it.
+typedef struct rate_limiter {
+    rate_shard_t shards[RATE_LIMIT_SHARDS];
+    double rate;                // Tokens added per second, 0 for no rate limit
+    double burst;               // Bucket size
+    int max_conns;              // 0 for no connection limit
+    rate_entry_t *table;        // One block holding every shard's entries
+} rate_limiter_t;
+
+/*
+ * Initialize a rate limiter
+ * limiter: Pointer to the rate_limiter_t to be initialized
+ * rate: Requests per second allowed from one address, 0 for no limit
+ * burst: Requests an idle address may make at once
+ * max_conns: Connections one address may have open at once, 0 for no limit
+ * Returns 0 on success or -1 on error
+ */
+int rate_limit_init(rate_limiter_t *limiter, double rate, double burst, int max_conns);
+
+/*
+ * Charge a new request against its client's address and prefix. If either is
+ * over its limit nothing is charged. Addresses that are not IPv4 or IPv6, and
+ * keys that do not fit in a full table, are let through uncounted.
+ * limiter: The rate limiter
+ * addr: The client address
+ * addr_len: The length of addr
+ * counted: Set to the RATE_LIMIT_KEY_* bits of the keys that were charged
+ * Returns RATE_LIMIT_OK or the limit that was hit
+ */
+int rate_limit_admit(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len,
+                     int *counted);
+
+/*
+ * Charge one more request on a connection that was already admitted, such as
+ * a later stream of an HTTP/2 connection. Only the request rate is checked;
+ * the connection is already part of the open counts.
+ * limiter: The rate limiter
+ * addr: The client address
+ * addr_len: The length of addr
+ * Returns RATE_LIMIT_OK or RATE_LIMIT_RATE
+ */
+int rate_limit_take(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len);
+
+/*
+ * Drop a connection admitted by rate_limit_admit() from the open counts
+ * limiter: The rate limiter
+ * addr: The client address
+ * addr_len: The length of addr
+ * counted: The bits rate_limit_admit() returned for this connection
+ */
+void rate_limit_release(rate_limiter_t *limiter, const struct sockaddr *addr, socklen_t addr_len,
+                        int counted);
+
+/*
+ * Deallocates and cleans up any resources associated with a rate limiter.
+ * Returns 0 on success or -1 on error
+ */
+int rate_limit_free(rate_limiter_t *limiter);
+
+#endif // RATE_LIMIT_H
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "send_loop.h"
+#include "stats.h"
+#include "timeutil.h"
+
+#define SEND_LOOP_TICK_MS 1000
+
+// Unlinks a response from the pending list and stops watching its socket.
+// Must be called with the lock held.
+static void remove_pending(send_loop_t *loop, http_send_t *send) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, send->client_fd, NULL);
+    if (send->prev != NULL) {
+        send->prev->next = send->next;
+    } else {
+        loop->pending = send->next;
+    }
+    if (send->next != NULL) {
+        send->next->prev = send->prev;
+    }
+    send->prev = NULL;
+    send->next = NULL;
+    loop->n_pending--;
+    if (send->linger_until_ms != 0) {
+        loop->n_lingering--;
+    }
+}
+
+// Closes a connection that was waiting for its client to close, once it has
+// been removed from the pending list. Must be called without the lock: the
+// close releases the connection, its rate limit slot and its file.
+static void end_linger(http_send_t *send) {
+    send->linger_until_ms = 0;
+    http_conn_close(send->conn);
+}
+
+// Reads and discards whatever a lingering client sent
+// Returns 1 once the client has closed its side (or the socket failed), 0 if
+// it may send more
+static int drain(int fd) {
+    char discard[512];
+    while (1) {
+        ssize_t n = read(fd, discard, sizeof(discard));
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+}
+
+// Drops every response that has not made progress within SEND_TIMEOUT_MS,
+// and closes the lingering connections whose time is up
+static void expire_stalled(send_loop_t *loop) {
+    long now = monotonic_ms();
+    http_send_t *expired = NULL;
+    pthread_mutex_lock(&loop->lock);
+    http_send_t *send = loop->pending;
+    while (send != NULL) {
+        http_send_t *next = send->next;
+        if (send->linger_until_ms != 0 ? now >= send->linger_until_ms
+                                       : now - send->last_progress_ms > SEND_TIMEOUT_MS) {
+            remove_pending(loop, send);
+            send->next = expired;
+            expired = send;
+        }
+        send = next;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    //finished after unlocking, so that threads parking responses don't wait
+    //on the closes
+    while (expired != NULL) {
+        send = expired;
+        expired = send->next;
+        send->next = NULL;
+        if (send->linger_until_ms != 0) {
+            end_linger(send);
+            continue;
+        }
+        fprintf(stderr, "Client on fd %d stalled, dropping response\n", send->client_fd);
+        //a client that stopped reading will not close either
+        send->conn->linger = 0;
+        http_send_finish(send, 0);
+    }
+}
+
+// Resumes every deferred response; those the I/O pool still has no room for
+// come back to the list
+static void retry_deferred(send_loop_t *loop) {
+    pthread_mutex_lock(&loop->lock);
+    http_send_t *send = loop->deferred;
+    loop->deferred = NULL;
+    loop->n_deferred = 0;
+    pthread_mutex_unlock(&loop->lock);
+    while (send != NULL) {
+        http_send_t *next = send->next;
+        send->next = NULL;
+        stats_set_state(STATS_SENDING, send->conn->request.resource_name);
+        if (http_send_dispatch(send, 1) != 0) {
+            fprintf(stderr, "Failed to write http request\n");
+        }
+        stats_set_state(STATS_IDLE, NULL);
+        send = next;
+    }
+}
+
+static void *send_loop_func(void *arg) {
+    send_loop_t *loop = arg;
+    struct epoll_event events[SEND_LOOP_MAX_EVENTS];
+    long last_expiry = monotonic_ms();
+    stats_thread_start("send");
+
+    while (1) {
+        pthread_mutex_lock(&loop->lock);
+        if (loop->shutdown && loop->n_pending == 0 && loop->n_deferred == 0) {
+            loop->running = 0;
+            pthread_mutex_unlock(&loop->lock);
+            return (void *)0;
+        }
+        //lingering connections are closed after LINGER_MS, not a whole tick
+        int lingering = loop->n_lingering > 0;
+        int timeout = lingering ? LINGER_MS : SEND_LOOP_TICK_MS;
+        if (loop->n_deferred > 0) {
+            timeout = SEND_LOOP_RETRY_MS;
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        int n_events = epoll_wait(loop->epoll_fd, events, SEND_LOOP_MAX_EVENTS, timeout);
+        if (n_events == -1) {
+            perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n_events; i++) {
+            http_send_t *send = events[i].data.ptr;
+            if (send == NULL) {
+                //woken up for a deferred response
+                uint64_t count;
+                if (read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    perror("read");
+                }
+                continue;
+            }
+            if (send->linger_until_ms != 0) {
+                if (drain(send->client_fd)) {
+                    pthread_mutex_lock(&loop->lock);
+                    remove_pending(loop, send);
+                    pthread_mutex_unlock(&loop->lock);
+                    end_linger(send);
+                }
+                continue;
+            }
+            pthread_mutex_lock(&loop->lock);
+            remove_pending(loop, send);
+            pthread_mutex_unlock(&loop->lock);
+            //resume; if the socket fills up again this parks it once more
+            stats_set_state(STATS_SENDING, send->conn->request.resource_name);
+            if (http_send_dispatch(send, 1) != 0) {
+                fprintf(stderr, "Failed to write http request\n");
+            }
+            stats_set_state(STATS_IDLE, NULL);
+        }
+        retry_deferred(loop);
+        if (lingering || monotonic_ms() - last_expiry >= SEND_LOOP_TICK_MS) {
+            expire_stalled(loop);
+            last_expiry = monotonic_ms();
+        }
+    }
+}
+
+int send_loop_init(send_loop_t *loop) {
+    loop->pending = NULL;
+    loop->n_pending = 0;
+    loop->n_lingering = 0;
+    loop->deferred = NULL;
+    loop->n_deferred = 0;
+    loop->shutdown = 0;
+    loop->running = 0;
+    int error;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (loop->wake_fd == -1 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1) {
+        perror(loop->wake_fd == -1 ? "eventfd" : "epoll_ctl");
+        if (loop->wake_fd != -1) {
+            close(loop->wake_fd);
+        }
+        close(loop->epoll_fd);
+        return -1;
+    }
+    if ((error = pthread_mutex_init(&loop->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(error));
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+    loop->running = 1;
+    if ((error = pthread_create(&loop->thread, NULL, send_loop_func, loop)) != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+        pthread_mutex_destroy(&loop->lock);
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Watches a socket for 'events' and adds its response to the pending list
+// Returns 0 on success, 1 if the loop is shutting down, or -1 on error
+static int park(send_loop_t *loop, http_send_t *send, uint32_t events) {
+    int error;
+    if ((error = pthread_mutex_lock(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    //the loop thread itself may re-park responses while draining at shutdown
+    if (!loop->running) {
+        pthread_mutex_unlock(&loop->lock);
+        return 1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = send;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, send->client_fd, &event) == -1) {
+        perror("epoll_ctl");
+        pthread_mutex_unlock(&loop->lock);
+        return -1;
+    }
+    send->prev = NULL;
+    send->next = loop->pending;
+    if (loop->pending != NULL) {
+        loop->pending->prev = send;
+    }
+    loop->pending = send;
+    loop->n_pending++;
+    if (send->linger_until_ms != 0) {
+        loop->n_lingering++;
+    }
+
+    if ((error = pthread_mutex_unlock(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+int send_loop_add(send_loop_t *loop, http_send_t *send) {
+    send->linger_until_ms = 0;
+    return park(loop, send, EPOLLOUT);
+}
+
+int send_loop_defer(send_loop_t *loop, http_send_t *send) {
+    int error;
+    if ((error = pthread_mutex_lock(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    if (!loop->running) {
+        pthread_mutex_unlock(&loop->lock);
+        return 1;
+    }
+    //not watched by epoll, only the next and count fields are used
+    send->prev = NULL;
+    send->next = loop->deferred;
+    loop->deferred = send;
+    loop->n_deferred++;
+    if ((error = pthread_mutex_unlock(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+    //the loop retries on its own, waking it for its own retries would spin
+    uint64_t one = 1;
+    if (!pthread_equal(pthread_self(), loop->thread) && write(loop->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+    return 0;
+}
+
+int send_loop_linger(send_loop_t *loop, http_send_t *send) {
+    send->linger_until_ms = monotonic_ms() + LINGER_MS;
+    int result = park(loop, send, EPOLLIN | EPOLLRDHUP);
+    if (result != 0) {
+        send->linger_until_ms = 0;
+    }
+    return result;
+}
+
+int send_loop_shutdown(send_loop_t *loop) {
+    int error;
+    if ((error = pthread_mutex_lock(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(error));
+        return -1;
+    }
+    loop->shutdown = 1;
+    if ((error = pthread_mutex_unlock(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(error));
+        return -1;
+    }
+
+    //the thread notices within one tick and exits once nothing is pending
+    if ((error = pthread_join(loop->thread, NULL)) != 0) {
+        fprintf(stderr, "pthread_join failed: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+int send_loop_free(send_loop_t *loop) {
+    int error;
+    if ((error = pthread_mutex_destroy(&loop->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(error));
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+    if (close(loop->wake_fd) == -1) {
+        perror("close");
+    }
+    if (close(loop->epoll_fd) == -1) {
+        perror("close");
+        return -1;
+    }
+    return 0;
+}
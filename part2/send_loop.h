@@ -0,0 +1,87 @@
+#ifndef SEND_LOOP_H
+#define SEND_LOOP_H
+
+#include <pthread.h>
+#include "http.h"
+
+// Responses that make no progress for this long are dropped
+#define SEND_TIMEOUT_MS 30000
+#define SEND_LOOP_MAX_EVENTS 64
+#define SEND_LOOP_RETRY_MS 5       // How often deferred responses retry the I/O pool
+
+// A single thread that waits, with epoll, for the sockets of slow clients to
+// become writable again and resumes their responses. This keeps a client that
+// reads slowly from holding on to a worker thread for the whole transfer. It
+// also waits for clients to close connections that linger (see
+// http_conn_close), and holds responses that need a disk read while the I/O
+// pool has no room, so that neither it nor a worker blocks on the disk.
+typedef struct send_loop {
+    int epoll_fd;
+    int wake_fd;                // eventfd that wakes the loop for deferred responses
+    http_send_t *pending;       // Responses waiting for their socket
+    int n_pending;
+    int n_lingering;            // Of those, connections waiting for the client to close
+    http_send_t *deferred;      // Responses waiting for room in the I/O pool
+    int n_deferred;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int running;                // Cleared when the loop thread exits
+} send_loop_t;
+
+/*
+ * Initialize a send loop and start its thread
+ * loop: Pointer to the send_loop_t to be initialized
+ * Returns 0 on success or -1 on error
+ */
+int send_loop_init(send_loop_t *loop);
+
+/*
+ * Park a response until its socket is writable. The loop owns the response
+ * from now on.
+ * loop: The send loop
+ * send: A response whose last write hit a full socket buffer
+ * Returns 0 on success, 1 if the loop is shutting down (the caller keeps the
+ * response), or -1 on error
+ */
+int send_loop_add(send_loop_t *loop, http_send_t *send);
+
+/*
+ * Hold a response whose next read would block until the I/O pool has room
+ * for it, resuming it every SEND_LOOP_RETRY_MS. The loop owns the response
+ * from now on.
+ * loop: The send loop
+ * send: A response that stopped with HTTP_SEND_DISK_BLOCKED
+ * Returns 0 on success, 1 if the loop is shutting down (the caller keeps the
+ * response), or -1 on error
+ */
+int send_loop_defer(send_loop_t *loop, http_send_t *send);
+
+/*
+ * Wait for the client of a finished response to close its side of the
+ * socket, which has been shut down for writing, then close the connection
+ * (see http_conn_close). Whatever the client still sends is discarded, and
+ * the connection is closed anyway after LINGER_MS.
+ * loop: The send loop
+ * send: The response state of the connection, with client_fd and conn set
+ * Returns 0 on success, 1 if the loop is shutting down (the caller closes the
+ * connection), or -1 on error
+ */
+int send_loop_linger(send_loop_t *loop, http_send_t *send);
+
+/*
+ * Stop accepting new responses, wait until every parked or deferred response
+ * has finished or timed out, then join the loop thread. The I/O pool must
+ * still be running, deferred responses are handed to it.
+ * loop: The send loop to shut down
+ * Returns 0 on success or -1 on error
+ */
+int send_loop_shutdown(send_loop_t *loop);
+
+/*
+ * Deallocates and cleans up any resources associated with a send loop.
+ * Returns 0 on success or -1 on error
+ */
+int send_loop_free(send_loop_t *loop);
+
+#endif // SEND_LOOP_H
@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "stats.h"
+#include "timeutil.h"
+
+const char *stats_counter_names[STATS_N_COUNTERS] = {
+    "accepted", "requests", "completed", "failed", "rejected", "bytes", "queued", "open",
+};
+
+const char *stats_state_names[] = { "idle", "reading", "sending" };
+
+static stats_segment_t *segment;
+static char segment_name[NAME_MAX];
+
+// Slot of the calling thread, NULL if it has none
+static __thread stats_thread_t *my_slot;
+
+// Turns a user supplied name into a shared memory object name
+static void make_name(const char *name, char *out, size_t len) {
+    snprintf(out, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+// Starts an update of the caller's own slot, readers retry until it ends
+static void slot_begin(stats_thread_t *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_end(stats_thread_t *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+int stats_open(const char *name) {
+    make_name(name, segment_name, sizeof(segment_name));
+    int fd = shm_open(segment_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(stats_segment_t)) == -1) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(segment_name);
+        return -1;
+    }
+    stats_segment_t *map = mmap(NULL, sizeof(stats_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(segment_name);
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+    map->size = sizeof(stats_segment_t);
+    map->pid = getpid();
+    map->start_ns = monotonic_ns();
+    //readers check the magic last, once everything else is in place
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(map->magic, STATS_MAGIC, sizeof(map->magic));
+    segment = map;
+    return 0;
+}
+
+void stats_close(void) {
+    if (segment == NULL) {
+        return;
+    }
+    munmap(segment, sizeof(stats_segment_t));
+    segment = NULL;
+    shm_unlink(segment_name);
+}
+
+void stats_thread_start(const char *role) {
+    if (segment == NULL) {
+        return;
+    }
+    uint32_t idx = __atomic_fetch_add(&segment->n_threads, 1, __ATOMIC_RELAXED);
+    if (idx >= STATS_MAX_THREADS) {
+        return;
+    }
+    stats_thread_t *slot = &segment->threads[idx];
+    slot_begin(slot);
+    snprintf(slot->role, sizeof(slot->role), "%s", role);
+    slot->state = STATS_IDLE;
+    slot->state_since_ns = monotonic_ns();
+    slot_end(slot);
+    my_slot = slot;
+}
+
+void stats_set_state(int state, const char *path) {
+    stats_thread_t *slot = my_slot;
+    if (slot == NULL) {
+        return;
+    }
+    slot_begin(slot);
+    slot->state = state;
+    snprintf(slot->path, sizeof(slot->path), "%s", path != NULL ? path : "");
+    slot->state_since_ns = monotonic_ns();
+    if (state == STATS_READING) {
+        slot->requests++;
+    }
+    slot_end(slot);
+}
+
+void stats_add_bytes(uint64_t bytes) {
+    if (segment == NULL) {
+        return;
+    }
+    __atomic_fetch_add(&segment->counters[STATS_BYTES], bytes, __ATOMIC_RELAXED);
+    stats_thread_t *slot = my_slot;
+    if (slot != NULL) {
+        slot_begin(slot);
+        slot->bytes_sent += bytes;
+        slot_end(slot);
+    }
+}
+
+void stats_count(int counter, int64_t delta) {
+    if (segment != NULL) {
+        __atomic_fetch_add(&segment->counters[counter], delta, __ATOMIC_RELAXED);
+    }
+}
+
+const stats_segment_t *stats_attach(const char *name) {
+    char shm_name[NAME_MAX];
+    make_name(name, shm_name, sizeof(shm_name));
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    const stats_segment_t *map = mmap(NULL, sizeof(stats_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (memcmp(map->magic, STATS_MAGIC, sizeof(map->magic)) != 0 || map->size != sizeof(stats_segment_t)) {
+        fprintf(stderr, "%s is not a statistics segment of this server version\n", shm_name);
+        munmap((void *)map, sizeof(stats_segment_t));
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return map;
+}
+
+int stats_read_thread(const stats_thread_t *src, stats_thread_t *dst) {
+    for (int i = 0; i < STATS_READ_RETRIES; i++) {
+        uint32_t before = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(dst, src, sizeof(*dst));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == before) {
+            return 0;
+        }
+    }
+    //the writer died mid-update or the slot is extremely busy
+    return -1;
+}
@@ -0,0 +1,119 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Live statistics published in a POSIX shared memory segment (-m <name>), so
+ * that http_top can show what a running server is doing without stopping it
+ * or attaching a debugger.
+ *
+ * Every worker, disk I/O and send loop thread owns one slot and is its only writer. A
+ * slot is guarded by a sequence counter (seqlock): the writer makes it odd
+ * while updating and even again afterwards, and a reader retries until it
+ * copies the slot without the counter changing. Writers never wait for
+ * readers. Global counters are plain atomics.
+ */
+
+#define STATS_MAGIC "HTTPSTA1"
+#define STATS_MAX_THREADS 32
+#define STATS_PATH_LEN 128
+#define STATS_ROLE_LEN 8
+#define STATS_READ_RETRIES 1000
+
+// Thread states
+#define STATS_IDLE 0        // Waiting for work
+#define STATS_READING 1     // Reading and parsing a request
+#define STATS_SENDING 2     // Writing a response
+
+// Global counters
+#define STATS_ACCEPTED 0    // Connections accepted
+#define STATS_REQUESTS 1    // Requests parsed
+#define STATS_COMPLETED 2   // Responses sent in full
+#define STATS_FAILED 3      // Responses dropped on error or timeout
+#define STATS_REJECTED 4    // Requests refused by the rate limiter
+#define STATS_BYTES 5       // Bytes written to clients
+#define STATS_QUEUED 6      // Connections waiting for a worker (gauge)
+#define STATS_OPEN 7        // Connections open (gauge)
+#define STATS_N_COUNTERS 8
+
+typedef struct {
+    uint32_t seq;                   // Odd while the owner is updating the slot
+    int state;
+    char role[STATS_ROLE_LEN];      // "worker", "io" or "send", empty if unused
+    char path[STATS_PATH_LEN];      // Resource being served
+    uint64_t state_since_ns;        // CLOCK_MONOTONIC time the state was entered
+    uint64_t bytes_sent;            // Bytes written by this thread
+    uint64_t requests;              // Requests this thread has started on
+} __attribute__((aligned(64))) stats_thread_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t size;                  // sizeof(stats_segment_t), checked by readers
+    int32_t pid;
+    uint64_t start_ns;              // CLOCK_MONOTONIC time the server started
+    uint32_t n_threads;             // Slots handed out so far
+    int64_t counters[STATS_N_COUNTERS];
+    stats_thread_t threads[STATS_MAX_THREADS];
+} stats_segment_t;
+
+extern const char *stats_counter_names[STATS_N_COUNTERS];
+extern const char *stats_state_names[];
+
+/*
+ * Create and map the statistics segment. Until this is called every other
+ * stats_* update is a no-op.
+ * name: Shared memory object name, a leading '/' is added if missing
+ * Returns 0 on success or -1 on error
+ */
+int stats_open(const char *name);
+
+/*
+ * Unmap the statistics segment and remove its name
+ */
+void stats_close(void);
+
+/*
+ * Claim a slot for the calling thread. Threads without a slot only update
+ * the global counters.
+ * role: Short label shown by the viewer
+ */
+void stats_thread_start(const char *role);
+
+/*
+ * Record what the calling thread is doing now
+ * state: One of the STATS_* thread states
+ * path: The resource being served, or NULL
+ */
+void stats_set_state(int state, const char *path);
+
+/*
+ * Count bytes written to a client, both globally and for the calling thread
+ * bytes: Number of bytes
+ */
+void stats_add_bytes(uint64_t bytes);
+
+/*
+ * Add to one of the global counters
+ * counter: One of the STATS_* counters
+ * delta: Amount to add, negative to decrease a gauge
+ */
+void stats_count(int counter, int64_t delta);
+
+/*
+ * Map an existing statistics segment read-only, as the viewer does
+ * name: Shared memory object name, a leading '/' is added if missing
+ * Returns the segment, or NULL on error
+ */
+const stats_segment_t *stats_attach(const char *name);
+
+/*
+ * Take a consistent copy of a thread slot
+ * src: The slot in the shared segment
+ * dst: Filled with the copy
+ * Returns 0 on success or -1 if no consistent copy could be taken within
+ * STATS_READ_RETRIES tries
+ */
+int stats_read_thread(const stats_thread_t *src, stats_thread_t *dst);
+
+#endif // STATS_H
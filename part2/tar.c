@@ -0,0 +1,450 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tar.h"
+
+// Header block of one archive member, as laid out by POSIX ustar
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} ustar_header_t;
+
+_Static_assert(sizeof(ustar_header_t) == TAR_BLOCK, "ustar header must fill one block");
+
+int tar_is_request(const char *resource_name) {
+    size_t len = strlen(TAR_RESOURCE);
+    return strncmp(resource_name, TAR_RESOURCE, len) == 0 &&
+           (resource_name[len] == '\0' || resource_name[len] == '?');
+}
+
+// Decodes %XX escapes in place
+// Returns 0 on success or -1 if an escape is malformed
+static int percent_decode(char *s) {
+    char *out = s;
+    for (char *in = s; *in != '\0'; in++) {
+        if (*in != '%') {
+            *out++ = *in;
+            continue;
+        }
+        char hex[3] = { in[1], in[1] != '\0' ? in[2] : '\0', '\0' };
+        char *end;
+        long value = strtol(hex, &end, 16);
+        if (hex[0] == '\0' || hex[1] == '\0' || *end != '\0' || value == 0) {
+            return -1;
+        }
+        *out++ = (char)value;
+        in += 2;
+    }
+    *out = '\0';
+    return 0;
+}
+
+// Returns 1 if a relative path stays inside the directory, 0 if it has an
+// empty, "." or ".." component. A trailing '/' is allowed if 'dir_ok' is set.
+static int path_is_safe(const char *path, int dir_ok) {
+    const char *component = path;
+    while (1) {
+        size_t len = strcspn(component, "/");
+        if ((len == 0 && !(dir_ok && component[0] == '\0' && component != path)) ||
+            (len == 1 && component[0] == '.') ||
+            (len == 2 && component[0] == '.' && component[1] == '.')) {
+            return 0;
+        }
+        if (component[len] == '\0') {
+            return 1;
+        }
+        component += len + 1;
+    }
+}
+
+// Finds where a name too long for the name field of a ustar header splits
+// into its prefix and name fields
+// Returns the length of the prefix, 0 if the name fits whole, or -1 if it
+// cannot be stored
+static int split_name(const char *name) {
+    size_t len = strlen(name);
+    if (len <= sizeof(((ustar_header_t *)0)->name)) {
+        return 0;
+    }
+    for (size_t i = len - 1; i > 0; i--) {
+        if (name[i] == '/' && i <= sizeof(((ustar_header_t *)0)->prefix) &&
+            len - i - 1 <= sizeof(((ustar_header_t *)0)->name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Adds a file to the archive, growing the member array as needed
+// Returns 0 on success or an errno
+static int add_member(tar_archive_t *archive, size_t *capacity, const char *name,
+                      const struct stat *st) {
+    if (archive->n_members == TAR_MAX_FILES) {
+        return E2BIG;
+    }
+    if (split_name(name) < 0) {
+        return ENAMETOOLONG;
+    }
+    if (archive->n_members == *capacity) {
+        size_t grown_capacity = *capacity == 0 ? 64 : *capacity * 2;
+        tar_member_t *grown = realloc(archive->members, grown_capacity * sizeof(tar_member_t));
+        if (grown == NULL) {
+            return ENOMEM;
+        }
+        archive->members = grown;
+        *capacity = grown_capacity;
+    }
+    tar_member_t *member = &archive->members[archive->n_members];
+    member->name = strdup(name);
+    if (member->name == NULL) {
+        return ENOMEM;
+    }
+    member->size = st->st_size;
+    member->mode = st->st_mode & 07777;
+    member->mtime = st->st_mtime;
+    archive->n_members++;
+    return 0;
+}
+
+// Adds one file named in a files= list
+// Returns 0 on success or an errno
+static int add_file(tar_archive_t *archive, size_t *capacity, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", archive->dir, name) >= sizeof(path)) {
+        return ENAMETOOLONG;
+    }
+    if (stat(path, &st) != 0) {
+        return errno;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return ENOENT;
+    }
+    return add_member(archive, capacity, name, &st);
+}
+
+// Adds every regular file under the directory 'rel' whose name starts with
+// 'prefix', only descending into directories that can hold such names.
+// Symbolic links to files are followed, those to directories are not.
+// Returns 0 on success or an errno
+static int add_tree(tar_archive_t *archive, size_t *capacity, const char *rel, const char *prefix) {
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    size_t prefix_len = strlen(prefix);
+    snprintf(path, sizeof(path), "%s/%s", archive->dir, rel);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return errno;
+    }
+    int error = 0;
+    struct dirent *entry;
+    while (error == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if ((size_t)snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] != '\0' ? "/" : "",
+                             entry->d_name) >= sizeof(name) ||
+            (size_t)snprintf(path, sizeof(path), "%s/%s", archive->dir, name) >= sizeof(path)) {
+            error = ENAMETOOLONG;
+            break;
+        }
+        size_t name_len = strlen(name);
+        if (strncmp(name, prefix, name_len < prefix_len ? name_len : prefix_len) != 0) {
+            continue;
+        }
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            error = add_tree(archive, capacity, name, prefix);
+            continue;
+        }
+        if (S_ISLNK(st.st_mode) && stat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && name_len >= prefix_len) {
+            error = add_member(archive, capacity, name, &st);
+        }
+    }
+    closedir(dir);
+    return error;
+}
+
+static int compare_members(const void *a, const void *b) {
+    return strcmp(((const tar_member_t *)a)->name, ((const tar_member_t *)b)->name);
+}
+
+// Writes a number into a header field: octal digits and a NUL, or base-256
+// (a GNU extension every common tar reads) if the digits would not fit
+static void put_number(char *field, size_t width, uint64_t value) {
+    if (value >> (3 * (width - 1)) == 0) {
+        snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+        return;
+    }
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+// Fills in the header block of a member
+static void member_header(char *block, const tar_member_t *member) {
+    ustar_header_t *header = (ustar_header_t *)block;
+    memset(header, 0, sizeof(*header));
+    size_t len = strlen(member->name);
+    int split = split_name(member->name);
+    if (split > 0) {
+        memcpy(header->prefix, member->name, split);
+        memcpy(header->name, member->name + split + 1, len - split - 1);
+    } else {
+        memcpy(header->name, member->name, len);
+    }
+    put_number(header->mode, sizeof(header->mode), member->mode);
+    put_number(header->uid, sizeof(header->uid), 0);
+    put_number(header->gid, sizeof(header->gid), 0);
+    put_number(header->size, sizeof(header->size), member->size);
+    put_number(header->mtime, sizeof(header->mtime), member->mtime > 0 ? member->mtime : 0);
+    header->typeflag = '0';
+    memcpy(header->magic, "ustar", sizeof(header->magic));
+    memcpy(header->version, "00", sizeof(header->version));
+
+    //the checksum is taken with its own field full of spaces
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    unsigned int sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        sum += (unsigned char)block[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum) - 1, "%06o", sum);
+    header->checksum[sizeof(header->checksum) - 1] = ' ';
+}
+
+// Unmaps the member that was being sent
+static void unmap_member(tar_archive_t *archive) {
+    if (archive->map != NULL) {
+        munmap(archive->map, archive->map_len);
+        archive->map = NULL;
+    }
+}
+
+// Loads the next part of the archive: the end of the previous member, then
+// either the next member's header and contents or the end-of-archive blocks
+static int archive_next(http_parts_t *parts, http_send_t *send, int nowait) {
+    tar_archive_t *archive = (tar_archive_t *)parts;
+    if (archive->done) {
+        return 0;
+    }
+    if (nowait && archive->next < archive->n_members) {
+        //opening the member can wait for the disk, leave it to an I/O thread.
+        //If the pool is full the send loop retries later with nowait set
+        //(send_loop_defer), so the open never runs on the loop itself.
+        return HTTP_SEND_DISK_BLOCKED;
+    }
+    send->parts_sent += send->buf_len + (send->end - send->body_start);
+    if (send->file != NULL) {
+        http_release_file(send->file);
+        send->file = NULL;
+    }
+    send->map = NULL;
+    unmap_member(archive);
+    send->file_fd = -1;
+    send->body_start = 0;
+    send->offset = 0;
+    send->end = 0;
+
+    char *buf = send->buf;
+    size_t len = archive->pad;
+    memset(buf, 0, len);
+    if (archive->chunked && archive->next > 0) {
+        memcpy(buf + len, "\r\n", 2);
+        len += 2;
+    }
+
+    if (archive->next == archive->n_members) {
+        //two zero blocks end the archive
+        if (archive->chunked) {
+            len += sprintf(buf + len, "%x\r\n", 2 * TAR_BLOCK);
+        }
+        memset(buf + len, 0, 2 * TAR_BLOCK);
+        len += 2 * TAR_BLOCK;
+        if (archive->chunked) {
+            memcpy(buf + len, "\r\n0\r\n\r\n", 7);
+            len += 7;
+        }
+        archive->done = 1;
+        send->buf_len = len;
+        send->buf_sent = 0;
+        return 1;
+    }
+
+    tar_member_t *member = &archive->members[archive->next++];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", archive->dir, member->name);
+    shared_file_t *file;
+    int error = http_open_file(path, &file);
+    if (error != 0) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(error));
+        return -1;
+    }
+    if (file->size != member->size) {
+        if (!archive->chunked) {
+            //the Content-Length already promised the old size
+            fprintf(stderr, "%s changed size while being archived\n", path);
+            http_release_file(file);
+            return -1;
+        }
+        member->size = file->size;
+    }
+    //start reading ahead while the header goes out, sendfile() blocks on
+    //whatever is not cached by then
+    posix_fadvise(file->fd, 0, member->size, POSIX_FADV_WILLNEED);
+    //without a mapping the send loop can't tell, and sends it regardless
+    if (member->size > 0) {
+        archive->map = mmap(NULL, member->size, PROT_READ, MAP_SHARED, file->fd, 0);
+        if (archive->map == MAP_FAILED) {
+            archive->map = NULL;
+        }
+        archive->map_len = member->size;
+    }
+    archive->pad = (TAR_BLOCK - member->size % TAR_BLOCK) % TAR_BLOCK;
+    if (archive->chunked) {
+        len += sprintf(buf + len, "%llx\r\n",
+                       (unsigned long long)(TAR_BLOCK + member->size + archive->pad));
+    }
+    member_header(buf + len, member);
+    len += TAR_BLOCK;
+
+    send->file = file;
+    send->file_fd = file->fd;
+    send->map = archive->map;
+    send->use_sendfile = 1;
+    send->end = member->size;
+    send->buf_len = len;
+    send->buf_sent = 0;
+    return 1;
+}
+
+static void archive_free(http_parts_t *parts) {
+    tar_archive_t *archive = (tar_archive_t *)parts;
+    unmap_member(archive);
+    for (size_t i = 0; i < archive->n_members; i++) {
+        free(archive->members[i].name);
+    }
+    free(archive->members);
+    free(archive->dir);
+    free(archive);
+}
+
+// Adds the files a query asks for
+// Returns 0 on success or an errno
+static int add_query(tar_archive_t *archive, char *query) {
+    char *files = NULL;
+    char *prefix = NULL;
+    char *save;
+    for (char *param = strtok_r(query, "&", &save); param != NULL; param = strtok_r(NULL, "&", &save)) {
+        char *value = strchr(param, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        }
+        if (strcmp(param, "files") == 0 && value != NULL) {
+            files = value;
+        } else if (strcmp(param, "prefix") == 0 && value != NULL) {
+            prefix = value;
+        } else if (strcmp(param, "chunked") == 0) {
+            archive->chunked = value == NULL || strcmp(value, "0") != 0;
+        } else {
+            return EINVAL;
+        }
+    }
+    if ((files == NULL) == (prefix == NULL)) {
+        return EINVAL;
+    }
+
+    size_t capacity = 0;
+    int error;
+    if (files != NULL) {
+        //split before decoding, so names can hold an escaped ','
+        for (char *name = strtok_r(files, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+            if (percent_decode(name) != 0) {
+                return EINVAL;
+            }
+            name += strspn(name, "/");
+            if (!path_is_safe(name, 0)) {
+                return EINVAL;
+            }
+            if ((error = add_file(archive, &capacity, name)) != 0) {
+                return error;
+            }
+        }
+        return archive->n_members > 0 ? 0 : EINVAL;
+    }
+
+    if (percent_decode(prefix) != 0) {
+        return EINVAL;
+    }
+    prefix += strspn(prefix, "/");
+    if (prefix[0] != '\0' && !path_is_safe(prefix, 1)) {
+        return EINVAL;
+    }
+    if ((error = add_tree(archive, &capacity, "", prefix)) != 0) {
+        return error;
+    }
+    if (archive->n_members == 0) {
+        return ENOENT;
+    }
+    qsort(archive->members, archive->n_members, sizeof(tar_member_t), compare_members);
+    return 0;
+}
+
+int tar_archive_open(tar_archive_t **archive, const char *dir, const char *query) {
+    //an exception to the request path not allocating (see conn_pool.h): the
+    //member list has no useful bound below TAR_MAX_FILES, so archives come
+    //from the heap and are freed with the response
+    tar_archive_t *fresh = calloc(1, sizeof(tar_archive_t));
+    char *params = strdup(query);
+    if (fresh == NULL || params == NULL || (fresh->dir = strdup(dir)) == NULL) {
+        free(fresh);
+        free(params);
+        return ENOMEM;
+    }
+    fresh->parts.next = archive_next;
+    fresh->parts.free = archive_free;
+    int error = add_query(fresh, params);
+    free(params);
+    if (error != 0) {
+        archive_free(&fresh->parts);
+        return error;
+    }
+    *archive = fresh;
+    return 0;
+}
+
+uint64_t tar_archive_size(const tar_archive_t *archive) {
+    uint64_t size = 2 * TAR_BLOCK;
+    for (size_t i = 0; i < archive->n_members; i++) {
+        size += TAR_BLOCK + (archive->members[i].size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+    return size;
+}
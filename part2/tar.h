@@ -0,0 +1,74 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "http.h"
+
+/*
+ * Tar archives of served files, built while they are sent (see
+ * write_tar_response). Each member is a ustar header generated in memory
+ * followed by the file itself, sent with sendfile(), so a client that needs
+ * a whole set of files gets them in one response instead of one connection
+ * per file. Members are only opened by threads allowed to wait for the disk,
+ * and each is mapped so that the send loop can tell whether sendfile() would.
+ */
+
+#define TAR_RESOURCE "/_tar"        // Resource name of archive requests
+#define TAR_BLOCK 512
+#define TAR_MAX_FILES 4096          // Most files one archive may hold
+
+// One file in an archive
+typedef struct {
+    char *name;                 // Relative to the served directory
+    off_t size;
+    mode_t mode;
+    time_t mtime;
+} tar_member_t;
+
+// An archive being sent. Its parts are handed to the response (see
+// http_parts_t): one per member, then the end-of-archive blocks.
+typedef struct tar_archive {
+    http_parts_t parts;         // First, the response only knows the parts
+    char *dir;                  // Directory the member names are relative to
+    tar_member_t *members;      // Sorted by name
+    size_t n_members;
+    size_t next;                // Member the next part starts
+    off_t pad;                  // Zeros owed after the member being sent
+    void *map;                  // The member being sent, mapped, or NULL
+    size_t map_len;
+    int chunked;                // Frame every part as a chunk
+    int done;                   // The end-of-archive blocks were loaded
+} tar_archive_t;
+
+/*
+ * Returns 1 if a requested resource is an archive request, 0 otherwise
+ * resource_name: The resource from the request line, query included
+ */
+int tar_is_request(const char *resource_name);
+
+/*
+ * List the files an archive request asks for. The query holds either
+ * files=<path>,<path>... or prefix=<path>, the latter taking every regular
+ * file whose path starts with it (an empty prefix takes them all), and may
+ * add chunked=1 to send the archive with chunked transfer encoding. Values
+ * may be percent-encoded.
+ * archive: Set to the new archive on success
+ * dir: The directory paths are relative to
+ * query: The query string, without the '?'
+ * Returns 0 on success, ENOENT if a listed file does not exist or no file
+ * matches the prefix, EINVAL if the query is malformed or names a path that
+ * leaves the directory, E2BIG if there are more than TAR_MAX_FILES files,
+ * ENAMETOOLONG if a path does not fit a ustar header, or another errno
+ */
+int tar_archive_open(tar_archive_t **archive, const char *dir, const char *query);
+
+/*
+ * Returns the size of an archive in bytes, not counting chunk framing
+ * archive: The archive
+ */
+uint64_t tar_archive_size(const tar_archive_t *archive);
+
+#endif // TAR_H
@@ -0,0 +1,335 @@
+#! /usr/bin/env python3
+
+# Talks HTTP/2 to a running http_server over a raw socket and prints one line
+# per check, for testius to compare: several streams on one connection, flow
+# control stalls and WINDOW_UPDATE, a malformed frame, the per-stream rate
+# limit, and a busy connection giving up its worker while others wait.
+#
+# Usage: h2_test.py <port> [rate-limit]
+# With "rate-limit" only the rate limit check runs, against a server started
+# with -r <rate>:2 and a rate too low to refill during the test.
+
+import socket
+import struct
+import sys
+import threading
+import time
+
+PREFACE = b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+DATA, HEADERS, RST_STREAM, SETTINGS, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION = 0, 1, 3, 4, 6, 7, 8, 9
+END_STREAM, ACK, END_HEADERS = 0x1, 0x1, 0x4
+SETTINGS_INITIAL_WINDOW_SIZE = 0x4
+ERROR_NAMES = {0: "NO_ERROR", 1: "PROTOCOL_ERROR", 3: "FLOW_CONTROL_ERROR", 6: "FRAME_SIZE_ERROR",
+               7: "REFUSED_STREAM", 9: "COMPRESSION_ERROR"}
+DEFAULT_WINDOW = 65535
+MAX_WINDOW = 0x7fffffff
+STALL_SEC = 0.3
+TIMEOUT_SEC = 5
+N_WORKERS = 5
+SERVER_FILES = "server_files/"
+
+STATIC_TABLE = [
+    (":authority", ""), (":method", "GET"), (":method", "POST"), (":path", "/"),
+    (":path", "/index.html"), (":scheme", "http"), (":scheme", "https"), (":status", "200"),
+    (":status", "204"), (":status", "206"), (":status", "304"), (":status", "400"),
+    (":status", "404"), (":status", "500"), ("accept-charset", ""),
+    ("accept-encoding", "gzip, deflate"), ("accept-language", ""), ("accept-ranges", ""),
+    ("accept", ""), ("access-control-allow-origin", ""), ("age", ""), ("allow", ""),
+    ("authorization", ""), ("cache-control", ""), ("content-disposition", ""),
+    ("content-encoding", ""), ("content-language", ""), ("content-length", ""),
+    ("content-location", ""), ("content-range", ""), ("content-type", ""), ("cookie", ""),
+    ("date", ""), ("etag", ""), ("expect", ""), ("expires", ""), ("from", ""), ("host", ""),
+    ("if-match", ""), ("if-modified-since", ""), ("if-none-match", ""), ("if-range", ""),
+    ("if-unmodified-since", ""), ("last-modified", ""), ("link", ""), ("location", ""),
+    ("max-forwards", ""), ("proxy-authenticate", ""), ("proxy-authorization", ""), ("range", ""),
+    ("referer", ""), ("refresh", ""), ("retry-after", ""), ("server", ""), ("set-cookie", ""),
+    ("strict-transport-security", ""), ("transfer-encoding", ""), ("user-agent", ""),
+    ("vary", ""), ("via", ""), ("www-authenticate", ""),
+]
+
+
+class Decoder:
+    """HPACK decoder for the server's header blocks, which are never Huffman coded"""
+
+    def __init__(self):
+        self.table = []
+        self.max_size = 4096
+
+    def size(self):
+        return sum(len(n) + len(v) + 32 for n, v in self.table)
+
+    def insert(self, name, value):
+        self.table.insert(0, (name, value))
+        while self.size() > self.max_size:
+            self.table.pop()
+
+    def lookup(self, index):
+        if index <= len(STATIC_TABLE):
+            return STATIC_TABLE[index - 1]
+        return self.table[index - len(STATIC_TABLE) - 1]
+
+    @staticmethod
+    def integer(block, pos, prefix_bits):
+        mask = (1 << prefix_bits) - 1
+        value = block[pos] & mask
+        pos += 1
+        if value == mask:
+            shift = 0
+            while True:
+                b = block[pos]
+                pos += 1
+                value += (b & 0x7f) << shift
+                shift += 7
+                if not b & 0x80:
+                    break
+        return value, pos
+
+    def string(self, block, pos):
+        if block[pos] & 0x80:
+            raise ValueError("unexpected Huffman coded string")
+        length, pos = self.integer(block, pos, 7)
+        return block[pos:pos + length].decode(), pos + length
+
+    def decode(self, block):
+        headers = []
+        pos = 0
+        while pos < len(block):
+            b = block[pos]
+            if b & 0x80:
+                index, pos = self.integer(block, pos, 7)
+                headers.append(self.lookup(index))
+            elif b & 0xe0 == 0x20:
+                self.max_size, pos = self.integer(block, pos, 5)
+                while self.size() > self.max_size:
+                    self.table.pop()
+            else:
+                indexing = b & 0xc0 == 0x40
+                index, pos = self.integer(block, pos, 6 if indexing else 4)
+                if index == 0:
+                    name, pos = self.string(block, pos)
+                else:
+                    name = self.lookup(index)[0]
+                value, pos = self.string(block, pos)
+                if indexing:
+                    self.insert(name, value)
+                headers.append((name, value))
+        return headers
+
+
+def literal(name, value):
+    """A header as a literal without indexing, with a literal name"""
+    name, value = name.encode(), value.encode()
+    return bytes([0, len(name)]) + name + bytes([len(value)]) + value
+
+
+class Response:
+    def __init__(self):
+        self.status = None
+        self.headers = []
+        self.body = b""
+        self.ended = False
+        self.reset = None
+
+
+class Connection:
+    """A prior knowledge HTTP/2 connection"""
+
+    def __init__(self, port, settings=None):
+        self.sock = socket.create_connection(("localhost", port), timeout=TIMEOUT_SEC)
+        self.decoder = Decoder()
+        self.buf = b""
+        self.responses = {}
+        self.goaway = None
+        self.closed = False
+        self.next_stream = 1
+        payload = b"".join(struct.pack(">HI", k, v) for k, v in (settings or {}).items())
+        self.sock.sendall(PREFACE + self.frame(SETTINGS, 0, 0, payload))
+
+    @staticmethod
+    def frame(type, flags, stream_id, payload):
+        return struct.pack(">I", len(payload))[1:] + struct.pack(">BBI", type, flags, stream_id) + payload
+
+    def send(self, type, flags, stream_id, payload):
+        self.sock.sendall(self.frame(type, flags, stream_id, payload))
+
+    def request(self, path):
+        stream_id = self.next_stream
+        self.next_stream += 2
+        block = bytes([0x82, 0x86]) + literal(":path", path) + literal(":authority", "localhost")
+        self.send(HEADERS, END_HEADERS | END_STREAM, stream_id, block)
+        self.responses[stream_id] = Response()
+        return stream_id
+
+    def window_update(self, stream_id, increment):
+        self.send(WINDOW_UPDATE, 0, stream_id, struct.pack(">I", increment))
+
+    def read_frame(self, timeout):
+        """Returns the next frame, or None if none arrived in time or the server closed"""
+        deadline = time.monotonic() + timeout
+        while len(self.buf) < 9 or len(self.buf) < 9 + int.from_bytes(self.buf[:3], "big"):
+            left = deadline - time.monotonic()
+            if left <= 0 or self.closed:
+                return None
+            self.sock.settimeout(left)
+            try:
+                chunk = self.sock.recv(65536)
+            except socket.timeout:
+                return None
+            except ConnectionResetError:
+                chunk = b""
+            if not chunk:
+                self.closed = True
+                return None
+            self.buf += chunk
+        length = int.from_bytes(self.buf[:3], "big")
+        type, flags, stream_id = struct.unpack(">BBI", self.buf[3:9])
+        payload = self.buf[9:9 + length]
+        self.buf = self.buf[9 + length:]
+        return type, flags, stream_id & 0x7fffffff, payload
+
+    def handle(self, frame):
+        type, flags, stream_id, payload = frame
+        response = self.responses.get(stream_id)
+        if type == HEADERS and response is not None:
+            response.headers = self.decoder.decode(payload)
+            response.status = dict(response.headers).get(":status")
+        elif type == DATA and response is not None:
+            response.body += payload
+        elif type == RST_STREAM and response is not None:
+            response.reset = ERROR_NAMES.get(struct.unpack(">I", payload)[0], "unknown")
+            response.ended = True
+        elif type == SETTINGS and not flags & ACK:
+            self.send(SETTINGS, ACK, 0, b"")
+        elif type == PING and not flags & ACK:
+            self.send(PING, ACK, 0, payload)
+        elif type == GOAWAY:
+            self.goaway = ERROR_NAMES.get(struct.unpack(">I", payload[4:8])[0], "unknown")
+        if type in (HEADERS, DATA) and flags & END_STREAM and response is not None:
+            response.ended = True
+
+    def pump(self, timeout, until=None):
+        """Handles frames until 'until' holds or nothing arrives for 'timeout' seconds"""
+        while until is None or not until():
+            frame = self.read_frame(timeout)
+            if frame is None:
+                return
+            self.handle(frame)
+
+    def wait_all(self):
+        self.pump(TIMEOUT_SEC, lambda: all(r.ended for r in self.responses.values()))
+
+    def close(self):
+        self.sock.close()
+
+
+def file_bytes(name):
+    with open(SERVER_FILES + name, "rb") as f:
+        return f.read()
+
+
+def check_streams(port):
+    names = ["quote.txt", "index.html", "gatsby.txt", "nothere"]
+    conn = Connection(port, {SETTINGS_INITIAL_WINDOW_SIZE: MAX_WINDOW})
+    conn.window_update(0, MAX_WINDOW - DEFAULT_WINDOW)
+    streams = [conn.request("/" + name) for name in names]
+    conn.wait_all()
+    statuses = " ".join(str(conn.responses[s].status) for s in streams)
+    bodies = all(conn.responses[s].body == file_bytes(name)
+                 for s, name in zip(streams, names) if conn.responses[s].status == "200")
+    print(f"{len(names)} streams on one connection: {statuses}, bodies match: {'yes' if bodies else 'no'}")
+    conn.close()
+
+
+def check_flow_control(port):
+    expected = file_bytes("gatsby.txt")
+    conn = Connection(port, {SETTINGS_INITIAL_WINDOW_SIZE: 1000})
+    stream = conn.request("/gatsby.txt")
+    response = conn.responses[stream]
+    conn.pump(STALL_SEC)
+    print(f"stream window of 1000: stalled after {len(response.body)} bytes")
+    conn.window_update(stream, 5000)
+    conn.pump(STALL_SEC)
+    print(f"stream WINDOW_UPDATE of 5000: stalled after {len(response.body)} bytes")
+    conn.window_update(stream, len(expected))
+    conn.pump(STALL_SEC)
+    print(f"stream window opened: stalled after {len(response.body)} bytes (connection window)")
+    conn.window_update(0, len(expected))
+    conn.wait_all()
+    print(f"connection WINDOW_UPDATE: body complete and matches: {'yes' if response.body == expected else 'no'}")
+    conn.close()
+
+
+def check_malformed(port):
+    conn = Connection(port)
+    #a SETTINGS payload must be a multiple of 6 bytes
+    conn.send(SETTINGS, 0, 0, b"\x00\x04\x00\x00\x10")
+    conn.pump(TIMEOUT_SEC, lambda: conn.goaway is not None)
+    conn.pump(STALL_SEC)
+    print(f"SETTINGS of 5 bytes: GOAWAY {conn.goaway}, connection closed: {'yes' if conn.closed else 'no'}")
+    conn.close()
+
+
+def check_rate_limit(port):
+    conn = Connection(port)
+    streams = [conn.request("/quote.txt") for _ in range(4)]
+    conn.wait_all()
+    statuses = " ".join(str(conn.responses[s].status) for s in streams)
+    print(f"4 streams with a burst of 2: {statuses}")
+    conn.close()
+
+
+def check_yield(port):
+    """Holds every worker with a connection that keeps opening streams and
+    checks that an HTTP/1 request still gets one"""
+    stop = threading.Event()
+    started = threading.Barrier(N_WORKERS + 1)
+    gave_up = []
+
+    def busy():
+        conn = Connection(port)
+        stream = conn.request("/quote.txt")
+        conn.pump(TIMEOUT_SEC, lambda: conn.responses[stream].ended)
+        started.wait()
+        while not stop.is_set() and conn.goaway is None and not conn.closed:
+            try:
+                stream = conn.request("/quote.txt")
+            except (BrokenPipeError, ConnectionResetError):
+                conn.closed = True
+                break
+            conn.pump(TIMEOUT_SEC, lambda: conn.responses[stream].ended or conn.goaway is not None)
+        #a reset can discard the GOAWAY before it is read, leaving only the close
+        if conn.goaway == "NO_ERROR" or (conn.goaway is None and conn.closed):
+            gave_up.append(conn)
+        conn.close()
+
+    threads = [threading.Thread(target=busy) for _ in range(N_WORKERS)]
+    for thread in threads:
+        thread.start()
+    started.wait()
+    status = "none"
+    try:
+        with socket.create_connection(("localhost", port), timeout=TIMEOUT_SEC / 2) as sock:
+            sock.sendall(b"GET /quote.txt HTTP/1.0\r\n\r\n")
+            status = sock.recv(64).split(b" ")[1].decode()
+    except (socket.timeout, IndexError):
+        pass
+    stop.set()
+    for thread in threads:
+        thread.join()
+    print(f"HTTP/1 request while every worker serves a busy HTTP/2 connection: {status}")
+    print(f"a busy connection gave up its worker: {'yes' if gave_up else 'no'}")
+
+
+def main():
+    port = int(sys.argv[1])
+    if sys.argv[2:] == ["rate-limit"]:
+        check_rate_limit(port)
+        return
+    check_streams(port)
+    check_flow_control(port)
+    check_malformed(port)
+    check_yield(port)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,51 @@
+#! /bin/bash
+
+# Fetches a file over HTTP/2 with prior knowledge and with an Upgrade: h2c
+# request, then runs h2_test.py against the server for the checks curl cannot
+# make: several streams on one connection, flow control, a malformed frame,
+# busy connections giving up their workers and the per-stream rate limit.
+
+target_file="gatsby.txt"
+
+# Starts the server with the given extra arguments and waits for it to listen
+start_server() {
+    ./http_server server_files $PORT "$@" &
+    http_server_pid=$!
+    for i in $(seq 50)
+    do
+        if ss -Hltn "sport = :$PORT" | grep -q .; then
+            break
+        fi
+        sleep 0.1
+    done
+}
+
+stop_server() {
+    kill -INT $http_server_pid
+    wait $http_server_pid
+}
+
+rm -rf downloaded_files
+mkdir -p downloaded_files
+echo "Starting HTTP Server"
+start_server
+
+version=$(curl -s -S --http2-prior-knowledge -w "%{http_version} %{http_code}" \
+    -o downloaded_files/$target_file http://localhost:$PORT/$target_file)
+echo "prior knowledge: HTTP/$version"
+diff -q server_files/$target_file downloaded_files/$target_file
+
+rm -f downloaded_files/$target_file
+version=$(curl -s -S --http2 -w "%{http_version} %{http_code}" \
+    -o downloaded_files/$target_file http://localhost:$PORT/$target_file)
+echo "Upgrade: h2c: HTTP/$version"
+diff -q server_files/$target_file downloaded_files/$target_file
+
+python3 test_cases/resources/h2_test.py $PORT
+stop_server
+
+# A rate this low does not refill during the test, leaving the burst of 2
+start_server -r 0.001:2
+python3 test_cases/resources/h2_test.py $PORT rate-limit
+stop_server
+echo "Server has terminated"
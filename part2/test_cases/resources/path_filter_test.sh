@@ -0,0 +1,49 @@
+#! /bin/bash
+
+# Runs the server with the path filter (-n) on a copy of server_files and
+# checks that it answers a missing file, an existing one, a file created
+# while it runs and a path with dot segments like the file system would.
+
+root=test_results/path_filter_root
+
+# Prints the status of a request, without normalizing the path
+status() {
+    curl -s -S --path-as-is -o /dev/null -w "%{http_code}" http://localhost:$PORT$1
+}
+
+rm -rf $root
+mkdir -p test_results
+cp -r server_files $root
+mkdir $root/sub
+echo "Starting HTTP Server"
+./http_server $root $PORT -n &
+http_server_pid=$!
+for i in $(seq 50)
+do
+    if ss -Hltn "sport = :$PORT" | grep -q .; then
+        break
+    fi
+    sleep 0.1
+done
+
+echo "missing file: $(status /nothere.txt)"
+echo "existing file: $(status /quote.txt)"
+echo "file not created yet: $(status /created.txt)"
+echo "created while serving" > $root/created.txt
+# The watcher adds the file as soon as inotify reports it
+for i in $(seq 50)
+do
+    result=$(status /created.txt)
+    if [ "$result" = "200" ]; then
+        break
+    fi
+    sleep 0.1
+done
+echo "file created while serving: $result"
+echo "dot segment: $(status /./quote.txt)"
+echo "dot-dot segment: $(status /sub/../quote.txt)"
+
+kill -INT $http_server_pid
+wait $http_server_pid
+echo "Server has terminated"
+rm -rf $root
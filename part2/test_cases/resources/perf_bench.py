@@ -0,0 +1,240 @@
+#! /usr/bin/env python3
+
+# Drives a fixed HTTP/1.0 workload against a running http_server over
+# loopback, records throughput and latency percentiles to a JSON results file
+# and compares them against a baseline measured on the same machine.
+#
+# Usage: perf_bench.py <port> [--baseline FILE] [--local-baseline FILE]
+#                             [--reference FILE] [--results FILE]
+#                             [--clients N] [--requests N] [--record | --no-check]
+#        perf_bench.py --has-local-baseline [--local-baseline FILE]
+# Exits with status 1 if any metric regressed beyond the baseline tolerance,
+# or if there is nothing to compare against.
+# The checked-in baseline file holds the tolerances and the commit of the
+# reference server. The numbers they apply to are either the results of that
+# reference server, measured on the same machine just before (--reference,
+# see perf_test.sh), or a local baseline file a maintainer recorded on this
+# machine with --record, which takes precedence.
+# PERF_TOLERANCE / PERF_LATENCY_TOLERANCE in the environment override the
+# tolerances stored in the baseline file.
+# Diagnostics go to stderr, and only when a check fails.
+
+import argparse
+import json
+import os
+import platform
+import socket
+import sys
+import threading
+import time
+
+FILES = [
+    "quote.txt",
+    "headers.html",
+    "index.html",
+    "courses.txt",
+    "mt2_practice.pdf",
+    "gatsby.txt",
+    "africa.jpg",
+    "ocelot.jpg",
+    "hard_drive.png",
+    "Lec01.pdf",
+]
+RECV_SIZE = 65536
+SOCKET_TIMEOUT_SEC = 10
+
+
+def fetch(port, name):
+    """Fetch one file, returning (latency in seconds, body bytes)"""
+    start = time.perf_counter()
+    with socket.create_connection(("localhost", port), timeout=SOCKET_TIMEOUT_SEC) as sock:
+        sock.sendall(f"GET /{name} HTTP/1.0\r\nHost: localhost\r\n\r\n".encode())
+        chunks = []
+        while True:
+            chunk = sock.recv(RECV_SIZE)
+            if not chunk:
+                break
+            chunks.append(chunk)
+    elapsed = time.perf_counter() - start
+    response = b"".join(chunks)
+    header, _, body = response.partition(b"\r\n\r\n")
+    if not header.startswith(b"HTTP/1.0 200"):
+        raise RuntimeError(f"bad response for {name}: {header[:40]!r}")
+    for line in header.split(b"\r\n"):
+        if line.lower().startswith(b"content-length:") and int(line.split(b":")[1]) != len(body):
+            raise RuntimeError(f"short body for {name}")
+    return elapsed, len(body)
+
+
+def client(port, idx, n_requests, latencies, totals, errors):
+    n_bytes = 0
+    for i in range(n_requests):
+        name = FILES[(idx + i) % len(FILES)]
+        try:
+            elapsed, size = fetch(port, name)
+        except (OSError, RuntimeError) as e:
+            errors.append(str(e))
+            continue
+        latencies.append(elapsed)
+        n_bytes += size
+    totals.append(n_bytes)
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    rank = min(len(sorted_values) - 1, int(round(pct / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[rank]
+
+
+def run_workload(port, n_clients, n_requests):
+    latencies = []
+    totals = []
+    errors = []
+    threads = [threading.Thread(target=client, args=(port, i, n_requests, latencies, totals, errors))
+               for i in range(n_clients)]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    duration = time.perf_counter() - start
+    latencies.sort()
+    return {
+        "clients": n_clients,
+        "requests": len(latencies),
+        "errors": len(errors),
+        "duration_sec": round(duration, 3),
+        "requests_per_sec": round(len(latencies) / duration, 1),
+        "mb_per_sec": round(sum(totals) / duration / 2**20, 1),
+        "latency_ms": {
+            "p50": round(percentile(latencies, 50) * 1000, 3),
+            "p90": round(percentile(latencies, 90) * 1000, 3),
+            "p99": round(percentile(latencies, 99) * 1000, 3),
+            "max": round(latencies[-1] * 1000 if latencies else 0.0, 3),
+        },
+    }, errors
+
+
+def machine():
+    """Identifies the machine a local baseline was measured on"""
+    return {"host": platform.node(), "cpus": os.cpu_count()}
+
+
+def load_local_baseline(path):
+    """Returns the results recorded on this machine, or None"""
+    try:
+        with open(path) as f:
+            local = json.load(f)
+    except (OSError, ValueError):
+        return None
+    if local.get("machine") != machine():
+        return None
+    return local
+
+
+def load_reference(path):
+    """Returns the results measured on the reference server, or None"""
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        return None
+
+
+def record_local_baseline(path, results):
+    local = dict(results)
+    local["machine"] = machine()
+    os.makedirs(os.path.dirname(path) or ".", exist_ok=True)
+    with open(path, "w") as f:
+        json.dump(local, f, indent=4)
+        f.write("\n")
+
+
+def compare(results, reference, tolerances):
+    """Returns a list of (metric, passed, detail) tuples"""
+    tolerance = float(os.environ.get("PERF_TOLERANCE", tolerances.get("tolerance", 0.5)))
+    latency_tolerance = float(os.environ.get("PERF_LATENCY_TOLERANCE",
+                                             tolerances.get("latency_tolerance", 1.0)))
+    checks = []
+    for metric in ("requests_per_sec", "mb_per_sec"):
+        floor = reference[metric] * (1 - tolerance)
+        checks.append((metric, results[metric] >= floor,
+                       f"{results[metric]} (baseline {reference[metric]}, minimum {floor:.1f})"))
+    for pct in ("p50", "p90", "p99"):
+        ceiling = reference["latency_ms"][pct] * (1 + latency_tolerance)
+        measured = results["latency_ms"][pct]
+        checks.append((f"latency {pct}", measured <= ceiling,
+                       f"{measured} ms (baseline {reference['latency_ms'][pct]} ms, maximum {ceiling:.3f} ms)"))
+    return checks
+
+
+def main():
+    parser = argparse.ArgumentParser(description="http_server performance regression test")
+    parser.add_argument("port", type=int, nargs="?")
+    parser.add_argument("--baseline", default="test_cases/perf_baseline.json",
+                        help="tolerances and reference commit")
+    parser.add_argument("--local-baseline", default="test_cases/perf_baseline.local.json",
+                        help="results a maintainer recorded on this machine")
+    parser.add_argument("--reference", help="results of the reference server, measured on this machine")
+    parser.add_argument("--results", default="test_results/perf_results.json")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--requests", type=int, default=200, help="requests per client")
+    parser.add_argument("--record", action="store_true",
+                        help="record this run as the machine's baseline instead of checking it")
+    parser.add_argument("--no-check", action="store_true",
+                        help="only write the results, as for the reference server")
+    parser.add_argument("--has-local-baseline", action="store_true",
+                        help="exit with status 0 if this machine has a recorded baseline")
+    args = parser.parse_args()
+    if args.has_local_baseline:
+        return 0 if load_local_baseline(args.local_baseline) is not None else 1
+    if args.port is None:
+        parser.error("the port is required")
+    with open(args.baseline) as f:
+        tolerances = json.load(f)
+
+    reference = None
+    if not args.record and not args.no_check:
+        reference = load_local_baseline(args.local_baseline)
+        if reference is None and args.reference is not None:
+            reference = load_reference(args.reference)
+        if reference is None:
+            #never fall back to comparing the code under test with itself
+            print("baseline: FAIL (nothing to compare against: no baseline recorded on this machine "
+                  "and no reference results; run perf_test.sh, which measures the reference server, "
+                  "or make perf-baseline)")
+            return 1
+
+    results, errors = run_workload(args.port, args.clients, args.requests)
+    os.makedirs(os.path.dirname(args.results) or ".", exist_ok=True)
+    with open(args.results, "w") as f:
+        json.dump(results, f, indent=4)
+        f.write("\n")
+
+    passed = True
+    if errors:
+        print(f"errors: FAIL ({len(errors)} failed requests, first: {errors[0]})")
+        passed = False
+    else:
+        print("errors: PASS")
+    if args.record:
+        if passed:
+            record_local_baseline(args.local_baseline, results)
+            print(f"Recorded baseline in {args.local_baseline}")
+        return 0 if passed else 1
+    if args.no_check:
+        return 0 if passed else 1
+    for metric, ok, detail in compare(results, reference, tolerances):
+        if ok:
+            print(f"{metric}: PASS")
+        else:
+            print(f"{metric}: FAIL {detail}")
+            passed = False
+    if not passed:
+        print(json.dumps(results, indent=4), file=sys.stderr)
+    return 0 if passed else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
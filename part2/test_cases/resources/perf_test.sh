@@ -0,0 +1,77 @@
+#! /bin/bash
+
+# Starts the server, drives the perf_bench.py workload against it and checks
+# the results against a baseline from this machine. Results are written to
+# test_results/perf_results.json. Arguments are passed on to perf_bench.py,
+# e.g. --record to record the machine's baseline.
+#
+# Unless a maintainer recorded a baseline on this machine (make perf-baseline),
+# the baseline is measured here first: the server of the commit pinned in
+# test_cases/perf_baseline.json is built from git and run through the same
+# workload, so that checkouts on any machine compare against the same code.
+
+reference_dir=test_results/perf_reference
+reference_results=test_results/perf_reference.json
+
+# Starts a server binary and waits for it to answer
+start_server() {
+    $1 server_files $PORT &
+    http_server_pid=$!
+    for i in $(seq 50)
+    do
+        if curl -s -o /dev/null http://localhost:$PORT/quote.txt; then
+            break
+        fi
+        sleep 0.1
+    done
+}
+
+stop_server() {
+    kill -INT $http_server_pid
+    wait $http_server_pid
+}
+
+# Builds the reference server and measures it, quietly: the output has to be
+# the same whichever baseline is used
+measure_reference() {
+    commit=$(python3 -c 'import json, sys; print(json.load(open(sys.argv[1]))["reference_commit"])' \
+        test_cases/perf_baseline.json)
+    if [ "$(cat $reference_dir/commit 2>/dev/null)" != "$commit" ]; then
+        rm -rf $reference_dir
+        mkdir -p $reference_dir
+        if ! git archive $commit . 2>/dev/null | tar -x -C $reference_dir 2>/dev/null || ! make -C $reference_dir http_server > /dev/null 2>&1; then
+            echo "reference server: FAIL (cannot build commit $commit from git; record a baseline with make perf-baseline instead)"
+            return 1
+        fi
+        echo $commit > $reference_dir/commit
+    fi
+    start_server $reference_dir/http_server > /dev/null 2>&1
+    python3 test_cases/resources/perf_bench.py $PORT --no-check --results $reference_results > /dev/null
+    status=$?
+    stop_server > /dev/null 2>&1
+    if [ $status -ne 0 ]; then
+        echo "reference server: FAIL (the workload failed against commit $commit)"
+        return 1
+    fi
+}
+
+bench_args=( "$@" )
+if [[ " $* " != *" --record "* ]] && ! python3 test_cases/resources/perf_bench.py --has-local-baseline; then
+    mkdir -p test_results
+    if ! measure_reference; then
+        exit 1
+    fi
+    bench_args+=( --reference $reference_results )
+fi
+
+echo "Starting HTTP Server"
+start_server ./http_server
+
+echo "Running benchmark"
+python3 test_cases/resources/perf_bench.py $PORT "${bench_args[@]}"
+bench_status=$?
+
+echo "Sending SIGINT to trigger server shutdown"
+stop_server
+echo "Server has terminated"
+exit $bench_status
@@ -0,0 +1,103 @@
+#! /usr/bin/env python3
+
+# Sends PROXY protocol v2 headers to a running http_server over its Unix
+# socket and prints one line per check, for testius to compare: TCP over IPv4
+# and IPv6, the LOCAL command, TLVs after the addresses, a header sent in
+# pieces, a bad signature and a truncated header, and rate limits keyed on the
+# address the header carries.
+#
+# Usage: proxy_test.py <socket path>
+# The server must be started with -P and -r <rate>:2, with a rate too low to
+# refill during the test.
+
+import socket
+import struct
+import sys
+import time
+
+SIGNATURE = b"\r\n\r\n\x00\r\nQUIT\n"
+CMD_LOCAL, CMD_PROXY = 0x20, 0x21
+FAMILY_UNSPEC, FAMILY_TCP4, FAMILY_TCP6 = 0x00, 0x11, 0x21
+PP2_TYPE_ALPN, PP2_TYPE_AUTHORITY = 0x01, 0x02
+REQUEST = b"GET /quote.txt HTTP/1.0\r\n\r\n"
+TIMEOUT_SEC = 5
+
+
+def header(command, family, addresses=b"", tlvs=b""):
+    block = addresses + tlvs
+    return SIGNATURE + struct.pack(">BBH", command, family, len(block)) + block
+
+
+def tcp4(src, dst="192.0.2.1", src_port=40000, dst_port=80):
+    return socket.inet_pton(socket.AF_INET, src) + socket.inet_pton(socket.AF_INET, dst) + \
+        struct.pack(">HH", src_port, dst_port)
+
+
+def tcp6(src, dst="2001:db8::ffff", src_port=40000, dst_port=80):
+    return socket.inet_pton(socket.AF_INET6, src) + socket.inet_pton(socket.AF_INET6, dst) + \
+        struct.pack(">HH", src_port, dst_port)
+
+
+def tlv(type, value):
+    return struct.pack(">BH", type, len(value)) + value
+
+
+def exchange(path, pieces, shut_write=False):
+    """Sends the pieces with a short pause between them, then reads until the
+    server closes. Returns the response status, or "closed" if the server
+    closed without answering"""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.settimeout(TIMEOUT_SEC)
+        sock.connect(path)
+        try:
+            for i, piece in enumerate(pieces):
+                if i > 0:
+                    time.sleep(0.05)
+                sock.sendall(piece)
+            if shut_write:
+                sock.shutdown(socket.SHUT_WR)
+            response = b""
+            while True:
+                data = sock.recv(4096)
+                if not data:
+                    break
+                response += data
+        except (BrokenPipeError, ConnectionResetError):
+            return "closed"
+        except socket.timeout:
+            return "timeout"
+    if not response:
+        return "closed"
+    return response.split(b" ")[1].decode()
+
+
+def main():
+    path = sys.argv[1]
+    proxy4 = header(CMD_PROXY, FAMILY_TCP4, tcp4("10.1.0.1"))
+    print(f"TCP4: {exchange(path, [proxy4 + REQUEST])}")
+    print(f"TCP6: {exchange(path, [header(CMD_PROXY, FAMILY_TCP6, tcp6('2001:db8:1::1')) + REQUEST])}")
+    print(f"LOCAL: {exchange(path, [header(CMD_LOCAL, FAMILY_UNSPEC) + REQUEST])}")
+    tlvs = tlv(PP2_TYPE_ALPN, b"http/1.1") + tlv(PP2_TYPE_AUTHORITY, b"example.com" * 30)
+    print(f"TCP4 with TLVs: {exchange(path, [header(CMD_PROXY, FAMILY_TCP4, tcp4('10.2.0.1'), tlvs) + REQUEST])}")
+    split = header(CMD_PROXY, FAMILY_TCP4, tcp4("10.3.0.1"))
+    print(f"header in pieces: {exchange(path, [split[:5], split[5:14], split[14:20], split[20:] + REQUEST])}")
+
+    print(f"no PROXY header: {exchange(path, [REQUEST])}")
+    bad = b"\r\n\r\n\x00\r\nQUIT\r" + proxy4[12:]
+    print(f"bad signature: {exchange(path, [bad + REQUEST])}")
+    print(f"unknown command: {exchange(path, [header(0x2f, FAMILY_TCP4, tcp4('10.4.0.1')) + REQUEST])}")
+    print(f"truncated header: {exchange(path, [proxy4[:20]], shut_write=True)}")
+    print(f"truncated addresses: {exchange(path, [proxy4[:-4]], shut_write=True)}")
+
+    #a burst of 2 per address, and the LOCAL connections above are not limited
+    limited = header(CMD_PROXY, FAMILY_TCP4, tcp4("10.5.0.1"))
+    statuses = " ".join(exchange(path, [limited + REQUEST]) for _ in range(3))
+    print(f"3 requests from 10.5.0.1: {statuses}")
+    print(f"then 10.6.0.1: {exchange(path, [header(CMD_PROXY, FAMILY_TCP4, tcp4('10.6.0.1')) + REQUEST])}")
+    limited6 = header(CMD_PROXY, FAMILY_TCP6, tcp6("2001:db8:5::1"))
+    statuses = " ".join(exchange(path, [limited6 + REQUEST]) for _ in range(3))
+    print(f"3 requests from 2001:db8:5::1: {statuses}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,27 @@
+#! /bin/bash
+
+# Runs the server with a Unix socket whose clients start with a PROXY protocol
+# v2 header (-u, -P) and a per-address rate limit, then runs proxy_test.py
+# against the socket.
+
+socket_path=test_results/proxy_test.sock
+
+rm -f $socket_path
+mkdir -p test_results
+echo "Starting HTTP Server"
+# A rate this low does not refill during the test, leaving the burst of 2
+./http_server server_files -u $socket_path -P -r 0.001:2 &
+http_server_pid=$!
+for i in $(seq 50)
+do
+    if [ -S $socket_path ]; then
+        break
+    fi
+    sleep 0.1
+done
+
+python3 -u test_cases/resources/proxy_test.py $socket_path
+
+kill -INT $http_server_pid
+wait $http_server_pid
+echo "Server has terminated"
@@ -0,0 +1,85 @@
+#! /bin/bash
+
+# Runs the server under concurrent_open.so with latency injection and an
+# in-flight cap, fetches a few files at once, and checks the summary the shim
+# writes at exit against what was served.
+
+target_files=(
+    "quote.txt"
+    "index.html"
+    "gatsby.txt"
+    "africa.jpg"
+    "Lec01.pdf"
+)
+open_latency_us=5000
+read_latency_us=2000
+max_inflight=2
+summary=test_results/shim_summary.txt
+
+rm -rf downloaded_files
+mkdir -p downloaded_files test_results
+rm -f $summary
+echo "Starting HTTP Server"
+CONCURRENT_OPEN_DEGREE=1 SHIM_OPEN_LATENCY=fixed:$open_latency_us SHIM_READ_LATENCY=fixed:$read_latency_us \
+    SHIM_MAX_INFLIGHT=$max_inflight SHIM_SUMMARY=$summary LD_PRELOAD=./concurrent_open.so \
+    ./http_server server_files $PORT &
+http_server_pid=$!
+
+# Wait for the server to start listening, without a request that would
+# open a server file
+for i in $(seq 50)
+do
+    if ss -Hltn "sport = :$PORT" | grep -q .; then
+        break
+    fi
+    sleep 0.1
+done
+
+curl_pids=( )
+for target_file in ${target_files[@]}
+do
+    curl -s -S http://localhost:$PORT/$target_file > downloaded_files/$target_file &
+    curl_pids+=($!)
+done
+for curl_pid in ${curl_pids[@]}
+do
+    wait $curl_pid
+done
+echo "All HTTP responses received"
+
+echo "Sending SIGINT to trigger server shutdown"
+kill -INT $http_server_pid
+wait $http_server_pid
+echo "Server has terminated"
+
+total_bytes=0
+for target_file in ${target_files[@]}
+do
+    diff -q server_files/$target_file downloaded_files/$target_file
+    total_bytes=$((total_bytes + $(stat -c %s server_files/$target_file)))
+done
+
+# Each value follows the last ':' of its summary line
+value() {
+    grep "$1" $summary | sed 's/.*: *//'
+}
+opens=$(value "server file opens")
+reads=$(value "server file reads")
+injected_ms=$(value "injected latency")
+echo "server file opens: $opens"
+if [ "$(value "bytes read")" -eq $total_bytes ]; then
+    echo "bytes read match the files served: yes"
+else
+    echo "bytes read match the files served: no ($(value "bytes read") of $total_bytes)"
+fi
+expected_ms=$(( (opens * open_latency_us + reads * read_latency_us) / 1000 ))
+if [ "${injected_ms%.*}" -ge $expected_ms ]; then
+    echo "latency injected into every open and read: yes"
+else
+    echo "latency injected into every open and read: no ($injected_ms ms, expected $expected_ms ms)"
+fi
+if [ "$(value "max concurrent opens")" -le $max_inflight ] && [ "$(value "max concurrent reads")" -le $max_inflight ]; then
+    echo "in-flight cap held: yes"
+else
+    echo "in-flight cap held: no"
+fi
@@ -0,0 +1,62 @@
+#! /bin/bash
+
+# Fetches tar archives of server_files by prefix, by a list of files and with
+# chunked transfer encoding, extracts them with tar and compares the contents
+# with the originals, then checks that paths leaving the served directory and
+# encoded NUL bytes are refused.
+
+dir=test_results/tar_test
+
+# Fetches /_tar?<query>, extracts it into $dir/<name> and compares it with
+# server_files
+fetch() {
+    local name=$1
+    local query=$2
+    mkdir -p $dir/$name
+    status=$(curl -s -S -o $dir/$name.tar -w "%{http_code}" "http://localhost:$PORT/_tar?$query")
+    if ! tar -xf $dir/$name.tar -C $dir/$name; then
+        echo "$name: $status, could not extract"
+        return
+    fi
+    local members=$(ls $dir/$name | wc -l)
+    local result="matches"
+    for file in $(ls $dir/$name)
+    do
+        if ! cmp -s $dir/$name/$file server_files/$file; then
+            result="differs"
+        fi
+    done
+    echo "$name: $status, $members members, $result"
+}
+
+# Prints the status of a request for /_tar?<query>
+status() {
+    curl -s -S -o /dev/null -w "%{http_code}" "http://localhost:$PORT/_tar?$1"
+}
+
+rm -rf $dir
+mkdir -p $dir
+echo "Starting HTTP Server"
+./http_server server_files $PORT &
+http_server_pid=$!
+for i in $(seq 50)
+do
+    if ss -Hltn "sport = :$PORT" | grep -q .; then
+        break
+    fi
+    sleep 0.1
+done
+
+fetch prefix "prefix="
+fetch files "files=quote.txt,gatsby.txt,Lec01.pdf"
+fetch chunked "prefix=&chunked=1"
+echo "every file in the prefix archive: $(diff -r -q $dir/prefix server_files > /dev/null && echo yes || echo no)"
+echo "files with ..: $(status "files=../http.c")"
+echo "prefix with ..: $(status "prefix=..")"
+echo "files with %00: $(status "files=quote.txt%00")"
+echo "prefix with %00: $(status "prefix=%00")"
+
+kill -INT $http_server_pid
+wait $http_server_pid
+echo "Server has terminated"
+rm -rf $dir
@@ -0,0 +1,19 @@
+#ifndef TIMEUTIL_H
+#define TIMEUTIL_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Nanoseconds on the monotonic clock
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Milliseconds on the monotonic clock
+static inline long monotonic_ms(void) {
+    return (long)(monotonic_ns() / 1000000ull);
+}
+
+#endif // TIMEUTIL_H
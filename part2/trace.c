@@ -0,0 +1,97 @@
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "timeutil.h"
+
+static FILE *trace_file;
+static uint64_t trace_start_ns;
+
+int trace_open(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    //records are small, let stdio batch them into large writes
+    if (setvbuf(file, NULL, _IOFBF, TRACE_BUFSIZE) != 0) {
+        perror("setvbuf");
+        fclose(file);
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.start_unix_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        perror("fwrite");
+        fclose(file);
+        return -1;
+    }
+    trace_start_ns = monotonic_ns();
+    trace_file = file;
+    return 0;
+}
+
+uint64_t trace_now(void) {
+    if (trace_file == NULL) {
+        return 0;
+    }
+    return monotonic_ns() - trace_start_ns;
+}
+
+void trace_write(trace_record_t *record, const char *path) {
+    char buf[sizeof(trace_record_t) + TRACE_PATH_MAX];
+    if (trace_file == NULL) {
+        return;
+    }
+    size_t path_len = strnlen(path, TRACE_PATH_MAX);
+    record->path_len = path_len;
+    memcpy(buf, record, sizeof(*record));
+    memcpy(buf + sizeof(*record), path, path_len);
+    //a single fwrite per record, stdio's lock keeps records whole
+    if (fwrite(buf, sizeof(*record) + path_len, 1, trace_file) != 1) {
+        perror("trace fwrite");
+    }
+}
+
+void trace_close(void) {
+    if (trace_file == NULL) {
+        return;
+    }
+    if (fclose(trace_file) != 0) {
+        perror("fclose");
+    }
+    trace_file = NULL;
+}
+
+int trace_read_header(FILE *file, trace_header_t *header) {
+    if (fread(header, sizeof(*header), 1, file) != 1) {
+        fprintf(stderr, "Trace too short\n");
+        return -1;
+    }
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRACE_VERSION || header->record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "Not a version %d request trace\n", TRACE_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+int trace_read(FILE *file, trace_record_t *record, char path[TRACE_PATH_MAX + 1]) {
+    size_t n = fread(record, 1, sizeof(*record), file);
+    if (n == 0 && feof(file)) {
+        return 0;
+    }
+    if (n != sizeof(*record) || record->path_len > TRACE_PATH_MAX ||
+        fread(path, 1, record->path_len, file) != record->path_len) {
+        fprintf(stderr, "Truncated or corrupt trace record\n");
+        return -1;
+    }
+    path[record->path_len] = '\0';
+    return 1;
+}
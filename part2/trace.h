@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Request traces (-t <file>) for replaying real traffic with trace_replay.
+ *
+ * A trace is a trace_header_t followed by one record per finished response,
+ * in the order they finished. Each record is a trace_record_t followed by
+ * path_len bytes of the request path (not NUL terminated). All integers are
+ * in host byte order.
+ */
+
+#define TRACE_MAGIC "HTTPTRC1"
+#define TRACE_VERSION 1
+#define TRACE_PATH_MAX 512
+#define TRACE_BUFSIZE 65536
+
+#define TRACE_FLAG_H2 0x1           // The request was a stream of an HTTP/2 connection
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(trace_record_t)
+    uint64_t start_unix_ns;     // Wall clock time capture started
+} trace_header_t;
+
+typedef struct {
+    uint64_t arrival_ns;        // Accept time, relative to the start of capture
+    uint64_t service_ns;        // Time from accept until the response was done
+    uint64_t response_bytes;    // Header and body bytes written
+    uint32_t conn_id;           // Accept order, shared by the streams of an HTTP/2 connection
+    uint32_t client_id;         // Hash of the client address, groups connections
+    uint16_t status;            // HTTP status, 0 if no response was started
+    uint16_t completed;         // Set if the whole response was written
+    uint16_t path_len;
+    uint16_t flags;             // TRACE_FLAG_* bits
+} trace_record_t;
+
+/*
+ * Start writing a trace. Until this is called trace_write() is a no-op.
+ * path: File to write, replaced if it exists
+ * Returns 0 on success or -1 on error
+ */
+int trace_open(const char *path);
+
+/*
+ * Returns the time since trace_open(), the clock arrival times are on, or
+ * 0 if no trace is being written
+ */
+uint64_t trace_now(void);
+
+/*
+ * Append one record. Safe to call from any thread.
+ * record: The record, its path_len is filled in from path
+ * path: The request path
+ */
+void trace_write(trace_record_t *record, const char *path);
+
+/*
+ * Flush and close the trace
+ */
+void trace_close(void);
+
+/*
+ * Read and check the header of a trace
+ * file: The trace, positioned at its start
+ * header: Filled with the header
+ * Returns 0 on success or -1 on error
+ */
+int trace_read_header(FILE *file, trace_header_t *header);
+
+/*
+ * Read the next record of a trace
+ * file: The trace
+ * record: Filled with the record
+ * path: Filled with the NUL terminated request path
+ * Returns 1 if a record was read, 0 at the end of the trace or -1 on error
+ */
+int trace_read(FILE *file, trace_record_t *record, char path[TRACE_PATH_MAX + 1]);
+
+#endif // TRACE_H
@@ -0,0 +1,764 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "hpack.h"
+#include "timeutil.h"
+#include "trace.h"
+
+#define DEFAULT_CLIENTS 64
+#define RESPONSE_BUFSIZE 65536
+
+// The few HTTP/2 (RFC 7540) pieces a replay client needs
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER_LEN 9
+#define H2_HEADER_BLOCK_MAX 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+
+// One recorded request and the outcome of replaying it
+typedef struct {
+    trace_record_t record;
+    char *path;
+    int status;                 // Status replayed, 0 if the request failed
+    uint64_t bytes;             // Bytes received
+    uint64_t latency_ns;        // Connect until the server closed the connection
+    uint64_t late_ns;           // How far behind schedule the request started
+    uint64_t sent_ns;           // When its HEADERS frame went out, HTTP/2 only
+    int done;                   // HTTP/2 only: answered, reset or given up on
+    int h2;                     // Replayed as a stream of an HTTP/2 connection
+} replay_request_t;
+
+// Requests that the server saw on one connection: a single HTTP/1 request,
+// or the streams of an HTTP/2 connection
+typedef struct {
+    size_t first;               // Index of its first request
+    size_t n;
+} replay_conn_t;
+
+replay_request_t *requests;
+size_t n_requests;
+replay_conn_t *conns;
+size_t n_conns;
+size_t next_conn;
+pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct addrinfo *server_addr;
+const char *host = "127.0.0.1";
+double speed = 1.0;
+uint64_t replay_start_ns;
+
+// Orders requests by arrival, then accept order
+int compare_arrival(const void *a, const void *b) {
+    const trace_record_t *x = &((const replay_request_t *)a)->record;
+    const trace_record_t *y = &((const replay_request_t *)b)->record;
+    if (x->arrival_ns != y->arrival_ns) {
+        return x->arrival_ns < y->arrival_ns ? -1 : 1;
+    }
+    return x->conn_id < y->conn_id ? -1 : x->conn_id > y->conn_id;
+}
+
+// Orders requests by connection, then arrival
+int compare_conn(const void *a, const void *b) {
+    const trace_record_t *x = &((const replay_request_t *)a)->record;
+    const trace_record_t *y = &((const replay_request_t *)b)->record;
+    if (x->conn_id != y->conn_id) {
+        return x->conn_id < y->conn_id ? -1 : 1;
+    }
+    return x->arrival_ns < y->arrival_ns ? -1 : x->arrival_ns > y->arrival_ns;
+}
+
+// Orders connections by the arrival of their first request
+int compare_conn_arrival(const void *a, const void *b) {
+    const replay_conn_t *x = a;
+    const replay_conn_t *y = b;
+    return compare_arrival(&requests[x->first], &requests[y->first]);
+}
+
+int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Loads every record that carries a request path and groups them into
+// connections, sorted by the arrival of their first request
+// Returns 0 on success or -1 on error
+int load_trace(const char *path, size_t *n_skipped) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    trace_header_t header;
+    if (trace_read_header(file, &header) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    size_t capacity = 1024;
+    requests = malloc(capacity * sizeof(replay_request_t));
+    if (requests == NULL) {
+        perror("malloc");
+        fclose(file);
+        return -1;
+    }
+    trace_record_t record;
+    char request_path[TRACE_PATH_MAX + 1];
+    int result;
+    *n_skipped = 0;
+    while ((result = trace_read(file, &record, request_path)) == 1) {
+        //connections refused before their request was read have no path
+        if (request_path[0] == '\0') {
+            (*n_skipped)++;
+            continue;
+        }
+        if (n_requests == capacity) {
+            capacity *= 2;
+            replay_request_t *grown = realloc(requests, capacity * sizeof(replay_request_t));
+            if (grown == NULL) {
+                perror("realloc");
+                fclose(file);
+                return -1;
+            }
+            requests = grown;
+        }
+        replay_request_t *request = &requests[n_requests++];
+        memset(request, 0, sizeof(*request));
+        request->record = record;
+        request->path = strdup(request_path);
+        if (request->path == NULL) {
+            perror("strdup");
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    if (result == -1) {
+        //a server that was killed may leave half a record at the end
+        fprintf(stderr, "Replaying the %zu records before the damage\n", n_requests);
+    }
+    qsort(requests, n_requests, sizeof(replay_request_t), compare_conn);
+
+    conns = malloc((n_requests > 0 ? n_requests : 1) * sizeof(replay_conn_t));
+    if (conns == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < n_requests; i++) {
+        if (i == 0 || requests[i].record.conn_id != requests[i - 1].record.conn_id) {
+            conns[n_conns].first = i;
+            conns[n_conns].n = 0;
+            n_conns++;
+        }
+        conns[n_conns - 1].n++;
+    }
+    //traces from before TRACE_FLAG_H2 only give away connections with several streams
+    for (size_t i = 0; i < n_conns; i++) {
+        int h2 = conns[i].n > 1;
+        for (size_t j = 0; j < conns[i].n; j++) {
+            h2 |= requests[conns[i].first + j].record.flags & TRACE_FLAG_H2;
+        }
+        for (size_t j = 0; j < conns[i].n; j++) {
+            requests[conns[i].first + j].h2 = h2;
+        }
+    }
+    qsort(conns, n_conns, sizeof(replay_conn_t), compare_conn_arrival);
+    return 0;
+}
+
+// Sends one request on a fresh connection and reads the response to the end
+void replay_one(replay_request_t *request) {
+    char buf[RESPONSE_BUFSIZE];
+    uint64_t start = monotonic_ns();
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if (fd == -1) {
+        perror("socket");
+        return;
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        perror("connect");
+        close(fd);
+        return;
+    }
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", request->path);
+    if (write(fd, buf, len) != len) {
+        perror("write");
+        close(fd);
+        return;
+    }
+    uint64_t total = 0;
+    int status = 0;
+    while (1) {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (total == 0) {
+            buf[n] = '\0';
+            sscanf(buf, "HTTP/%*s %d", &status);
+        }
+        total += n;
+    }
+    close(fd);
+    request->latency_ns = monotonic_ns() - start;
+    request->bytes = total;
+    request->status = status;
+}
+
+// Returns when a request is due, on the monotonic clock
+uint64_t due_ns(const replay_request_t *request) {
+    uint64_t due = replay_start_ns;
+    if (speed > 0) {
+        due += (uint64_t)(request->record.arrival_ns / speed);
+    }
+    return due;
+}
+
+// Sleeps until a request is due, or notes how late it is
+void wait_until_due(replay_request_t *request) {
+    uint64_t due = due_ns(request);
+    uint64_t now = monotonic_ns();
+    if (now < due) {
+        struct timespec until = { .tv_sec = due / 1000000000ull, .tv_nsec = due % 1000000000ull };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+        }
+    } else if (request->late_ns == 0) {
+        request->late_ns = now - due;
+    }
+}
+
+// Writes a frame header
+void put_frame_header(uint8_t *out, size_t len, uint8_t type, uint8_t flags, uint32_t stream_id) {
+    out[0] = len >> 16;
+    out[1] = len >> 8;
+    out[2] = len;
+    out[3] = type;
+    out[4] = flags;
+    out[5] = stream_id >> 24;
+    out[6] = stream_id >> 16;
+    out[7] = stream_id >> 8;
+    out[8] = stream_id;
+}
+
+uint32_t get_u32(const uint8_t *in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+// Writes all of a buffer
+// Returns 0 on success or -1 on error
+int write_all(int fd, const void *buf, size_t len) {
+    const char *pos = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, pos, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("write");
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Records the :status of a response
+int collect_status(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    if (name_len == 7 && memcmp(name, ":status", 7) == 0) {
+        char digits[4] = "";
+        memcpy(digits, value, value_len < 3 ? value_len : 3);
+        *(int *)arg = atoi(digits);
+    }
+    return 0;
+}
+
+// Opens a prior knowledge HTTP/2 connection with windows large enough that
+// the server never waits for a WINDOW_UPDATE
+// Returns the socket, or -1 on error
+int h2_connect(void) {
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    uint8_t out[sizeof(H2_PREFACE) - 1 + 3 * H2_FRAME_HEADER_LEN + 12 + 4];
+    size_t len = sizeof(H2_PREFACE) - 1;
+    memcpy(out, H2_PREFACE, len);
+    put_frame_header(out + len, 12, H2_SETTINGS, 0, 0);
+    len += H2_FRAME_HEADER_LEN;
+    uint8_t settings[12] = { 0, H2_SETTINGS_ENABLE_PUSH, 0, 0, 0, 0,
+                             0, H2_SETTINGS_INITIAL_WINDOW_SIZE, 0x7f, 0xff, 0xff, 0xff };
+    memcpy(out + len, settings, sizeof(settings));
+    len += sizeof(settings);
+    put_frame_header(out + len, 4, H2_WINDOW_UPDATE, 0, 0);
+    len += H2_FRAME_HEADER_LEN;
+    uint32_t increment = H2_MAX_WINDOW - H2_DEFAULT_WINDOW;
+    out[len++] = increment >> 24;
+    out[len++] = increment >> 16;
+    out[len++] = increment >> 8;
+    out[len++] = increment;
+    if (write_all(fd, out, len) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends the HEADERS frame of a GET request
+// Returns 0 on success or -1 on error
+int h2_send_request(int fd, hpack_table_t *encoder, uint32_t stream_id, const char *path) {
+    uint8_t frame[H2_FRAME_HEADER_LEN + H2_HEADER_BLOCK_MAX];
+    uint8_t *block = frame + H2_FRAME_HEADER_LEN;
+    size_t cap = H2_HEADER_BLOCK_MAX;
+    const char *fields[4][2] = { { ":method", "GET" }, { ":scheme", "http" },
+                                 { ":path", path }, { ":authority", host } };
+    size_t len = 0;
+    for (int i = 0; i < 4; i++) {
+        int n = hpack_encode(encoder, block + len, cap - len, fields[i][0], fields[i][1], 0);
+        if (n < 0) {
+            fprintf(stderr, "Request headers for %s do not fit a frame\n", path);
+            return -1;
+        }
+        len += n;
+    }
+    put_frame_header(frame, len, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, stream_id);
+    return write_all(fd, frame, H2_FRAME_HEADER_LEN + len);
+}
+
+// Replays the streams of one HTTP/2 connection on one connection, each at its
+// recorded time. Streams the server did not process before a GOAWAY are sent
+// again on a new connection, as a browser would.
+void replay_h2(replay_conn_t *conn) {
+    replay_request_t *streams = &requests[conn->first];
+    uint8_t in[H2_FRAME_HEADER_LEN + RESPONSE_BUFSIZE];
+    uint8_t block[H2_HEADER_BLOCK_MAX];
+    size_t remaining = conn->n;
+
+    while (remaining > 0) {
+        //don't hold an idle connection open until the first stream is due
+        size_t first = 0;
+        while (streams[first].done) {
+            first++;
+        }
+        wait_until_due(&streams[first]);
+        int fd = h2_connect();
+        if (fd == -1) {
+            return;
+        }
+        hpack_table_t encoder;
+        hpack_table_t decoder;
+        hpack_table_init(&encoder);
+        hpack_table_init(&decoder);
+        //stream i of this connection is request sent[i]
+        size_t sent[conn->n];
+        size_t n_sent = 0;
+        size_t n_open = 0;
+        size_t next = 0;
+        size_t in_len = 0;
+        size_t block_len = 0;
+        uint32_t block_stream = 0;
+        uint32_t goaway_last = UINT32_MAX;
+        size_t progress = remaining;
+        int failed = 0;
+
+        while (!failed && (n_open > 0 || (next < conn->n && goaway_last == UINT32_MAX))) {
+            //send every stream that is due, unless the server is going away
+            while (next < conn->n && goaway_last == UINT32_MAX) {
+                replay_request_t *request = &streams[next];
+                if (request->done) {
+                    next++;
+                    continue;
+                }
+                uint64_t now = monotonic_ns();
+                if (now < due_ns(request)) {
+                    break;
+                }
+                wait_until_due(request);
+                request->sent_ns = now;
+                if (h2_send_request(fd, &encoder, 2 * n_sent + 1, request->path) != 0) {
+                    failed = 1;
+                    break;
+                }
+                sent[n_sent++] = next++;
+                n_open++;
+            }
+            if (failed) {
+                break;
+            }
+
+            int timeout = -1;
+            if (next < conn->n && goaway_last == UINT32_MAX) {
+                uint64_t due = due_ns(&streams[next]);
+                uint64_t now = monotonic_ns();
+                timeout = due > now ? (int)((due - now) / 1000000 + 1) : 0;
+            } else if (n_open == 0) {
+                break;
+            }
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            int ready = poll(&pfd, 1, timeout);
+            if (ready < 0 && errno != EINTR) {
+                perror("poll");
+                failed = 1;
+            }
+            if (ready <= 0) {
+                continue;
+            }
+            ssize_t n = read(fd, in + in_len, sizeof(in) - in_len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            in_len += n;
+
+            //handle every complete frame
+            size_t pos = 0;
+            while (!failed && in_len - pos >= H2_FRAME_HEADER_LEN) {
+                uint8_t *frame = in + pos;
+                size_t len = (size_t)frame[0] << 16 | (size_t)frame[1] << 8 | frame[2];
+                uint8_t type = frame[3];
+                uint8_t flags = frame[4];
+                uint32_t stream_id = get_u32(frame + 5) & 0x7fffffff;
+                if (len > RESPONSE_BUFSIZE) {
+                    fprintf(stderr, "Frame of %zu bytes is too large\n", len);
+                    failed = 1;
+                    break;
+                }
+                if (in_len - pos < H2_FRAME_HEADER_LEN + len) {
+                    break;
+                }
+                uint8_t *payload = frame + H2_FRAME_HEADER_LEN;
+                pos += H2_FRAME_HEADER_LEN + len;
+
+                replay_request_t *request = NULL;
+                if (stream_id != 0 && stream_id % 2 == 1 && (stream_id - 1) / 2 < n_sent) {
+                    request = &streams[sent[(stream_id - 1) / 2]];
+                    if (request->done) {
+                        request = NULL;
+                    }
+                }
+                int end_stream = 0;
+                switch (type) {
+                case H2_DATA:
+                    if (request != NULL) {
+                        request->bytes += H2_FRAME_HEADER_LEN + len;
+                        end_stream = flags & H2_FLAG_END_STREAM;
+                    }
+                    break;
+                case H2_HEADERS:
+                case H2_CONTINUATION: {
+                    size_t start = 0;
+                    size_t end = len;
+                    if (type == H2_HEADERS) {
+                        if (flags & H2_FLAG_PADDED) {
+                            end -= len > 0 ? payload[0] : 0;
+                            start++;
+                        }
+                        if (flags & H2_FLAG_PRIORITY) {
+                            start += 5;
+                        }
+                        block_len = 0;
+                        block_stream = stream_id;
+                    }
+                    if (start > end || end > len || block_len + end - start > sizeof(block)) {
+                        fprintf(stderr, "Malformed header block\n");
+                        failed = 1;
+                        break;
+                    }
+                    memcpy(block + block_len, payload + start, end - start);
+                    block_len += end - start;
+                    if (request != NULL) {
+                        request->bytes += H2_FRAME_HEADER_LEN + len;
+                    }
+                    if (flags & H2_FLAG_END_HEADERS) {
+                        //the table has to follow every block, even of finished streams
+                        int status = 0;
+                        if (hpack_decode(&decoder, block, block_len, collect_status, &status) != 0) {
+                            fprintf(stderr, "Malformed header block\n");
+                            failed = 1;
+                            break;
+                        }
+                        if (request != NULL && stream_id == block_stream) {
+                            request->status = status;
+                        }
+                    }
+                    //HEADERS carries END_STREAM for the whole block
+                    if (type == H2_HEADERS && request != NULL) {
+                        end_stream = flags & H2_FLAG_END_STREAM;
+                    }
+                    break;
+                }
+                case H2_RST_STREAM:
+                    if (request != NULL) {
+                        request->status = 0;
+                        end_stream = 1;
+                    }
+                    break;
+                case H2_SETTINGS:
+                    if (!(flags & H2_FLAG_ACK)) {
+                        uint8_t ack[H2_FRAME_HEADER_LEN];
+                        put_frame_header(ack, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+                        failed = write_all(fd, ack, sizeof(ack)) != 0;
+                    }
+                    break;
+                case H2_PING:
+                    if (!(flags & H2_FLAG_ACK) && len == 8) {
+                        uint8_t pong[H2_FRAME_HEADER_LEN + 8];
+                        put_frame_header(pong, 8, H2_PING, H2_FLAG_ACK, 0);
+                        memcpy(pong + H2_FRAME_HEADER_LEN, payload, 8);
+                        failed = write_all(fd, pong, sizeof(pong)) != 0;
+                    }
+                    break;
+                case H2_GOAWAY:
+                    if (len >= 8) {
+                        goaway_last = get_u32(payload) & 0x7fffffff;
+                    }
+                    break;
+                }
+                if (end_stream) {
+                    request->latency_ns = monotonic_ns() - request->sent_ns;
+                    request->done = 1;
+                    n_open--;
+                    remaining--;
+                }
+            }
+            memmove(in, in + pos, in_len - pos);
+            in_len -= pos;
+        }
+
+        //streams the server gave up on or never answered
+        for (size_t i = 0; i < n_sent; i++) {
+            replay_request_t *request = &streams[sent[i]];
+            if (request->done) {
+                continue;
+            }
+            if (failed || goaway_last == UINT32_MAX || 2 * i + 1 <= goaway_last) {
+                request->status = 0;
+                request->done = 1;
+                remaining--;
+            }
+        }
+        hpack_table_free(&encoder);
+        hpack_table_free(&decoder);
+        close(fd);
+        if (failed || remaining == progress) {
+            //a connection that got nothing done won't do better the next time
+            for (size_t i = 0; i < conn->n; i++) {
+                streams[i].done = 1;
+            }
+            return;
+        }
+    }
+}
+
+// Takes connections in arrival order and issues each request at its recorded
+// time, scaled by the replay speed
+void *client_func(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&next_lock);
+        size_t idx = next_conn++;
+        pthread_mutex_unlock(&next_lock);
+        if (idx >= n_conns) {
+            return NULL;
+        }
+        replay_conn_t *conn = &conns[idx];
+        if (!requests[conn->first].h2) {
+            wait_until_due(&requests[conn->first]);
+            replay_one(&requests[conn->first]);
+        } else {
+            replay_h2(conn);
+        }
+    }
+}
+
+// Prints percentiles of a sorted array of nanosecond values in milliseconds
+void print_percentiles(const char *label, const int64_t *sorted, size_t n) {
+    printf("  %-10s p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f ms\n", label,
+           sorted[n / 2] / 1e6, sorted[n * 90 / 100] / 1e6, sorted[n * 99 / 100] / 1e6,
+           sorted[n - 1] / 1e6);
+}
+
+void report(size_t n_skipped, uint64_t elapsed_ns) {
+    size_t n_failed = 0;
+    size_t n_status_diff = 0;
+    size_t n_bytes_diff = 0;
+    size_t n_late = 0;
+    uint64_t max_late = 0;
+    int64_t *recorded = malloc(n_requests * sizeof(int64_t));
+    int64_t *replayed = malloc(n_requests * sizeof(int64_t));
+    int64_t *delta = malloc(n_requests * sizeof(int64_t));
+    if (recorded == NULL || replayed == NULL || delta == NULL) {
+        perror("malloc");
+        free(recorded);
+        free(replayed);
+        free(delta);
+        return;
+    }
+    size_t n_h2 = 0;
+    size_t n_streams = 0;
+    for (size_t i = 0; i < n_conns; i++) {
+        if (requests[conns[i].first].h2) {
+            n_h2++;
+            n_streams += conns[i].n;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < n_requests; i++) {
+        replay_request_t *request = &requests[i];
+        if (request->late_ns > 1000000) {
+            n_late++;
+        }
+        if (request->late_ns > max_late) {
+            max_late = request->late_ns;
+        }
+        if (request->status == 0) {
+            n_failed++;
+            continue;
+        }
+        if (request->status != request->record.status) {
+            n_status_diff++;
+        }
+        //how DATA frames are cut, and so their header bytes, depends on the client's windows
+        if (request->record.completed && !request->h2 &&
+            request->bytes != request->record.response_bytes) {
+            n_bytes_diff++;
+        }
+        recorded[n] = request->record.service_ns;
+        replayed[n] = request->latency_ns;
+        delta[n] = (int64_t)request->latency_ns - (int64_t)request->record.service_ns;
+        n++;
+    }
+
+    printf("Replayed %zu requests in %.2fs (%zu in the trace had no request)\n",
+           n_requests, elapsed_ns / 1e9, n_skipped);
+    printf("  %zu connections, %zu of them HTTP/2 carrying %zu streams\n", n_conns, n_h2, n_streams);
+    printf("  failed %zu, status differs %zu, size differs %zu (HTTP/1 only), started >1ms late %zu (max %.1fms)\n",
+           n_failed, n_status_diff, n_bytes_diff, n_late, max_late / 1e6);
+    if (n > 0) {
+        qsort(recorded, n, sizeof(int64_t), compare_i64);
+        qsort(replayed, n, sizeof(int64_t), compare_i64);
+        qsort(delta, n, sizeof(int64_t), compare_i64);
+        printf("Latency (recorded is server-side service time, replayed is client-side):\n");
+        print_percentiles("recorded", recorded, n);
+        print_percentiles("replayed", replayed, n);
+        print_percentiles("delta", delta, n);
+    }
+    free(recorded);
+    free(replayed);
+    free(delta);
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [-x <speed>] [-j <clients>] [-h <host>] <trace> <port>\n", program);
+    printf("Replays a trace recorded with http_server -t and compares latencies\n");
+    printf("Requests that shared a connection are replayed as the streams of one HTTP/2 connection\n");
+    printf("  -x <speed>    2 replays twice as fast, 0 as fast as possible (default 1)\n");
+    printf("  -j <clients>  concurrent connections at most (default %d)\n", DEFAULT_CLIENTS);
+    printf("  -h <host>     server host (default 127.0.0.1)\n");
+}
+
+int main(int argc, char **argv) {
+    int n_clients = DEFAULT_CLIENTS;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:j:h:")) != -1) {
+        switch (opt) {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'j':
+            n_clients = atoi(optarg);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || n_clients <= 0 || speed < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    size_t n_skipped;
+    if (load_trace(argv[optind], &n_skipped) != 0) {
+        return 1;
+    }
+    if (n_requests == 0) {
+        fprintf(stderr, "No requests to replay\n");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host, argv[optind + 1], &hints, &server_addr);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return 1;
+    }
+
+    //the first request goes out right away, the rest keep their gaps
+    uint64_t first_arrival = requests[conns[0].first].record.arrival_ns;
+    for (size_t i = 0; i < n_requests; i++) {
+        requests[i].record.arrival_ns -= first_arrival;
+    }
+
+    pthread_t threads[n_clients];
+    int error;
+    replay_start_ns = monotonic_ns();
+    for (int i = 0; i < n_clients; i++) {
+        if ((error = pthread_create(&threads[i], NULL, client_func, NULL)) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            n_clients = i;
+            break;
+        }
+    }
+    for (int i = 0; i < n_clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report(n_skipped, monotonic_ns() - replay_start_ns);
+
+    freeaddrinfo(server_addr);
+    for (size_t i = 0; i < n_requests; i++) {
+        free(requests[i].path);
+    }
+    free(requests);
+    free(conns);
+    return 0;
+}